@@ -0,0 +1,53 @@
+#include "mpc.h"
+
+/*
+** Shared by benchmark.c and stress.c so both time
+** the same grammar over the same input.
+*/
+
+typedef struct {
+  mpc_parser_t* Number;
+  mpc_parser_t* Symbol;
+  mpc_parser_t* Sexpr;
+  mpc_parser_t* Qexpr;
+  mpc_parser_t* Expr;
+  mpc_parser_t* Lispy;
+} bench_grammar_t;
+
+/* Builds the Lispy grammar from lispy.grammar, printing any error */
+static int bench_grammar_new(bench_grammar_t* g, int flags) {
+
+  g->Number = mpc_new("number");
+  g->Symbol = mpc_new("symbol");
+  g->Sexpr  = mpc_new("sexpr");
+  g->Qexpr  = mpc_new("qexpr");
+  g->Expr   = mpc_new("expr");
+  g->Lispy  = mpc_new("lispy");
+
+  mpc_err_t* err = mpca_lang_contents(flags, "lispy.grammar",
+    g->Number, g->Symbol, g->Sexpr, g->Qexpr, g->Expr, g->Lispy, NULL);
+
+  if (err != NULL) {
+    mpc_err_print(err);
+    mpc_err_delete(err);
+    return 0;
+  }
+
+  return 1;
+}
+
+static void bench_grammar_delete(bench_grammar_t* g) {
+  mpc_cleanup(6, g->Number, g->Symbol, g->Sexpr, g->Qexpr, g->Expr, g->Lispy);
+}
+
+/* Builds a long program of nested expressions */
+static char* bench_input(int lines) {
+  const char* line =
+    "(def {fact} (\\ {n} {if (== n 0) {1} {* n (fact (- n 1))}}))"
+    " (fact 10) {head (list 1 2.5 -3 foo_bar)} (+ 1 (* 2 3) (/ 4 5))\n";
+  size_t len = strlen(line);
+  char* input = malloc(len * lines + 1);
+  for (int i = 0; i < lines; i++) { memcpy(input + len * i, line, len); }
+  input[len * lines] = '\0';
+  return input;
+}
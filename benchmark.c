@@ -0,0 +1,59 @@
+#include "bench.h"
+#include <time.h>
+
+/*
+** Times the Lispy grammar parsed by mpca_lang
+** against the same grammar compiled to C by
+** generate.c, and checks they give the same AST.
+**
+**   cc -std=c99 -Wall generate.c mpc.c -lm -o generate
+**   ./generate lispy < lispy.grammar > lispy_parser.c
+**   cc -std=c99 -O2 -Wall benchmark.c lispy_parser.c mpc.c -lm -o benchmark
+**   ./benchmark
+*/
+
+int lispy_parse_lispy(const char* filename, const char* string, mpc_result_t* r);
+
+int main(int argc, char** argv) {
+
+  int lines = argc > 1 ? atoi(argv[1]) : 2000;
+  int runs = argc > 2 ? atoi(argv[2]) : 10;
+
+  bench_grammar_t g;
+  if (!bench_grammar_new(&g, MPC_LANG_DEFAULT)) { return 1; }
+  mpc_parser_t* Lispy = g.Lispy;
+
+  char* input = bench_input(lines);
+  mpc_result_t a, b;
+  int ok = 1;
+
+  /* Both must agree before timing means anything */
+  if (!mpc_parse("<bench>", input, Lispy, &a)) { mpc_err_print(a.error); return 1; }
+  if (!lispy_parse_lispy("<bench>", input, &b)) { mpc_err_print(b.error); return 1; }
+  if (!mpc_ast_eq(a.output, b.output)) { puts("ASTs differ!"); ok = 0; }
+  mpc_ast_delete(a.output);
+  mpc_ast_delete(b.output);
+
+  clock_t start = clock();
+  for (int i = 0; i < runs; i++) {
+    mpc_parse("<bench>", input, Lispy, &a);
+    mpc_ast_delete(a.output);
+  }
+  double interpreted = (double)(clock() - start) / CLOCKS_PER_SEC;
+
+  start = clock();
+  for (int i = 0; i < runs; i++) {
+    lispy_parse_lispy("<bench>", input, &b);
+    mpc_ast_delete(b.output);
+  }
+  double generated = (double)(clock() - start) / CLOCKS_PER_SEC;
+
+  printf("%i lines x %i runs\n", lines, runs);
+  printf("mpca_lang:     %.3fs\n", interpreted);
+  printf("mpca_generate: %.3fs (%.2fx)\n", generated, interpreted / generated);
+
+  free(input);
+  bench_grammar_delete(&g);
+
+  return ok ? 0 : 1;
+}
@@ -0,0 +1,52 @@
+#include "mpc.h"
+
+/*
+** Reads a grammar in the syntax of `mpca_lang` on
+** stdin and writes C source for its parsers to
+** stdout, each called `<prefix>_parse_<rule>`.
+** Any of `predictive`, `whitespace_sensitive` and
+** `packrat` may follow the prefix as flags.
+**
+**   cc -std=c99 -Wall generate.c mpc.c -lm -o generate
+**   ./generate lispy < lispy.grammar > lispy_parser.c
+*/
+
+int main(int argc, char** argv) {
+
+  if (argc < 2) {
+    fprintf(stderr, "Usage: %s <prefix> [flags...] < grammar > parser.c\n", argv[0]);
+    return 1;
+  }
+
+  int flags = MPC_LANG_DEFAULT;
+  for (int i = 2; i < argc; i++) {
+    if (strcmp(argv[i], "predictive") == 0) { flags |= MPC_LANG_PREDICTIVE; }
+    else if (strcmp(argv[i], "whitespace_sensitive") == 0) { flags |= MPC_LANG_WHITESPACE_SENSITIVE; }
+    else if (strcmp(argv[i], "packrat") == 0) { flags |= MPC_LANG_PACKRAT; }
+    else {
+      fprintf(stderr, "Unknown flag '%s'!\n", argv[i]);
+      return 1;
+    }
+  }
+
+  /* Read all of the grammar */
+  size_t len = 0, cap = 4096;
+  char* text = malloc(cap);
+  size_t n;
+  while ((n = fread(text + len, 1, cap - len - 1, stdin)) > 0) {
+    len += n;
+    if (cap - len == 1) { cap *= 2; text = realloc(text, cap); }
+  }
+  text[len] = '\0';
+
+  mpc_err_t* err = mpca_generate(stdout, argv[1], flags, text);
+  free(text);
+
+  if (err != NULL) {
+    mpc_err_print(err);
+    mpc_err_delete(err);
+    return 1;
+  }
+
+  return 0;
+}
@@ -1,5 +1,47 @@
+/*
+** Memory mapping is used for file input where
+** the platform supports it. This needs the POSIX
+** declarations to be visible even when compiling
+** with strict ANSI flags.
+*/
+
+#if defined(__unix__) || defined(__unix) || (defined(__APPLE__) && defined(__MACH__))
+#ifndef _POSIX_C_SOURCE
+#define _POSIX_C_SOURCE 200112L
+#endif
+#define MPC_USE_MMAP
+#endif
+
 #include "mpc.h"
 
+#ifdef MPC_USE_MMAP
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#endif
+
+/*
+** Batches of files are parsed on POSIX threads
+** unless `MPC_NO_THREADS` is defined, in which
+** case they are parsed one after another.
+*/
+
+#if defined(MPC_USE_MMAP) && !defined(MPC_NO_THREADS)
+#define MPC_USE_PTHREADS
+#include <pthread.h>
+#endif
+
+/*
+** Runs of a character class in string input are
+** skipped sixteen bytes at a time where SSE2 is
+** available, which is every x86-64 target.
+*/
+
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#define MPC_USE_SSE2
+#include <emmintrin.h>
+#endif
+
 /*
 ** State Type
 */
@@ -54,6 +96,8 @@ static mpc_err_t *mpc_err_fail(const char *filename, mpc_state_t s, const char *
 void mpc_err_delete(mpc_err_t *x) {
 
   int i;
+  if (x == NULL) { return; }
+  
   for (i = 0; i < x->expected_num; i++) {
     free(x->expected[i]);
   }
@@ -64,6 +108,40 @@ void mpc_err_delete(mpc_err_t *x) {
   free(x);
 }
 
+static mpc_err_t *mpc_err_copy(mpc_err_t *x) {
+  
+  int i;
+  mpc_err_t *y;
+  
+  if (x == NULL) { return NULL; }
+  
+  y = malloc(sizeof(mpc_err_t));
+  y->filename = malloc(strlen(x->filename) + 1);
+  strcpy(y->filename, x->filename);
+  y->state = x->state;
+  y->expected_num = x->expected_num;
+  y->expected = x->expected_num ? malloc(sizeof(char*) * x->expected_num) : NULL;
+  for (i = 0; i < x->expected_num; i++) {
+    y->expected[i] = malloc(strlen(x->expected[i]) + 1);
+    strcpy(y->expected[i], x->expected[i]);
+  }
+  y->failure = NULL;
+  if (x->failure) {
+    y->failure = malloc(strlen(x->failure) + 1);
+    strcpy(y->failure, x->failure);
+  }
+  return y;
+}
+
+static mpc_err_t *mpc_err_at(mpc_err_t *x, const char *filename, mpc_state_t s) {
+  mpc_err_t *y = mpc_err_copy(x);
+  free(y->filename);
+  y->filename = malloc(strlen(filename) + 1);
+  strcpy(y->filename, filename);
+  y->state = s;
+  return y;
+}
+
 static int mpc_err_contains_expected(mpc_err_t *x, char *expected) {
   
   int i;
@@ -116,13 +194,13 @@ void mpc_err_string_cat(char *buffer, int *pos, int *max, char *fmt, ...) {
   va_end(va);
 }
 
-static char char_unescape_buffer[3];
-
-static char *mpc_err_char_unescape(char c) {
+/* Printable characters are quoted into `buffer`, which must hold four */
+static char *mpc_err_char_unescape(char c, char *buffer) {
   
-  char_unescape_buffer[0] = '\'';
-  char_unescape_buffer[1] = ' ';
-  char_unescape_buffer[2] = '\'';
+  buffer[0] = '\'';
+  buffer[1] = ' ';
+  buffer[2] = '\'';
+  buffer[3] = '\0';
   
   switch (c) {
     
@@ -136,8 +214,8 @@ static char *mpc_err_char_unescape(char c) {
     case '\t': return "tab";
     case ' ' : return "space";
     default:
-      char_unescape_buffer[1] = c;
-      return char_unescape_buffer;
+      buffer[1] = c;
+      return buffer;
   }
   
 }
@@ -145,6 +223,7 @@ static char *mpc_err_char_unescape(char c) {
 char *mpc_err_string(mpc_err_t *x) {
   
   char *buffer = calloc(1, 1024);
+  char unescaped[4];
   int max = 1023;
   int pos = 0; 
   int i;
@@ -174,7 +253,7 @@ char *mpc_err_string(mpc_err_t *x) {
   }
   
   mpc_err_string_cat(buffer, &pos, &max, " at ");
-  mpc_err_string_cat(buffer, &pos, &max, mpc_err_char_unescape(x->state.next));
+  mpc_err_string_cat(buffer, &pos, &max, "%s", mpc_err_char_unescape(x->state.next, unescaped));
   mpc_err_string_cat(buffer, &pos, &max, "\n");
   
   return realloc(buffer, strlen(buffer) + 1);
@@ -220,7 +299,11 @@ static mpc_err_t *mpc_err_or(mpc_err_t** x, int n) {
 static mpc_err_t *mpc_err_repeat(mpc_err_t *x, const char *prefix) {
 
   int i;
-  char *expect = malloc(strlen(prefix) + 1);
+  char *expect;
+  
+  if (x == NULL) { return NULL; }
+  
+  expect = malloc(strlen(prefix) + 1);
   strcpy(expect, prefix);
   
   if (x->expected_num == 1) {
@@ -258,7 +341,9 @@ static mpc_err_t *mpc_err_many1(mpc_err_t *x) {
 static mpc_err_t *mpc_err_count(mpc_err_t *x, int n) {
   mpc_err_t *y;
   int digits = n/10 + 1;
-  char *prefix = malloc(digits + strlen(" of ") + 1);
+  char *prefix;
+  if (x == NULL) { return NULL; }
+  prefix = malloc(digits + strlen(" of ") + 1);
   sprintf(prefix, "%i of ", n);
   y = mpc_err_repeat(x, prefix);
   free(prefix);
@@ -270,13 +355,16 @@ static mpc_err_t *mpc_err_count(mpc_err_t *x, int n) {
 */
 
 /*
-** In mpc the input type has three modes of 
-** operation: String, File and Pipe.
+** In mpc the input type has five modes of 
+** operation: String, File, Pipe, Mmap and Push.
 **
-** String is easy. The whole contents are 
-** loaded into a buffer and scanned through.
-** The cursor can jump around at will making 
-** backtracking easy.
+** String is easy. The contents are scanned
+** through in place - they are borrowed from
+** the caller rather than copied - and the
+** length is stored so checking for the end
+** of input is constant time. The cursor can
+** jump around at will making backtracking
+** easy.
 **
 ** The second is a File which is also somewhat
 ** easy. The contents are never loaded into 
@@ -284,26 +372,48 @@ static mpc_err_t *mpc_err_count(mpc_err_t *x, int n) {
 ** by seeking in the file at different positions.
 **
 ** The final mode is Pipe. This is the difficult
-** one. As we assume pipes cannot be seeked - and 
-** only support a single character lookahead at 
-** any point, when the input is marked for a 
-** potential backtracking we start buffering any 
-** input.
+** one. As we assume pipes cannot be seeked the
+** input is read a character at a time into a
+** buffer which holds everything from the oldest
+** mark onward.
+** The buffer knows its own start position and
+** length so reading a character is just an
+** index into it.
 **
 ** This means that if we are requested to seek
 ** back we can simply start reading from the
-** buffer instead of the input.
+** buffer again. Anything before the oldest mark
+** can never be revisited so it is released when
+** the buffer is next refilled, keeping memory
+** bounded by how far the parser may backtrack
+** rather than by the size of the stream.
 **
 ** Of course using `mpc_predictive` will disable
 ** backtracking and make LL(1) grammars easy
 ** to parse for all input methods.
 **
+** Mmap is used in place of File whenever the
+** file is a regular file and the platform can
+** map it into memory. The mapping is then read
+** exactly like a String - so backtracking is
+** just resetting the position - but nothing is
+** copied and the length is known up front.
+**
+** Push is buffered just like Pipe except the
+** data is handed to us by the caller rather
+** than read. When the buffer runs dry before
+** the end of input has been signalled the input
+** is marked as suspended, and the parser stops
+** where it is until more data is fed in.
+**
 */
 
 enum {
   MPC_INPUT_STRING = 0,
   MPC_INPUT_FILE   = 1,
-  MPC_INPUT_PIPE   = 2
+  MPC_INPUT_PIPE   = 2,
+  MPC_INPUT_MMAP   = 3,
+  MPC_INPUT_PUSH   = 4
 };
 
 typedef struct {
@@ -312,17 +422,28 @@ typedef struct {
   char *filename;  
   mpc_state_t state;
   
-  char *string;
+  const char *string;
   char *buffer;
   FILE *file;
   
+  long buffer_start;
+  size_t buffer_length;
+  size_t buffer_size;
+  int eof;
+  int suspended;
+  
+  char *mapping;
+  size_t mapping_length;
+  size_t length;
+  
   int backtrack;
   int marks_num;
+  int marks_slots;
   mpc_state_t* marks;
   
 } mpc_input_t;
 
-static mpc_input_t *mpc_input_new_string(const char *filename, const char *string) {
+static mpc_input_t *mpc_input_new_nstring(const char *filename, const char *string, size_t length) {
 
   mpc_input_t *i = malloc(sizeof(mpc_input_t));
   
@@ -332,18 +453,31 @@ static mpc_input_t *mpc_input_new_string(const char *filename, const char *strin
   
   i->state = mpc_state_new();
   
-  i->string = malloc(strlen(string) + 1);
-  strcpy(i->string, string);
+  i->string = string;
   i->buffer = NULL;
   i->file = NULL;
+  i->buffer_start = 0;
+  i->buffer_length = 0;
+  i->buffer_size = 0;
+  i->eof = 0;
+  i->suspended = 0;
+  
+  i->mapping = NULL;
+  i->mapping_length = 0;
+  i->length = length;
   
   i->backtrack = 1;
   i->marks_num = 0;
+  i->marks_slots = 0;
   i->marks = NULL;
   
   return i;
 }
 
+static mpc_input_t *mpc_input_new_string(const char *filename, const char *string) {
+  return mpc_input_new_nstring(filename, string, strlen(string));
+}
+
 static mpc_input_t *mpc_input_new_pipe(const char *filename, FILE *pipe) {
 
   mpc_input_t *i = malloc(sizeof(mpc_input_t));
@@ -357,9 +491,51 @@ static mpc_input_t *mpc_input_new_pipe(const char *filename, FILE *pipe) {
   i->string = NULL;
   i->buffer = NULL;
   i->file = pipe;
+  i->buffer_start = 0;
+  i->buffer_length = 0;
+  i->buffer_size = 0;
+  i->eof = 0;
+  i->suspended = 0;
+  
+  i->mapping = NULL;
+  i->mapping_length = 0;
+  i->length = 0;
+  
+  i->backtrack = 1;
+  i->marks_num = 0;
+  i->marks_slots = 0;
+  i->marks = NULL;
+  
+  return i;
+  
+}
+
+static mpc_input_t *mpc_input_new_push(const char *filename) {
+
+  mpc_input_t *i = malloc(sizeof(mpc_input_t));
+  
+  i->filename = malloc(strlen(filename) + 1);
+  strcpy(i->filename, filename);
+  
+  i->type = MPC_INPUT_PUSH;
+  i->state = mpc_state_new();
+  
+  i->string = NULL;
+  i->buffer = NULL;
+  i->file = NULL;
+  i->buffer_start = 0;
+  i->buffer_length = 0;
+  i->buffer_size = 0;
+  i->eof = 0;
+  i->suspended = 0;
+  
+  i->mapping = NULL;
+  i->mapping_length = 0;
+  i->length = 0;
   
   i->backtrack = 1;
   i->marks_num = 0;
+  i->marks_slots = 0;
   i->marks = NULL;
   
   return i;
@@ -378,20 +554,107 @@ static mpc_input_t *mpc_input_new_file(const char *filename, FILE *file) {
   i->string = NULL;
   i->buffer = NULL;
   i->file = file;
+  i->buffer_start = 0;
+  i->buffer_length = 0;
+  i->buffer_size = 0;
+  i->eof = 0;
+  i->suspended = 0;
+  
+  i->mapping = NULL;
+  i->mapping_length = 0;
+  i->length = 0;
+  
+  i->backtrack = 1;
+  i->marks_num = 0;
+  i->marks_slots = 0;
+  i->marks = NULL;
+  
+  return i;
+}
+
+/*
+** Maps the remainder of `file` - from its current
+** position onward - into memory. Returns NULL when
+** this is not possible, such as for pipes, sockets
+** and terminals or on platforms without `mmap`, in
+** which case the caller should fall back to the
+** regular File input.
+*/
+
+static mpc_input_t *mpc_input_new_mmap(const char *filename, FILE *file) {
+
+#ifdef MPC_USE_MMAP
+  
+  mpc_input_t *i;
+  struct stat st;
+  long offset;
+  void *mapping;
+  
+  if (fstat(fileno(file), &st) != 0) { return NULL; }
+  if (!S_ISREG(st.st_mode)) { return NULL; }
+  
+  offset = ftell(file);
+  if (offset < 0 || offset > st.st_size) { return NULL; }
+  
+  if (st.st_size == 0) {
+    mapping = NULL;
+  } else {
+    mapping = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fileno(file), 0);
+    if (mapping == MAP_FAILED) { return NULL; }
+  }
+  
+  i = malloc(sizeof(mpc_input_t));
+  
+  i->filename = malloc(strlen(filename) + 1);
+  strcpy(i->filename, filename);
+  i->type = MPC_INPUT_MMAP;
+  i->state = mpc_state_new();
+  
+  i->mapping = mapping;
+  i->mapping_length = st.st_size;
+  /* An empty file can't be mapped, so it reads as an empty string */
+  i->string = mapping ? (char*)mapping + offset : "";
+  i->length = st.st_size - offset;
+  i->buffer = NULL;
+  i->file = file;
+  i->buffer_start = 0;
+  i->buffer_length = 0;
+  i->buffer_size = 0;
+  i->eof = 0;
+  i->suspended = 0;
   
   i->backtrack = 1;
   i->marks_num = 0;
+  i->marks_slots = 0;
   i->marks = NULL;
   
   return i;
+
+#else
+  
+  return NULL;
+
+#endif
+
 }
 
 static void mpc_input_delete(mpc_input_t *i) {
   
   free(i->filename);
   
-  if (i->type == MPC_INPUT_STRING) { free(i->string); }
-  if (i->type == MPC_INPUT_PIPE) { free(i->buffer); }
+  /* C promises only one character of push back, so anything further is lost */
+  if (i->type == MPC_INPUT_PIPE && i->state.pos < i->buffer_start + (long)i->buffer_length) {
+    ungetc((unsigned char)i->buffer[i->state.pos - i->buffer_start], i->file);
+  }
+  
+  if (i->type == MPC_INPUT_PIPE
+  ||  i->type == MPC_INPUT_PUSH) { free(i->buffer); }
+  
+#ifdef MPC_USE_MMAP
+  if (i->type == MPC_INPUT_MMAP && i->mapping) {
+    munmap(i->mapping, i->mapping_length);
+  }
+#endif
   
   free(i->marks);
   free(i);
@@ -404,14 +667,13 @@ static void mpc_input_mark(mpc_input_t *i) {
   
   if (i->backtrack < 1) { return; }
   
-  i->marks_num++;
-  i->marks = realloc(i->marks, sizeof(mpc_state_t) * i->marks_num);
-  i->marks[i->marks_num-1] = i->state;
-  
-  if (i->type == MPC_INPUT_PIPE && i->marks_num == 1) {
-    i->buffer = calloc(1, 1);
+  if (i->marks_num == i->marks_slots) {
+    i->marks_slots = i->marks_slots * 2 + 16;
+    i->marks = realloc(i->marks, sizeof(mpc_state_t) * i->marks_slots);
   }
   
+  i->marks[i->marks_num++] = i->state;
+  
 }
 
 static void mpc_input_unmark(mpc_input_t *i) {
@@ -419,12 +681,6 @@ static void mpc_input_unmark(mpc_input_t *i) {
   if (i->backtrack < 1) { return; }
   
   i->marks_num--;
-  i->marks = realloc(i->marks, sizeof(mpc_state_t) * i->marks_num);
-  
-  if (i->type == MPC_INPUT_PIPE && i->marks_num == 0) {
-    free(i->buffer);
-    i->buffer = NULL;
-  }
   
 }
 
@@ -441,18 +697,88 @@ static void mpc_input_rewind(mpc_input_t *i) {
   mpc_input_unmark(i);
 }
 
+/*
+** Pipe Buffering
+**
+** Pipes are read through stdio a character at a
+** time, only when the parser asks for one past
+** the end of the buffer. Anything the stream had
+** already buffered is seen, and nothing is taken
+** from it beyond what the parse looked at.
+**
+** When the input is deleted the first character
+** looked at but not consumed is pushed back, as
+** stdio promises no more than one. A parse that
+** backtracked may have looked further, so a pipe
+** parsed more than once should go through a
+** stream, which keeps its buffer between parses.
+*/
+
+enum { MPC_INPUT_CHUNK = 4096 };
+
+static void mpc_input_jump(mpc_input_t *i, mpc_state_t s) {
+  i->state = s;
+  if (i->type == MPC_INPUT_FILE) {
+    fseek(i->file, i->state.pos, SEEK_SET);
+  }
+}
+
 static int mpc_input_buffer_in_range(mpc_input_t *i) {
-  return i->state.pos < (strlen(i->buffer) + i->marks[0].pos);
+  return i->state.pos < i->buffer_start + (long)i->buffer_length;
 }
 
 static char mpc_input_buffer_get(mpc_input_t *i) {
-  return i->buffer[i->state.pos - i->marks[0].pos];
+  return i->buffer[i->state.pos - i->buffer_start];
+}
+
+static void mpc_input_buffer_reserve(mpc_input_t *i, size_t n) {
+  
+  long keep;
+  size_t drop;
+  
+  /* Release everything before the oldest mark once it is at least half the buffer */
+  keep = i->marks_num > 0 ? i->marks[0].pos : i->state.pos;
+  drop = keep - i->buffer_start;
+  if (drop > 0 && drop >= i->buffer_length / 2) {
+    memmove(i->buffer, i->buffer + drop, i->buffer_length - drop);
+    i->buffer_start += drop;
+    i->buffer_length -= drop;
+  }
+  
+  if (i->buffer_size - i->buffer_length < n) {
+    i->buffer_size = i->buffer_size * 2 > i->buffer_length + n
+      ? i->buffer_size * 2 : i->buffer_length + n;
+    i->buffer = realloc(i->buffer, i->buffer_size);
+  }
+  
+}
+
+static int mpc_input_buffer_fill(mpc_input_t *i) {
+  
+  int c;
+  
+  if (i->eof) { return 0; }
+  
+  c = getc(i->file);
+  if (c == EOF) { i->eof = 1; return 0; }
+  
+  mpc_input_buffer_reserve(i, MPC_INPUT_CHUNK);
+  i->buffer[i->buffer_length++] = (char)c;
+  return 1;
+}
+
+static void mpc_input_buffer_feed(mpc_input_t *i, const char *data, size_t n) {
+  mpc_input_buffer_reserve(i, n);
+  memcpy(i->buffer + i->buffer_length, data, n);
+  i->buffer_length += n;
 }
 
 static int mpc_input_terminated(mpc_input_t *i) {
-  if (i->type == MPC_INPUT_STRING && i->state.pos == strlen(i->string)) { return 1; }
+  if (i->type == MPC_INPUT_STRING && (size_t)i->state.pos == i->length) { return 1; }
+  if (i->type == MPC_INPUT_MMAP && (size_t)i->state.pos == i->length) { return 1; }
   if (i->type == MPC_INPUT_FILE && feof(i->file)) { return 1; }
-  if (i->type == MPC_INPUT_PIPE && feof(i->file)) { return 1; }
+  if (i->type == MPC_INPUT_PIPE && i->eof && !mpc_input_buffer_in_range(i)) { return 1; }
+  if (i->type == MPC_INPUT_PUSH && i->eof && !mpc_input_buffer_in_range(i)) { return 1; }
   return 0;
 }
 
@@ -461,16 +787,22 @@ static char mpc_input_getc(mpc_input_t *i) {
   char c;
   switch (i->type) {
     
-    case MPC_INPUT_STRING: c = i->string[i->state.pos]; break;
+    case MPC_INPUT_STRING:
+    case MPC_INPUT_MMAP: c = (size_t)i->state.pos < i->length ? i->string[i->state.pos] : '\0'; break;
     case MPC_INPUT_FILE: c = fgetc(i->file); break;
     case MPC_INPUT_PIPE:
     
-      if (!i->buffer) { c = getc(i->file); break; }
-      
-      if (i->buffer && mpc_input_buffer_in_range(i)) {
+      if (!mpc_input_buffer_in_range(i)) { mpc_input_buffer_fill(i); }
+      c = mpc_input_buffer_in_range(i) ? mpc_input_buffer_get(i) : '\0';
+    
+    break;
+    case MPC_INPUT_PUSH:
+    
+      if (mpc_input_buffer_in_range(i)) {
         c = mpc_input_buffer_get(i);
       } else {
-        c = getc(i->file);
+        if (!i->eof) { i->suspended = 1; }
+        c = '\0';
       }
     
     break;
@@ -483,18 +815,11 @@ static char mpc_input_getc(mpc_input_t *i) {
 static int mpc_input_failure(mpc_input_t *i, char c) {
 
   switch (i->type) {
-    case MPC_INPUT_STRING: break;
-    case MPC_INPUT_FILE: fseek(i->file, -1, SEEK_CUR); break;
+    case MPC_INPUT_STRING:
+    case MPC_INPUT_MMAP:
     case MPC_INPUT_PIPE:
-      
-      if (!i->buffer) { ungetc(c, i->file); break; }
-      
-      if (i->buffer && mpc_input_buffer_in_range(i)) {
-        break;
-      } else {
-        ungetc(c, i->file); 
-      }
-      
+    case MPC_INPUT_PUSH: break;
+    case MPC_INPUT_FILE: fseek(i->file, -1, SEEK_CUR); break;
   }
   
   i->state.next = c;
@@ -503,14 +828,7 @@ static int mpc_input_failure(mpc_input_t *i, char c) {
 
 static int mpc_input_success(mpc_input_t *i, char c, char **o) {
   
-  if (i->type == MPC_INPUT_PIPE &&
-      i->buffer &&
-      !mpc_input_buffer_in_range(i)) {
-    
-    i->buffer = realloc(i->buffer, strlen(i->buffer) + 2);
-    i->buffer[strlen(i->buffer) + 1] = '\0';
-    i->buffer[strlen(i->buffer) + 0] = c;
-  }
+  if (i->suspended) { return 0; }
 
   i->state.pos++;
   i->state.col++;
@@ -551,22 +869,18 @@ static int mpc_input_char(mpc_input_t *i, char c, char **o) {
   return x == c ? mpc_input_success(i, x, o) : mpc_input_failure(i, x);
 }
 
-static int mpc_input_range(mpc_input_t *i, char c, char d, char **o) {
-  char x = mpc_input_getc(i);
-  if (mpc_input_terminated(i)) { i->state.next = '\0'; return 0; }
-  return x >= c && x <= d ? mpc_input_success(i, x, o) : mpc_input_failure(i, x);  
+static int mpc_class_has(const unsigned char *c, char x) {
+  return (c[(unsigned char)x / 8] >> ((unsigned char)x % 8)) & 1;
 }
 
-static int mpc_input_oneof(mpc_input_t *i, const char *c, char **o) {
-  char x = mpc_input_getc(i);
-  if (mpc_input_terminated(i)) { i->state.next = '\0'; return 0; }
-  return strchr(c, x) != 0 ? mpc_input_success(i, x, o) : mpc_input_failure(i, x);  
+static void mpc_class_add(unsigned char *c, char x) {
+  c[(unsigned char)x / 8] |= 1 << ((unsigned char)x % 8);
 }
 
-static int mpc_input_noneof(mpc_input_t *i, const char *c, char **o) {
+static int mpc_input_class(mpc_input_t *i, const unsigned char *c, char **o) {
   char x = mpc_input_getc(i);
   if (mpc_input_terminated(i)) { i->state.next = '\0'; return 0; }
-  return strchr(c, x) == 0 ? mpc_input_success(i, x, o) : mpc_input_failure(i, x);  
+  return mpc_class_has(c, x) ? mpc_input_success(i, x, o) : mpc_input_failure(i, x);
 }
 
 static int mpc_input_satisfy(mpc_input_t *i, int(*cond)(char), char **o) {
@@ -577,14 +891,11 @@ static int mpc_input_satisfy(mpc_input_t *i, int(*cond)(char), char **o) {
 
 static int mpc_input_string(mpc_input_t *i, const char *c, char **o) {
   
-  char *co = NULL;
   const char *x = c;
 
   mpc_input_mark(i);
   while (*x) {
-    if (mpc_input_char(i, *x, &co)) {
-      free(co);
-    } else {
+    if (!mpc_input_char(i, *x, NULL)) {
       mpc_input_rewind(i);
       return 0;
     }
@@ -592,8 +903,10 @@ static int mpc_input_string(mpc_input_t *i, const char *c, char **o) {
   }
   mpc_input_unmark(i);
   
-  *o = malloc(strlen(c) + 1);
-  strcpy(*o, c);
+  if (o) {
+    *o = malloc(strlen(c) + 1);
+    strcpy(*o, c);
+  }
   return 1;
 }
 
@@ -613,30 +926,38 @@ enum {
   MPC_TYPE_EOI       = 7,
   MPC_TYPE_ANY       = 8,
   MPC_TYPE_SINGLE    = 9,
-  MPC_TYPE_ONEOF     = 10,
-  MPC_TYPE_NONEOF    = 11,
-  MPC_TYPE_RANGE     = 12,
-  MPC_TYPE_SATISFY   = 13,
-  MPC_TYPE_STRING    = 14,
-  
-  MPC_TYPE_APPLY     = 15,
-  MPC_TYPE_APPLY_TO  = 16,
-  MPC_TYPE_PREDICT   = 17,
-  MPC_TYPE_NOT       = 18,
-  MPC_TYPE_MAYBE     = 19,
-  MPC_TYPE_MANY      = 20,
-  MPC_TYPE_MANY1     = 21,
-  MPC_TYPE_COUNT     = 22,
-  
-  MPC_TYPE_OR        = 23,
-  MPC_TYPE_AND       = 24
+  MPC_TYPE_CLASS     = 10,
+  MPC_TYPE_SATISFY   = 11,
+  MPC_TYPE_STRING    = 12,
+  
+  MPC_TYPE_APPLY     = 13,
+  MPC_TYPE_APPLY_TO  = 14,
+  MPC_TYPE_PREDICT   = 15,
+  MPC_TYPE_NOT       = 16,
+  MPC_TYPE_MAYBE     = 17,
+  MPC_TYPE_MANY      = 18,
+  MPC_TYPE_MANY1     = 19,
+  MPC_TYPE_COUNT     = 20,
+  
+  MPC_TYPE_OR        = 21,
+  MPC_TYPE_AND       = 22,
+  
+  MPC_TYPE_MEMO      = 23,
+  MPC_TYPE_REGEX     = 24
 };
 
 typedef struct { char *m; } mpc_pdata_fail_t;
 typedef struct { mpc_ctor_t lf; void *x; } mpc_pdata_lift_t;
 typedef struct { mpc_parser_t *x; char *m; } mpc_pdata_expect_t;
 typedef struct { char x; } mpc_pdata_single_t;
-typedef struct { char x; char y; } mpc_pdata_range_t;
+typedef struct {
+  unsigned char x[32];
+  mpc_err_t *err;
+  unsigned char lo[4];
+  unsigned char width[4];
+  char ranges;
+  char negate;
+} mpc_pdata_class_t;
 typedef struct { int(*f)(char); } mpc_pdata_satisfy_t;
 typedef struct { char *x; } mpc_pdata_string_t;
 typedef struct { mpc_parser_t *x; mpc_apply_t f; } mpc_pdata_apply_t;
@@ -644,15 +965,31 @@ typedef struct { mpc_parser_t *x; mpc_apply_to_t f; void *d; } mpc_pdata_apply_t
 typedef struct { mpc_parser_t *x; } mpc_pdata_predict_t;
 typedef struct { mpc_parser_t *x; mpc_dtor_t dx; mpc_ctor_t lf; } mpc_pdata_not_t;
 typedef struct { int n; mpc_fold_t f; mpc_parser_t *x; mpc_dtor_t dx; } mpc_pdata_repeat_t;
-typedef struct { int n; mpc_parser_t **xs; } mpc_pdata_or_t;
+typedef struct { unsigned char chars[32]; char nullable; mpc_err_t *err; } mpc_first_t;
+
+typedef struct { int n; mpc_parser_t **xs; mpc_first_t *first; } mpc_pdata_or_t;
 typedef struct { int n; mpc_fold_t f; mpc_parser_t **xs; mpc_dtor_t *dxs;  } mpc_pdata_and_t;
+typedef struct { mpc_parser_t *x; mpc_copy_t cx; mpc_dtor_t dx; } mpc_pdata_memo_t;
+
+typedef struct { unsigned char chars[32]; char kind; int n; mpc_err_t *err; mpc_err_t *fail; } mpc_regex_item_t;
+
+typedef struct {
+  mpc_parser_t *x;
+  mpc_err_t *soi;
+  int items_num;
+  mpc_regex_item_t *items;
+  int states_num;
+  int *base;
+  int *item;
+  int *table;
+} mpc_pdata_regex_t;
 
 typedef union {
   mpc_pdata_fail_t fail;
   mpc_pdata_lift_t lift;
   mpc_pdata_expect_t expect;
   mpc_pdata_single_t single;
-  mpc_pdata_range_t range;
+  mpc_pdata_class_t class;
   mpc_pdata_satisfy_t satisfy;
   mpc_pdata_string_t string;
   mpc_pdata_apply_t apply;
@@ -662,12 +999,15 @@ typedef union {
   mpc_pdata_repeat_t repeat;
   mpc_pdata_and_t and;
   mpc_pdata_or_t or;
+  mpc_pdata_memo_t memo;
+  mpc_pdata_regex_t regex;
 } mpc_pdata_t;
 
 struct mpc_parser_t {
   char retained;
   char *name;
   char type;
+  int id;
   mpc_pdata_t data;
 };
 
@@ -675,6 +1015,80 @@ struct mpc_parser_t {
 ** Stack Type
 */
 
+/*
+** The results of `mpc_memo` parsers are cached
+** in a table on the stack for the duration of a
+** single parse, keyed on the parser and the
+** position it was run at. Each entry stores a
+** copy of the result, the input state after it,
+** and any errors merged into the stack's error
+** while it ran so that a cached run reports the
+** same errors as a real one.
+**
+** While a memoised parser is running a frame
+** records where it started and holds the error
+** the stack had up to that point.
+**
+** With farthest errors no `mpc_err_t` is built
+** while parsing and every error is just NULL.
+** Instead each failure is checked against the
+** furthest position failed at so far, and what
+** was expected there is kept as pointers to the
+** strings held by the parsers. Failures inside
+** an `mpc_expect` are left out, as its name is
+** what gets reported. Only if the whole parse
+** fails are these copied into an error, which
+** names the same position as a full error but
+** may list fewer of the things expected there.
+*/
+
+typedef struct {
+  mpc_parser_t *parser;
+  long pos;
+  int success;
+  mpc_result_t result;
+  mpc_state_t state;
+  mpc_err_t *err;
+} mpc_memo_t;
+
+typedef struct {
+  long pos;
+  mpc_err_t *err;
+} mpc_memo_frame_t;
+
+/*
+** A flat AST is built in a table of nodes kept by
+** its parse context. While parsing, a node is passed
+** around as its index plus one so that no node is
+** the same as NULL. `starts` holds the input position
+** at which each leaf being parsed began.
+*/
+
+typedef struct {
+  long tag;
+  long contents;
+  int rule;
+  unsigned long rules;
+  long start;
+  long length;
+  int first;
+  int last;
+  int next;
+  int children_num;
+} mpc_flat_node_t;
+
+typedef struct {
+  int nodes_num;
+  int nodes_slots;
+  mpc_flat_node_t *nodes;
+  long strings_num;
+  long strings_slots;
+  char *strings;
+  int starts_num;
+  int starts_slots;
+  long *starts;
+} mpc_flat_build_t;
+
 typedef struct {
 
   int parsers_num;
@@ -689,10 +1103,34 @@ typedef struct {
   
   mpc_err_t *err;
   
+  int memo_num;
+  int memo_slots;
+  mpc_memo_t *memo;
+  
+  int frames_num;
+  int frames_slots;
+  mpc_memo_frame_t *frames;
+  
+  long memo_hits;
+  long memo_misses;
+  
+  int retain;
+  int recognize;
+  mpc_ast_arena_t *arena;
+  mpc_flat_build_t *flat;
+  
+  int lazy;
+  int quiet;
+  const char *filename;
+  mpc_state_t far;
+  const char *far_failure;
+  int far_num;
+  int far_slots;
+  const char **far_expected;
+  
 } mpc_stack_t;
 
-static mpc_stack_t *mpc_stack_new(const char *filename) {
-  mpc_stack_t *s = malloc(sizeof(mpc_stack_t));
+static void mpc_stack_init(mpc_stack_t *s) {
   
   s->parsers_num = 0;
   s->parsers_slots = 0;
@@ -704,88 +1142,356 @@ static mpc_stack_t *mpc_stack_new(const char *filename) {
   s->results = NULL;
   s->returns = NULL;
   
-  s->err = mpc_err_fail(filename, mpc_state_invalid(), "Unknown Error");
+  s->err = NULL;
   
-  return s;
+  s->memo_num = 0;
+  s->memo_slots = 0;
+  s->memo = NULL;
+  
+  s->frames_num = 0;
+  s->frames_slots = 0;
+  s->frames = NULL;
+  
+  s->retain = 0;
+  s->recognize = 0;
+  s->arena = NULL;
+  s->flat = NULL;
+  
+  s->lazy = 0;
+  s->quiet = 0;
+  s->filename = NULL;
+  s->far = mpc_state_invalid();
+  s->far_failure = NULL;
+  s->far_num = 0;
+  s->far_slots = 0;
+  s->far_expected = NULL;
 }
 
-static void mpc_stack_err(mpc_stack_t *s, mpc_err_t* e) {
-  mpc_err_t *errs[2];
-  errs[0] = s->err;
-  errs[1] = e;
-  s->err = mpc_err_or(errs, 2);
+static mpc_err_t *mpc_stack_unknown(mpc_stack_t *s, const char *filename) {
+  return s->lazy ? NULL : mpc_err_fail(filename, mpc_state_invalid(), "Unknown Error");
 }
 
-static int mpc_stack_terminate(mpc_stack_t *s, mpc_result_t *r) {
-  int success = s->returns[0];
-  
-  if (success) {
-    r->output = s->results[0].output;
-    mpc_err_delete(s->err);
-  } else {
-    mpc_stack_err(s, s->results[0].error);
-    r->error = s->err;
+/*
+** When the stack has an arena the functions which
+** build and free ASTs are swapped for ones that
+** allocate from the arena and free nothing. When
+** it builds a flat AST they are swapped for ones
+** that add to and link nodes in its table.
+*/
+
+static mpc_val_t *mpc_optimise_fold(int n, mpc_val_t **xs);
+static mpc_val_t *mpc_ast_arena_fold(mpc_ast_arena_t *a, int n, mpc_val_t **xs, int seq);
+static mpc_ast_t *mpc_ast_arena_node(mpc_ast_arena_t *a, const char *tag, const char *contents);
+static mpc_ast_t *mpc_ast_arena_add_root(mpc_ast_arena_t *a, mpc_ast_t *x);
+static mpc_ast_t *mpc_ast_arena_tag(mpc_ast_arena_t *a, mpc_ast_t *x, const char *t);
+static mpc_ast_t *mpc_ast_arena_add_tag(mpc_ast_arena_t *a, mpc_ast_t *x, const char *t);
+static mpc_ast_t *mpc_ast_arena_copy(mpc_ast_arena_t *a, mpc_ast_t *x);
+static mpc_ast_t *mpc_ast_add_rule_id(mpc_ast_t *a, int id);
+static mpc_val_t *mpcaf_add_rule(mpc_val_t *x, void *r);
+static mpc_val_t *mpc_flat_build_fold(mpc_flat_build_t *b, int n, mpc_val_t **xs, int seq);
+static mpc_val_t *mpc_flat_build_leaf(mpc_flat_build_t *b, const char *x, long start);
+static mpc_val_t *mpc_flat_build_add_root(mpc_flat_build_t *b, mpc_val_t *x);
+static mpc_val_t *mpc_flat_build_tag(mpc_flat_build_t *b, mpc_val_t *x, const char *t, int add, int id);
+static mpc_val_t *mpc_flat_build_copy(mpc_flat_build_t *b, mpc_val_t *x);
+static void mpc_flat_build_reset(mpc_flat_build_t *b);
+static mpc_flat_t *mpc_flat_build_finish(mpc_flat_build_t *b, mpc_val_t *x);
+
+/* Leaves of a flat AST need to know where in the input they began */
+static void mpc_stack_span_enter(mpc_stack_t *s, mpc_input_t *i, mpc_apply_t f) {
+  mpc_flat_build_t *b = s->flat;
+  if (b == NULL || f != mpcf_str_ast) { return; }
+  if (b->starts_num == b->starts_slots) {
+    b->starts_slots = b->starts_slots * 2 + 16;
+    b->starts = realloc(b->starts, sizeof(long) * b->starts_slots);
   }
-  
-  free(s->parsers);
-  free(s->states);
-  free(s->results);
-  free(s->returns);
-  free(s);
-  
-  return success;
+  b->starts[b->starts_num++] = i->state.pos;
 }
 
-/* Stack Parser Stuff */
-
-static void mpc_stack_set_state(mpc_stack_t *s, int x) {
-  s->states[s->parsers_num-1] = x;
+static long mpc_stack_span_leave(mpc_stack_t *s, mpc_apply_t f) {
+  if (s->flat == NULL || f != mpcf_str_ast) { return 0; }
+  return s->flat->starts[--s->flat->starts_num];
 }
 
-static void mpc_stack_parsers_reserve_more(mpc_stack_t *s) {
-  if (s->parsers_num > s->parsers_slots) {
-    s->parsers_slots = ceil((s->parsers_slots+1) * 1.5);
-    s->parsers = realloc(s->parsers, sizeof(mpc_parser_t*) * s->parsers_slots);
-    s->states = realloc(s->states, sizeof(int) * s->parsers_slots);
+static mpc_val_t *mpc_stack_apply(mpc_stack_t *s, mpc_apply_t f, mpc_val_t *x) {
+  mpc_ast_t *r;
+  if (s->flat && f == mpcf_str_ast) {
+    r = mpc_flat_build_leaf(s->flat, x, mpc_stack_span_leave(s, f));
+    free(x);
+    return r;
   }
+  if (s->flat && f == (mpc_apply_t)mpc_ast_add_root) { return mpc_flat_build_add_root(s->flat, x); }
+  if (s->arena && f == mpcf_str_ast) {
+    r = mpc_ast_arena_node(s->arena, "", x);
+    free(x);
+    return r;
+  }
+  if (s->arena && f == (mpc_apply_t)mpc_ast_add_root) { return mpc_ast_arena_add_root(s->arena, x); }
+  return f(x);
 }
 
-static void mpc_stack_parsers_reserve_less(mpc_stack_t *s) {
-  if (s->parsers_slots > pow(s->parsers_num+1, 1.5)) {
-    s->parsers_slots = floor((s->parsers_slots-1) * (1.0/1.5));
-    s->parsers = realloc(s->parsers, sizeof(mpc_parser_t*) * s->parsers_slots);
-    s->states = realloc(s->states, sizeof(int) * s->parsers_slots);
+static mpc_val_t *mpc_stack_apply_to(mpc_stack_t *s, mpc_apply_to_t f, mpc_val_t *x, void *d) {
+  if (s->flat && f == (mpc_apply_to_t)mpc_ast_tag) { return mpc_flat_build_tag(s->flat, x, d, 0, 0); }
+  if (s->flat && f == (mpc_apply_to_t)mpc_ast_add_tag) { return mpc_flat_build_tag(s->flat, x, d, 1, 0); }
+  if (s->flat && f == mpcaf_add_rule) {
+    return mpc_flat_build_tag(s->flat, x, ((mpc_parser_t*)d)->name, 1, ((mpc_parser_t*)d)->id);
   }
+  if (s->arena && f == (mpc_apply_to_t)mpc_ast_tag) { return mpc_ast_arena_tag(s->arena, x, d); }
+  if (s->arena && f == (mpc_apply_to_t)mpc_ast_add_tag) { return mpc_ast_arena_add_tag(s->arena, x, d); }
+  if (s->arena && f == mpcaf_add_rule) {
+    if (x == NULL) { return x; }
+    return mpc_ast_add_rule_id(mpc_ast_arena_add_tag(s->arena, x, ((mpc_parser_t*)d)->name), ((mpc_parser_t*)d)->id);
+  }
+  return f(x, d);
 }
 
-static void mpc_stack_pushp(mpc_stack_t *s, mpc_parser_t *p) {
-  s->parsers_num++;
-  mpc_stack_parsers_reserve_more(s);
-  s->parsers[s->parsers_num-1] = p;
-  s->states[s->parsers_num-1] = 0;
+static mpc_val_t *mpc_stack_copy(mpc_stack_t *s, mpc_copy_t c, mpc_val_t *x) {
+  if (s->flat && c == (mpc_copy_t)mpc_ast_copy) { return mpc_flat_build_copy(s->flat, x); }
+  if (s->arena && c == (mpc_copy_t)mpc_ast_copy) { return mpc_ast_arena_copy(s->arena, x); }
+  return c(x);
 }
 
-static void mpc_stack_popp(mpc_stack_t *s, mpc_parser_t **p, int *st) {
-  *p = s->parsers[s->parsers_num-1];
-  *st = s->states[s->parsers_num-1];
-  s->parsers_num--;
-  mpc_stack_parsers_reserve_less(s);
+static void mpc_stack_dtor(mpc_stack_t *s, mpc_dtor_t d, mpc_val_t *x) {
+  if ((s->arena || s->flat) && d == (mpc_dtor_t)mpc_ast_delete) { return; }
+  d(x);
 }
 
-static void mpc_stack_peepp(mpc_stack_t *s, mpc_parser_t **p, int *st) {
-  *p = s->parsers[s->parsers_num-1];
-  *st = s->states[s->parsers_num-1];
+/* Readies the stack for a new parse, keeping whatever it has allocated */
+static void mpc_stack_reset(mpc_stack_t *s, const char *filename) {
+  s->parsers_num = 0;
+  s->results_num = 0;
+  s->err = mpc_stack_unknown(s, filename);
+  s->quiet = 0;
+  s->filename = filename;
+  s->far = mpc_state_invalid();
+  s->far_failure = NULL;
+  s->far_num = 0;
+  s->memo_hits = 0;
+  s->memo_misses = 0;
 }
 
-static int mpc_stack_empty(mpc_stack_t *s) {
-  return s->parsers_num == 0;
+static mpc_stack_t *mpc_stack_new(const char *filename) {
+  mpc_stack_t *s = malloc(sizeof(mpc_stack_t));
+  mpc_stack_init(s);
+  mpc_stack_reset(s, filename);
+  return s;
 }
 
-/* Stack Result Stuff */
-
-static mpc_result_t mpc_result_err(mpc_err_t *e) {
-  mpc_result_t r;
-  r.error = e;
+static void mpc_stack_err(mpc_stack_t *s, mpc_err_t* e) {
+  mpc_err_t *errs[2];
+  if (s->lazy) { return; }
+  errs[0] = s->err;
+  errs[1] = e;
+  s->err = mpc_err_or(errs, 2);
+}
+
+/* Farthest Errors */
+
+static void mpc_stack_far(mpc_stack_t *s, mpc_input_t *i, const char *expected, const char *failure) {
+  
+  int k;
+  
+  if (s->quiet || i->state.pos < s->far.pos) { return; }
+  
+  if (i->state.pos > s->far.pos) {
+    s->far = i->state;
+    s->far_failure = NULL;
+    s->far_num = 0;
+  }
+  
+  if (failure) {
+    if (s->far_failure == NULL) { s->far_failure = failure; }
+    return;
+  }
+  
+  if (expected == NULL) { return; }
+  
+  for (k = 0; k < s->far_num; k++) {
+    if (s->far_expected[k] == expected) { return; }
+  }
+  
+  if (s->far_num == s->far_slots) {
+    s->far_slots = s->far_slots * 2 + 8;
+    s->far_expected = realloc(s->far_expected, sizeof(const char*) * s->far_slots);
+  }
+  
+  s->far_expected[s->far_num++] = expected;
+}
+
+static mpc_err_t *mpc_stack_far_err(mpc_stack_t *s) {
+  
+  int k;
+  mpc_err_t *e;
+  
+  if (s->far.pos < 0) { return mpc_err_fail(s->filename, mpc_state_invalid(), "Unknown Error"); }
+  
+  e = malloc(sizeof(mpc_err_t));
+  e->filename = malloc(strlen(s->filename) + 1);
+  strcpy(e->filename, s->filename);
+  e->state = s->far;
+  e->expected_num = 0;
+  e->expected = NULL;
+  e->failure = NULL;
+  
+  if (s->far_failure) {
+    e->failure = malloc(strlen(s->far_failure) + 1);
+    strcpy(e->failure, s->far_failure);
+  }
+  
+  for (k = 0; k < s->far_num; k++) {
+    if (!mpc_err_contains_expected(e, (char*)s->far_expected[k])) {
+      mpc_err_add_expected(e, (char*)s->far_expected[k]);
+    }
+  }
+  
+  return e;
+}
+
+/*
+** These make the error for a failure in the
+** engine, or note it when errors are farthest.
+*/
+
+static mpc_err_t *mpc_stack_fail(mpc_stack_t *s, mpc_input_t *i, const char *failure) {
+  if (s->lazy) { mpc_stack_far(s, i, NULL, failure); return NULL; }
+  return mpc_err_fail(i->filename, i->state, failure);
+}
+
+static mpc_err_t *mpc_stack_expect(mpc_stack_t *s, mpc_input_t *i, const char *expected) {
+  if (s->lazy) { mpc_stack_far(s, i, expected, NULL); return NULL; }
+  return mpc_err_new(i->filename, i->state, expected);
+}
+
+static mpc_err_t *mpc_stack_at(mpc_stack_t *s, mpc_input_t *i, mpc_err_t *x) {
+  
+  int k;
+  
+  if (!s->lazy) { return mpc_err_at(x, i->filename, i->state); }
+  
+  if (x->failure || x->expected_num == 0) { mpc_stack_far(s, i, NULL, x->failure); }
+  for (k = 0; k < x->expected_num && !x->failure; k++) {
+    mpc_stack_far(s, i, x->expected[k], NULL);
+  }
+  return NULL;
+}
+
+static void mpc_stack_memo_delete(mpc_stack_t *s) {
+  
+  int i;
+  mpc_memo_t *m;
+  
+  for (i = 0; i < s->memo_slots; i++) {
+    m = &s->memo[i];
+    if (m->parser == NULL) { continue; }
+    if (m->success) {
+      if (!s->recognize) { mpc_stack_dtor(s, m->parser->data.memo.dx, m->result.output); }
+    } else {
+      mpc_err_delete(m->result.error);
+    }
+    mpc_err_delete(m->err);
+  }
+  
+  for (i = 0; i < s->frames_num; i++) {
+    mpc_err_delete(s->frames[i].err);
+  }
+  
+  free(s->memo);
+  free(s->frames);
+  
+  s->memo_num = 0;
+  s->memo_slots = 0;
+  s->memo = NULL;
+  s->frames_num = 0;
+  s->frames_slots = 0;
+  s->frames = NULL;
+}
+
+static void mpc_stack_free(mpc_stack_t *s) {
+  free(s->parsers);
+  free(s->states);
+  free(s->results);
+  free(s->returns);
+  free(s->far_expected);
+}
+
+/* Takes the result of a finished parse, leaving the stack empty */
+static int mpc_stack_finish(mpc_stack_t *s, mpc_result_t *r) {
+  int success = s->returns[0];
+  
+  if (success) {
+    r->output = s->results[0].output;
+    mpc_err_delete(s->err);
+  } else if (s->lazy) {
+    r->error = mpc_stack_far_err(s);
+  } else {
+    mpc_stack_err(s, s->results[0].error);
+    r->error = s->err;
+  }
+  
+  s->err = NULL;
+  s->results_num = 0;
+  mpc_stack_memo_delete(s);
+  
+  return success;
+}
+
+static int mpc_stack_terminate(mpc_stack_t *s, mpc_result_t *r) {
+  int success = mpc_stack_finish(s, r);
+  mpc_stack_free(s);
+  free(s);
+  return success;
+}
+
+/* Stack Parser Stuff */
+
+static void mpc_stack_set_state(mpc_stack_t *s, int x) {
+  s->states[s->parsers_num-1] = x;
+}
+
+static void mpc_stack_parsers_reserve_more(mpc_stack_t *s) {
+  if (s->parsers_num > s->parsers_slots) {
+    s->parsers_slots = ceil((s->parsers_slots+1) * 1.5);
+    s->parsers = realloc(s->parsers, sizeof(mpc_parser_t*) * s->parsers_slots);
+    s->states = realloc(s->states, sizeof(int) * s->parsers_slots);
+  }
+}
+
+static void mpc_stack_parsers_reserve_less(mpc_stack_t *s) {
+  if (s->retain) { return; }
+  if (s->parsers_slots > pow(s->parsers_num+1, 1.5)) {
+    s->parsers_slots = floor((s->parsers_slots-1) * (1.0/1.5));
+    s->parsers = realloc(s->parsers, sizeof(mpc_parser_t*) * s->parsers_slots);
+    s->states = realloc(s->states, sizeof(int) * s->parsers_slots);
+  }
+}
+
+static void mpc_stack_pushp(mpc_stack_t *s, mpc_parser_t *p) {
+  s->parsers_num++;
+  mpc_stack_parsers_reserve_more(s);
+  s->parsers[s->parsers_num-1] = p;
+  s->states[s->parsers_num-1] = 0;
+}
+
+static void mpc_stack_popp(mpc_stack_t *s, mpc_parser_t **p, int *st) {
+  *p = s->parsers[s->parsers_num-1];
+  *st = s->states[s->parsers_num-1];
+  s->parsers_num--;
+  mpc_stack_parsers_reserve_less(s);
+}
+
+static void mpc_stack_peepp(mpc_stack_t *s, mpc_parser_t **p, int *st) {
+  *p = s->parsers[s->parsers_num-1];
+  *st = s->states[s->parsers_num-1];
+}
+
+static int mpc_stack_empty(mpc_stack_t *s) {
+  return s->parsers_num == 0;
+}
+
+/* Stack Result Stuff */
+
+static mpc_result_t mpc_result_err(mpc_err_t *e) {
+  mpc_result_t r;
+  r.error = e;
   return r;
 }
 
@@ -804,7 +1510,8 @@ static void mpc_stack_results_reserve_more(mpc_stack_t *s) {
 }
 
 static void mpc_stack_results_reserve_less(mpc_stack_t *s) {
-  if ( s->results_slots > pow(s->results_num+1, 1.5)) {
+  if (s->retain) { return; }
+  if (s->results_slots > pow(s->results_num+1, 1.5)) {
     s->results_slots = floor((s->results_slots-1) * (1.0/1.5));
     s->results = realloc(s->results, sizeof(mpc_result_t) * s->results_slots);
     s->returns = realloc(s->returns, sizeof(int) * s->results_slots);
@@ -845,7 +1552,7 @@ static void mpc_stack_popr_out(mpc_stack_t *s, int n, mpc_dtor_t *ds) {
   mpc_result_t x;
   while (n) {
     mpc_stack_popr(s, &x);
-    ds[n-1](x.output);
+    mpc_stack_dtor(s, ds[n-1], x.output);
     n--;
   }
 }
@@ -854,7 +1561,7 @@ static void mpc_stack_popr_out_single(mpc_stack_t *s, int n, mpc_dtor_t dx) {
   mpc_result_t x;
   while (n) {
     mpc_stack_popr(s, &x);
-    dx(x.output);
+    mpc_stack_dtor(s, dx, x.output);
     n--;
   }
 }
@@ -868,102 +1575,626 @@ static void mpc_stack_popr_n(mpc_stack_t *s, int n) {
 }
 
 static mpc_val_t *mpc_stack_merger_out(mpc_stack_t *s, int n, mpc_fold_t f) {
-  mpc_val_t *x = f(n, (mpc_val_t**)(&s->results[s->results_num-n]));
+  mpc_val_t **xs = (mpc_val_t**)(&s->results[s->results_num-n]);
+  mpc_val_t *x;
+  if (s->flat && (f == mpcf_fold_ast || f == mpc_optimise_fold)) {
+    x = mpc_flat_build_fold(s->flat, n, xs, f == mpc_optimise_fold);
+  } else if (s->arena && (f == mpcf_fold_ast || f == mpc_optimise_fold)) {
+    x = mpc_ast_arena_fold(s->arena, n, xs, f == mpc_optimise_fold);
+  } else {
+    x = f(n, xs);
+  }
   mpc_stack_popr_n(s, n);
   return x;
 }
 
 static mpc_err_t *mpc_stack_merger_err(mpc_stack_t *s, int n) {
-  mpc_err_t *x = mpc_err_or((mpc_err_t**)(&s->results[s->results_num-n]), n);
+  mpc_err_t *x;
+  if (s->lazy) { mpc_stack_popr_n(s, n); return NULL; }
+  x = mpc_err_or((mpc_err_t**)(&s->results[s->results_num-n]), n);
   mpc_stack_popr_n(s, n);
   return x;
 }
 
+/* Stack Memo Stuff */
+
+static unsigned long mpc_memo_hash(mpc_parser_t *p, long pos) {
+  unsigned long h = (unsigned long)(size_t)p;
+  h ^= (unsigned long)pos * 2654435761UL;
+  h ^= h >> 15;
+  return h;
+}
+
+static mpc_memo_t *mpc_stack_memo_find(mpc_stack_t *s, mpc_parser_t *p, long pos) {
+  
+  unsigned long j;
+  
+  if (s->memo_slots == 0) { return NULL; }
+  
+  j = mpc_memo_hash(p, pos) & (s->memo_slots-1);
+  while (s->memo[j].parser) {
+    if (s->memo[j].parser == p && s->memo[j].pos == pos) { return &s->memo[j]; }
+    j = (j+1) & (s->memo_slots-1);
+  }
+  
+  return NULL;
+}
+
+static void mpc_stack_memo_insert(mpc_stack_t *s, mpc_memo_t m) {
+  
+  int i, slots;
+  unsigned long j;
+  mpc_memo_t *old;
+  
+  if ((s->memo_num+1) * 2 > s->memo_slots) {
+    
+    old = s->memo;
+    slots = s->memo_slots;
+    
+    s->memo_slots = slots ? slots * 2 : 64;
+    s->memo = calloc(s->memo_slots, sizeof(mpc_memo_t));
+    s->memo_num = 0;
+    
+    for (i = 0; i < slots; i++) {
+      if (old[i].parser) { mpc_stack_memo_insert(s, old[i]); }
+    }
+    free(old);
+  }
+  
+  j = mpc_memo_hash(m.parser, m.pos) & (s->memo_slots-1);
+  while (s->memo[j].parser) { j = (j+1) & (s->memo_slots-1); }
+  s->memo[j] = m;
+  s->memo_num++;
+}
+
+static void mpc_stack_memo_enter(mpc_stack_t *s, mpc_input_t *i) {
+  
+  if (s->frames_num == s->frames_slots) {
+    s->frames_slots = s->frames_slots * 2 + 8;
+    s->frames = realloc(s->frames, sizeof(mpc_memo_frame_t) * s->frames_slots);
+  }
+  
+  s->frames[s->frames_num].pos = i->state.pos;
+  s->frames[s->frames_num].err = s->err;
+  s->frames_num++;
+  
+  s->err = mpc_stack_unknown(s, i->filename);
+}
+
+static void mpc_stack_memo_leave(mpc_stack_t *s, mpc_parser_t *p, mpc_input_t *i) {
+  
+  mpc_memo_t m;
+  mpc_result_t r;
+  mpc_memo_frame_t f = s->frames[--s->frames_num];
+  
+  m.parser = p;
+  m.pos = f.pos;
+  m.state = i->state;
+  m.success = mpc_stack_peekr(s, &r);
+  if (m.success) {
+    m.result.output = s->recognize ? NULL : mpc_stack_copy(s, p->data.memo.cx, r.output);
+  } else {
+    m.result.error = mpc_err_copy(r.error);
+  }
+  
+  m.err = s->err;
+  s->err = f.err;
+  mpc_stack_err(s, mpc_err_copy(m.err));
+  
+  mpc_stack_memo_insert(s, m);
+}
+
 /*
-** This is rather pleasant. The core parsing routine
-** is written in about 200 lines of C.
-**
-** I also love the way in which each parsing type
-** concisely matches some construct or pattern.
-**
-** Particularly nice are the `or` and `and`
-** types which have a broken but mirrored structure
-** with return value and error reflected.
-**
-** When this function was written in recursive form
-** it looked pretty nice. But I've since switched
-** it around to an awkward while loop. It was an
-** unfortunate change for code simplicity but it
-** is noble in the name of performance (and 
-** not smashing the stack).
-**
-** But it is now a pretty ugly beast...
+** Repeating a single character parser into a
+** string with `mpcf_strfold` is how most tokens
+** are built, regex ones in particular, so it is
+** handled directly. Rather than producing a new
+** string for each character and folding them
+** together, the characters are matched in place
+** and the whole span is copied out at once.
 */
 
-#define MPC_CONTINUE(st, x) mpc_stack_set_state(stk, st); mpc_stack_pushp(stk, x); continue
-#define MPC_SUCCESS(x) mpc_stack_popp(stk, &p, &st); mpc_stack_pushr(stk, mpc_result_out(x), 1); continue
-#define MPC_FAILURE(x) mpc_stack_popp(stk, &p, &st); mpc_stack_pushr(stk, mpc_result_err(x), 0); continue
-#define MPC_PRIMATIVE(x, f) if (f) { MPC_SUCCESS(x); } else { MPC_FAILURE(mpc_err_fail(i->filename, i->state, "Incorrect Input")); }
+static mpc_parser_t *mpc_span_single(mpc_parser_t *p, char **expected) {
+  
+  *expected = NULL;
+  
+  while (p->type == MPC_TYPE_EXPECT) {
+    if (*expected == NULL) { *expected = p->data.expect.m; }
+    p = p->data.expect.x;
+  }
+  
+  switch (p->type) {
+    case MPC_TYPE_ANY:
+    case MPC_TYPE_SINGLE:
+    case MPC_TYPE_CLASS:
+    case MPC_TYPE_SATISFY: return p;
+    default: return NULL;
+  }
+}
 
-int mpc_parse_input(mpc_input_t *i, mpc_parser_t *init, mpc_result_t *final) {
+static int mpc_primitive_match(mpc_parser_t *p, char x) {
+  switch (p->type) {
+    case MPC_TYPE_ANY:     return 1;
+    case MPC_TYPE_SINGLE:  return x == p->data.single.x;
+    case MPC_TYPE_CLASS:   return mpc_class_has(p->data.class.x, x);
+    case MPC_TYPE_SATISFY: return p->data.satisfy.f(x);
+    default: return 0;
+  }
+}
+
+static int mpc_span_match(mpc_input_t *i, mpc_parser_t *p, char *c) {
   
-  /* Stack */
-  int st = 0;
-  mpc_parser_t *p = NULL;
-  mpc_stack_t *stk = mpc_stack_new(i->filename);
+  char x = mpc_input_getc(i);
+  if (mpc_input_terminated(i)) { i->state.next = '\0'; return 0; }
   
-  /* Variables */
-  char *s;
-  mpc_result_t r;
+  if (!mpc_primitive_match(p, x)) { return mpc_input_failure(i, x); }
+  
+  *c = x;
+  return mpc_input_success(i, x, NULL);
+}
 
-  /* Go! */
-  mpc_stack_pushp(stk, init);
+/*
+** For string input a class can be matched straight
+** from memory. Where the class, or its complement,
+** is at most four ranges of bytes each block of
+** sixteen is tested at once with one compare per
+** range, and the bytes left are tested one by one.
+*/
+
+#ifdef MPC_USE_SSE2
+
+static size_t mpc_class_span_sse2(mpc_pdata_class_t *c, const char *s, size_t n) {
   
-  while (!mpc_stack_empty(stk)) {
+  int j, mask;
+  size_t k = 0;
+  __m128i v, t, m;
+  
+  while (k + 16 <= n) {
     
-    mpc_stack_peepp(stk, &p, &st);
+    v = _mm_loadu_si128((const __m128i*)(s + k));
+    m = _mm_setzero_si128();
+    for (j = 0; j < c->ranges; j++) {
+      t = _mm_sub_epi8(v, _mm_set1_epi8((char)c->lo[j]));
+      m = _mm_or_si128(m, _mm_cmpeq_epi8(_mm_min_epu8(t, _mm_set1_epi8((char)c->width[j])), t));
+    }
     
-    switch (p->type) {
-      
-      /* Trivial Parsers */
-
-      case MPC_TYPE_UNDEFINED: MPC_FAILURE(mpc_err_fail(i->filename, i->state, "Parser Undefined!"));      
-      case MPC_TYPE_PASS:      MPC_SUCCESS(NULL);
-      case MPC_TYPE_FAIL:      MPC_FAILURE(mpc_err_fail(i->filename, i->state, p->data.fail.m));
-      case MPC_TYPE_LIFT:      MPC_SUCCESS(p->data.lift.lf());
-      case MPC_TYPE_LIFT_VAL:  MPC_SUCCESS(p->data.lift.x);
+    mask = _mm_movemask_epi8(m);
+    if (c->negate) { mask = ~mask & 0xFFFF; }
+    if (mask != 0xFFFF) {
+      for (j = 0; mask & (1 << j); j++);
+      return k + j;
+    }
     
-      /* Basic Parsers */
+    k += 16;
+  }
+  
+  return k;
+}
 
-      case MPC_TYPE_SOI:       MPC_PRIMATIVE(NULL, mpc_input_soi(i));
-      case MPC_TYPE_EOI:       MPC_PRIMATIVE(NULL, mpc_input_eoi(i));
-      case MPC_TYPE_ANY:       MPC_PRIMATIVE(s, mpc_input_any(i, &s));
-      case MPC_TYPE_SINGLE:    MPC_PRIMATIVE(s, mpc_input_char(i, p->data.single.x, &s));
-      case MPC_TYPE_RANGE:     MPC_PRIMATIVE(s, mpc_input_range(i, p->data.range.x, p->data.range.y, &s));
-      case MPC_TYPE_ONEOF:     MPC_PRIMATIVE(s, mpc_input_oneof(i, p->data.string.x, &s));
-      case MPC_TYPE_NONEOF:    MPC_PRIMATIVE(s, mpc_input_noneof(i, p->data.string.x, &s));
-      case MPC_TYPE_SATISFY:   MPC_PRIMATIVE(s, mpc_input_satisfy(i, p->data.satisfy.f, &s));
-      case MPC_TYPE_STRING:    MPC_PRIMATIVE(s, mpc_input_string(i, p->data.string.x, &s));
-    
-      /* Application Parsers */
-      
-      case MPC_TYPE_EXPECT:
-        if (st == 0) { MPC_CONTINUE(1, p->data.expect.x); }
-        if (st == 1) {
-          if (mpc_stack_popr(stk, &r)) {
+#endif
+
+static size_t mpc_class_span(mpc_pdata_class_t *c, const char *s, size_t n) {
+  
+  size_t k = 0;
+  
+#ifdef MPC_USE_SSE2
+  if (c->ranges) { k = mpc_class_span_sse2(c, s, n); }
+#endif
+  
+  while (k < n && mpc_class_has(c->x, s[k])) { k++; }
+  return k;
+}
+
+static void mpc_input_advance(mpc_input_t *i, size_t n) {
+  
+  const char *s = i->string + i->state.pos;
+  const char *e = s + n;
+  const char *l = NULL;
+  const char *x = s;
+  
+  while ((x = memchr(x, '\n', e - x))) { i->state.row++; l = ++x; }
+  
+  i->state.col = l ? (int)(e - l) : i->state.col + (int)n;
+  i->state.pos += n;
+  i->state.next = (size_t)i->state.pos < i->length ? i->string[i->state.pos] : '\0';
+}
+
+static char *mpc_span_scan(mpc_input_t *i, mpc_parser_t *r, int *count) {
+  
+  long start = i->state.pos;
+  char *out = NULL;
+  char *expected;
+  int slots = 0;
+  char c;
+  mpc_parser_t *p = mpc_span_single(r->data.repeat.x, &expected);
+  
+  *count = 0;
+  
+  if ((i->type == MPC_INPUT_STRING || i->type == MPC_INPUT_MMAP) && p->type == MPC_TYPE_CLASS) {
+    *count = mpc_class_span(&p->data.class, i->string + start, i->length - start);
+    mpc_input_advance(i, *count);
+    out = malloc(*count + 1);
+    memcpy(out, i->string + start, *count);
+  } else if (i->type == MPC_INPUT_STRING || i->type == MPC_INPUT_MMAP) {
+    while (mpc_span_match(i, p, &c)) { (*count)++; }
+    out = malloc(*count + 1);
+    memcpy(out, i->string + start, *count);
+  } else {
+    while (mpc_span_match(i, p, &c)) {
+      if (*count + 1 >= slots) {
+        slots = slots * 2 + 16;
+        out = realloc(out, slots);
+      }
+      out[(*count)++] = c;
+    }
+    out = realloc(out, *count + 1);
+  }
+  
+  out[*count] = '\0';
+  return out;
+}
+
+/* Like `mpc_span_scan` for String input but without copying anything out */
+static int mpc_span_skip(mpc_input_t *i, mpc_parser_t *r) {
+  
+  int count = 0;
+  char *expected;
+  char c;
+  mpc_parser_t *p = mpc_span_single(r->data.repeat.x, &expected);
+  
+  if (p->type == MPC_TYPE_CLASS) {
+    count = mpc_class_span(&p->data.class, i->string + i->state.pos, i->length - i->state.pos);
+    mpc_input_advance(i, count);
+  } else {
+    while (mpc_span_match(i, p, &c)) { count++; }
+  }
+  
+  return count;
+}
+
+static int mpc_span_possible(mpc_input_t *i, mpc_parser_t *p) {
+  char *expected;
+  return p->data.repeat.f == mpcf_strfold
+    && i->type != MPC_INPUT_PUSH
+    && mpc_span_single(p->data.repeat.x, &expected) != NULL;
+}
+
+static mpc_err_t *mpc_span_err(mpc_input_t *i, mpc_stack_t *stk, mpc_parser_t *p) {
+  char *expected;
+  mpc_parser_t *x = mpc_span_single(p->data.repeat.x, &expected);
+  if (expected) { return mpc_stack_expect(stk, i, expected); }
+  if (x->type == MPC_TYPE_CLASS && x->data.class.err) { return mpc_stack_at(stk, i, x->data.class.err); }
+  return mpc_stack_fail(stk, i, "Incorrect Input");
+}
+
+/*
+** Once a grammar has been analysed each `or` knows
+** which characters every alternative can start
+** with. Before an alternative is tried the next
+** character is peeked and any alternative which
+** cannot start with it, and cannot match empty,
+** is passed over. In its place goes a copy of
+** the error it would have given, so the merged
+** error is the same as if it had been run.
+*/
+
+static void mpc_or_first_delete(mpc_parser_t *p) {
+  
+  int i;
+  if (p->data.or.first == NULL) { return; }
+  
+  for (i = 0; i < p->data.or.n; i++) {
+    if (p->data.or.first[i].err) { mpc_err_delete(p->data.or.first[i].err); }
+  }
+  free(p->data.or.first);
+  p->data.or.first = NULL;
+}
+
+static int mpc_input_peek(mpc_input_t *i, int *c) {
+  
+  char x = mpc_input_getc(i);
+  if (i->suspended) { i->suspended = 0; return 0; }
+  if (mpc_input_terminated(i)) { i->state.next = '\0'; *c = -1; return 1; }
+  
+  mpc_input_failure(i, x);
+  *c = (unsigned char)x;
+  return 1;
+}
+
+static int mpc_or_skip(mpc_input_t *i, mpc_stack_t *stk, mpc_parser_t *p, int st) {
+  
+  int c, from = st;
+  char next = i->state.next;
+  mpc_first_t *f = p->data.or.first;
+  
+  if (f == NULL || st >= p->data.or.n || !mpc_input_peek(i, &c)) { return st; }
+  
+  while (st < p->data.or.n && !f[st].nullable && f[st].err
+  &&    (c == -1 || !(f[st].chars[c / 8] & (1 << (c % 8))))) {
+    mpc_stack_pushr(stk, mpc_result_err(mpc_stack_at(stk, i, f[st].err)), 0);
+    st++;
+  }
+  
+  if (st == from) { i->state.next = next; }
+  
+  return st;
+}
+
+/*
+** Regular expressions that are simple enough are
+** run as a table driven automaton. The expression
+** becomes a list of items, each a character class
+** with an optional repeat, and a state is a place
+** in that list along with a count for repeats.
+** The whole table is filled in when the expression
+** is compiled so that matching only ever reads it.
+**
+** Every step is exactly the choice the combinators
+** would make so the result is always the same. The
+** errors left behind by repeats as they stop are
+** only kept if they are at the furthest position,
+** so rather than build them all the step which made
+** the last of them is run once more at the end.
+*/
+
+enum {
+  MPC_REGEX_ONE   = 0,
+  MPC_REGEX_MAYBE = 1,
+  MPC_REGEX_MANY  = 2,
+  MPC_REGEX_MANY1 = 3,
+  MPC_REGEX_COUNT = 4,
+  MPC_REGEX_EOI   = 5
+};
+
+enum {
+  MPC_REGEX_KNOWN   = 1,
+  MPC_REGEX_CONSUME = 2,
+  MPC_REGEX_EMIT    = 4,
+  MPC_REGEX_SHIFT   = 3,
+  MPC_REGEX_STATES  = 256
+};
+
+static void mpc_regex_delete(mpc_pdata_regex_t *d) {
+  
+  int i;
+  for (i = 0; i < d->items_num; i++) {
+    if (d->items[i].err)  { mpc_err_delete(d->items[i].err); }
+    if (d->items[i].fail) { mpc_err_delete(d->items[i].fail); }
+  }
+  if (d->soi) { mpc_err_delete(d->soi); }
+  
+  free(d->items);
+  free(d->base);
+  free(d->item);
+  free(d->table);
+}
+
+static int mpc_regex_step(mpc_pdata_regex_t *d, int s, int c, mpc_input_t *i, mpc_stack_t *stk, mpc_err_t **fail) {
+  
+  int k, flags = MPC_REGEX_KNOWN;
+  mpc_regex_item_t *it;
+  
+  while (s < d->states_num) {
+    
+    it = &d->items[d->item[s]];
+    k = s - d->base[d->item[s]];
+    
+    if (it->kind != MPC_REGEX_EOI && c < 256 && (it->chars[c / 8] & (1 << (c % 8)))) {
+      switch (it->kind) {
+        case MPC_REGEX_MANY:  break;
+        case MPC_REGEX_MANY1: s = d->base[d->item[s]] + 1; break;
+        case MPC_REGEX_COUNT: s = k <= it->n ? s+1 : s; break;
+        default:              s = d->base[d->item[s]+1]; break;
+      }
+      return (s << MPC_REGEX_SHIFT) | flags | MPC_REGEX_CONSUME;
+    }
+    
+    if (i) { i->state.next = c < 256 ? (char)c : '\0'; }
+    
+    if ((it->kind == MPC_REGEX_ONE)
+    ||  (it->kind == MPC_REGEX_MANY1 && k == 0)
+    ||  (it->kind == MPC_REGEX_COUNT && k != it->n)
+    ||  (it->kind == MPC_REGEX_EOI && c < 256)) {
+      if (fail) { *fail = it->fail; }
+      return ((d->states_num+1) << MPC_REGEX_SHIFT) | flags;
+    }
+    
+    if (it->kind != MPC_REGEX_EOI) {
+      flags |= MPC_REGEX_EMIT;
+      if (stk) { mpc_stack_err(stk, mpc_stack_at(stk, i, it->err)); }
+    }
+    
+    s = d->base[d->item[s]+1];
+  }
+  
+  return (s << MPC_REGEX_SHIFT) | flags;
+}
+
+static int mpc_regex_run(mpc_input_t *i, mpc_stack_t *stk, mpc_pdata_regex_t *d, char **o, mpc_err_t **e) {
+  
+  int s = 0, c = 256, t = 0, emit_s = -1, emit_c = 0;
+  size_t len = 0, slots = 0;
+  char x = '\0', *out = NULL;
+  mpc_state_t start = i->state, emit_state = i->state, end;
+  mpc_err_t *fail = NULL;
+  int direct = i->type == MPC_INPUT_STRING || i->type == MPC_INPUT_MMAP;
+  
+  if (d->soi && i->state.pos != 0) {
+    *e = mpc_stack_at(stk, i, d->soi);
+    return 0;
+  }
+  
+  mpc_input_mark(i);
+  
+  while (s < d->states_num) {
+    
+    if (direct) {
+      c = (size_t)i->state.pos < i->length ? (unsigned char)(x = i->string[i->state.pos]) : 256;
+    } else {
+      x = mpc_input_getc(i);
+      if (i->suspended) { mpc_input_unmark(i); free(out); return -1; }
+      c = mpc_input_terminated(i) ? 256 : (unsigned char)x;
+    }
+    
+    t = d->table[s * 257 + c];
+    
+    if (t & MPC_REGEX_EMIT) { emit_s = s; emit_c = c; emit_state = i->state; }
+    if (!(t & MPC_REGEX_CONSUME)) { break; }
+    
+    if (!direct && o) {
+      if (len + 1 >= slots) {
+        slots = slots * 2 + 16;
+        out = realloc(out, slots);
+      }
+      out[len++] = x;
+    }
+    
+    mpc_input_success(i, x, NULL);
+    s = t >> MPC_REGEX_SHIFT;
+  }
+  
+  if (s < d->states_num) {
+    if (c == 256) { i->state.next = '\0'; } else { mpc_input_failure(i, x); }
+  }
+  
+  if (emit_s >= 0) {
+    end = i->state;
+    i->state = emit_state;
+    mpc_regex_step(d, emit_s, emit_c, i, stk, NULL);
+    i->state = end;
+  }
+  
+  if (s < d->states_num && (t >> MPC_REGEX_SHIFT) > d->states_num) {
+    mpc_regex_step(d, s, c, i, NULL, &fail);
+    *e = mpc_stack_at(stk, i, fail);
+    mpc_input_rewind(i);
+    free(out);
+    return 0;
+  }
+  
+  mpc_input_unmark(i);
+  
+  if (o == NULL) { return 1; }
+  
+  if (direct) {
+    len = i->state.pos - start.pos;
+    out = malloc(len + 1);
+    memcpy(out, i->string + start.pos, len);
+  } else {
+    out = realloc(out, len + 1);
+  }
+  
+  out[len] = '\0';
+  *o = out;
+  return 1;
+}
+
+/*
+** This is rather pleasant. The core parsing routine
+** is written in about 200 lines of C.
+**
+** I also love the way in which each parsing type
+** concisely matches some construct or pattern.
+**
+** Particularly nice are the `or` and `and`
+** types which have a broken but mirrored structure
+** with return value and error reflected.
+**
+** When this function was written in recursive form
+** it looked pretty nice. But I've since switched
+** it around to an awkward while loop. It was an
+** unfortunate change for code simplicity but it
+** is noble in the name of performance (and 
+** not smashing the stack).
+**
+** But it is now a pretty ugly beast...
+**
+** Because all of the state lives on the stack
+** the loop can also be stopped part way. When a
+** primitive finds a Push input has run dry it
+** restores the position, leaves itself on top
+** of the stack and returns. Running the stack
+** again once more input has arrived simply
+** retries that primitive and carries on.
+*/
+
+#define MPC_CONTINUE(st, x) mpc_stack_set_state(stk, st); mpc_stack_pushp(stk, x); continue
+#define MPC_SUCCESS(x) mpc_stack_popp(stk, &p, &st); mpc_stack_pushr(stk, mpc_result_out(x), 1); continue
+#define MPC_FAILURE(x) mpc_stack_popp(stk, &p, &st); mpc_stack_pushr(stk, mpc_result_err(x), 0); continue
+#define MPC_SUSPEND() i->state = resume; return 0
+#define MPC_PRIMATIVE(x, f) resume = i->state; if (f) { MPC_SUCCESS(x); } else if (i->suspended) { MPC_SUSPEND(); } else { MPC_FAILURE(mpc_stack_fail(stk, i, "Incorrect Input")); }
+
+static int mpc_parse_run(mpc_input_t *i, mpc_stack_t *stk) {
+  
+  /* Stack */
+  int st = 0;
+  mpc_parser_t *p = NULL;
+  
+  /* Variables */
+  char *s;
+  int n;
+  mpc_result_t r;
+  mpc_state_t resume;
+  mpc_memo_t *m;
+  mpc_err_t *e;
+  
+  while (!mpc_stack_empty(stk)) {
+    
+    mpc_stack_peepp(stk, &p, &st);
+    
+    switch (p->type) {
+      
+      /* Trivial Parsers */
+
+      case MPC_TYPE_UNDEFINED: MPC_FAILURE(mpc_stack_fail(stk, i, "Parser Undefined!"));      
+      case MPC_TYPE_PASS:      MPC_SUCCESS(NULL);
+      case MPC_TYPE_FAIL:      MPC_FAILURE(mpc_stack_fail(stk, i, p->data.fail.m));
+      case MPC_TYPE_LIFT:      MPC_SUCCESS(p->data.lift.lf());
+      case MPC_TYPE_LIFT_VAL:  MPC_SUCCESS(p->data.lift.x);
+    
+      /* Basic Parsers */
+
+      case MPC_TYPE_SOI:       MPC_PRIMATIVE(NULL, mpc_input_soi(i));
+      case MPC_TYPE_EOI:       MPC_PRIMATIVE(NULL, mpc_input_eoi(i));
+      case MPC_TYPE_ANY:       MPC_PRIMATIVE(s, mpc_input_any(i, &s));
+      case MPC_TYPE_SINGLE:    MPC_PRIMATIVE(s, mpc_input_char(i, p->data.single.x, &s));
+      case MPC_TYPE_CLASS:
+        if (p->data.class.err == NULL) { MPC_PRIMATIVE(s, mpc_input_class(i, p->data.class.x, &s)); }
+        resume = i->state;
+        if (mpc_input_class(i, p->data.class.x, &s)) { MPC_SUCCESS(s); }
+        if (i->suspended) { MPC_SUSPEND(); }
+        MPC_FAILURE(mpc_stack_at(stk, i, p->data.class.err));
+      case MPC_TYPE_SATISFY:   MPC_PRIMATIVE(s, mpc_input_satisfy(i, p->data.satisfy.f, &s));
+      case MPC_TYPE_STRING:    MPC_PRIMATIVE(s, mpc_input_string(i, p->data.string.x, &s));
+      
+      case MPC_TYPE_REGEX:
+        resume = i->state;
+        n = mpc_regex_run(i, stk, &p->data.regex, &s, &e);
+        if (n > 0) { MPC_SUCCESS(s); }
+        if (n < 0) { MPC_SUSPEND(); }
+        MPC_FAILURE(e);
+    
+      /* Application Parsers */
+      
+      case MPC_TYPE_EXPECT:
+        if (st == 0) { stk->quiet++; MPC_CONTINUE(1, p->data.expect.x); }
+        if (st == 1) {
+          stk->quiet--;
+          if (mpc_stack_popr(stk, &r)) {
             MPC_SUCCESS(r.output);
           } else {
             mpc_err_delete(r.error); 
-            MPC_FAILURE(mpc_err_new(i->filename, i->state, p->data.expect.m));
+            MPC_FAILURE(mpc_stack_expect(stk, i, p->data.expect.m));
           }
         }
       
       case MPC_TYPE_APPLY:
-        if (st == 0) { MPC_CONTINUE(1, p->data.apply.x); }
+        if (st == 0) { mpc_stack_span_enter(stk, i, p->data.apply.f); MPC_CONTINUE(1, p->data.apply.x); }
         if (st == 1) {
           if (mpc_stack_popr(stk, &r)) {
-            MPC_SUCCESS(p->data.apply.f(r.output));
+            MPC_SUCCESS(mpc_stack_apply(stk, p->data.apply.f, r.output));
           } else {
+            mpc_stack_span_leave(stk, p->data.apply.f);
             MPC_FAILURE(r.error);
           }
         }
@@ -972,7 +2203,7 @@ int mpc_parse_input(mpc_input_t *i, mpc_parser_t *init, mpc_result_t *final) {
         if (st == 0) { MPC_CONTINUE(1, p->data.apply_to.x); }
         if (st == 1) {
           if (mpc_stack_popr(stk, &r)) {
-            MPC_SUCCESS(p->data.apply_to.f(r.output, p->data.apply_to.d));
+            MPC_SUCCESS(mpc_stack_apply_to(stk, p->data.apply_to.f, r.output, p->data.apply_to.d));
           } else {
             MPC_FAILURE(r.error);
           }
@@ -995,8 +2226,8 @@ int mpc_parse_input(mpc_input_t *i, mpc_parser_t *init, mpc_result_t *final) {
         if (st == 1) {
           if (mpc_stack_popr(stk, &r)) {
             mpc_input_rewind(i);
-            p->data.not.dx(r.output);
-            MPC_FAILURE(mpc_err_new(i->filename, i->state, "opposite"));
+            mpc_stack_dtor(stk, p->data.not.dx, r.output);
+            MPC_FAILURE(mpc_stack_expect(stk, i, "opposite"));
           } else {
             mpc_input_unmark(i);
             mpc_stack_err(stk, r.error);
@@ -1018,6 +2249,11 @@ int mpc_parse_input(mpc_input_t *i, mpc_parser_t *init, mpc_result_t *final) {
       /* Repeat Parsers */
       
       case MPC_TYPE_MANY:
+        if (st == 0 && mpc_span_possible(i, p)) {
+          s = mpc_span_scan(i, p, &n);
+          mpc_stack_err(stk, mpc_span_err(i, stk, p));
+          MPC_SUCCESS(s);
+        }
         if (st == 0) { MPC_CONTINUE(st+1, p->data.repeat.x); }
         if (st >  0) {
           if (mpc_stack_peekr(stk, &r)) {
@@ -1030,6 +2266,16 @@ int mpc_parse_input(mpc_input_t *i, mpc_parser_t *init, mpc_result_t *final) {
         }
       
       case MPC_TYPE_MANY1:
+        if (st == 0 && mpc_span_possible(i, p)) {
+          s = mpc_span_scan(i, p, &n);
+          if (n == 0) {
+            free(s);
+            MPC_FAILURE(mpc_err_many1(mpc_span_err(i, stk, p)));
+          } else {
+            mpc_stack_err(stk, mpc_span_err(i, stk, p));
+            MPC_SUCCESS(s);
+          }
+        }
         if (st == 0) { MPC_CONTINUE(st+1, p->data.repeat.x); }
         if (st >  0) {
           if (mpc_stack_peekr(stk, &r)) {
@@ -1072,13 +2318,18 @@ int mpc_parse_input(mpc_input_t *i, mpc_parser_t *init, mpc_result_t *final) {
         
         if (p->data.or.n == 0) { MPC_SUCCESS(NULL); }
         
-        if (st == 0) { MPC_CONTINUE(st+1, p->data.or.xs[st]); }
+        if (st == 0) {
+          st = mpc_or_skip(i, stk, p, st);
+          if (st <  p->data.or.n) { MPC_CONTINUE(st+1, p->data.or.xs[st]); }
+          if (st == p->data.or.n) { MPC_FAILURE(mpc_stack_merger_err(stk, p->data.or.n)); }
+        }
         if (st <= p->data.or.n) {
           if (mpc_stack_peekr(stk, &r)) {
             mpc_stack_popr(stk, &r);
             mpc_stack_popr_err(stk, st-1);
             MPC_SUCCESS(r.output);
           }
+          st = mpc_or_skip(i, stk, p, st);
           if (st <  p->data.or.n) { MPC_CONTINUE(st+1, p->data.or.xs[st]); }
           if (st == p->data.or.n) { MPC_FAILURE(mpc_stack_merger_err(stk, p->data.or.n)); }
         }
@@ -1099,23 +2350,56 @@ int mpc_parse_input(mpc_input_t *i, mpc_parser_t *init, mpc_result_t *final) {
           if (st == p->data.and.n) { mpc_input_unmark(i); MPC_SUCCESS(mpc_stack_merger_out(stk, p->data.and.n, p->data.and.f)); }
         }
       
+      /* Memo Parsers */
+      
+      case MPC_TYPE_MEMO:
+        if (st == 0) {
+          m = mpc_stack_memo_find(stk, p, i->state.pos);
+          if (m) {
+            stk->memo_hits++;
+            mpc_input_jump(i, m->state);
+            mpc_stack_err(stk, mpc_err_copy(m->err));
+            if (m->success) {
+              MPC_SUCCESS(mpc_stack_copy(stk, p->data.memo.cx, m->result.output));
+            } else {
+              MPC_FAILURE(mpc_err_copy(m->result.error));
+            }
+          }
+          stk->memo_misses++;
+          mpc_stack_memo_enter(stk, i);
+          MPC_CONTINUE(1, p->data.memo.x);
+        }
+        if (st == 1) {
+          mpc_stack_memo_leave(stk, p, i);
+          mpc_stack_popp(stk, &p, &st);
+          continue;
+        }
+      
       /* End */
       
       default:
         
-        MPC_FAILURE(mpc_err_fail(i->filename, i->state, "Unknown Parser Type Id!"));
+        MPC_FAILURE(mpc_stack_fail(stk, i, "Unknown Parser Type Id!"));
     }
   }
   
-  return mpc_stack_terminate(stk, final);
+  return 1;
   
 }
 
 #undef MPC_CONTINUE
 #undef MPC_SUCCESS
 #undef MPC_FAILURE
+#undef MPC_SUSPEND
 #undef MPC_PRIMATIVE
 
+int mpc_parse_input(mpc_input_t *i, mpc_parser_t *init, mpc_result_t *final) {
+  mpc_stack_t *stk = mpc_stack_new(i->filename);
+  mpc_stack_pushp(stk, init);
+  mpc_parse_run(i, stk);
+  return mpc_stack_terminate(stk, final);
+}
+
 int mpc_parse(const char *filename, const char *string, mpc_parser_t *p, mpc_result_t *r) {
   int x;
   mpc_input_t *i = mpc_input_new_string(filename, string);
@@ -1124,14 +2408,48 @@ int mpc_parse(const char *filename, const char *string, mpc_parser_t *p, mpc_res
   return x;
 }
 
-int mpc_parse_file(const char *filename, FILE *file, mpc_parser_t *p, mpc_result_t *r) {
+/*
+** Regular files are mapped into memory and parsed
+** in place. Afterward the file is positioned just
+** after the consumed input, as it would be if the
+** contents had been read character by character.
+*/
+
+static mpc_input_t *mpc_input_new_file_or_mmap(const char *filename, FILE *file) {
+  mpc_input_t *i = mpc_input_new_mmap(filename, file);
+  return i ? i : mpc_input_new_file(filename, file);
+}
+
+static void mpc_input_delete_file_or_mmap(mpc_input_t *i) {
+  if (i->type == MPC_INPUT_MMAP) {
+    fseek(i->file, (long)(i->mapping_length - i->length) + i->state.pos, SEEK_SET);
+  }
+  mpc_input_delete(i);
+}
+
+/*
+** Like `mpc_parse` but takes the length of the
+** input explicitly. The buffer is read in place
+** for the duration of the call and does not need
+** to be null terminated.
+*/
+
+int mpc_parse_n(const char *filename, const char *string, size_t length, mpc_parser_t *p, mpc_result_t *r) {
   int x;
-  mpc_input_t *i = mpc_input_new_file(filename, file);
+  mpc_input_t *i = mpc_input_new_nstring(filename, string, length);
   x = mpc_parse_input(i, p, r);
   mpc_input_delete(i);
   return x;
 }
 
+int mpc_parse_file(const char *filename, FILE *file, mpc_parser_t *p, mpc_result_t *r) {
+  int x;
+  mpc_input_t *i = mpc_input_new_file_or_mmap(filename, file);
+  x = mpc_parse_input(i, p, r);
+  mpc_input_delete_file_or_mmap(i);
+  return x;
+}
+
 int mpc_parse_pipe(const char *filename, FILE *pipe, mpc_parser_t *p, mpc_result_t *r) {
   int x;
   mpc_input_t *i = mpc_input_new_pipe(filename, pipe);
@@ -1157,1171 +2475,3634 @@ int mpc_parse_contents(const char *filename, mpc_parser_t *p, mpc_result_t *r) {
 }
 
 /*
-** Building a Parser
+** Streams
+**
+** A stream parses a sequence of values one after
+** another from the same file or pipe, each parse
+** continuing where the last one finished. It is
+** read through the Pipe input, so only the data
+** still needed is held and input which has been
+** parsed is released as more is read in.
 */
 
-static void mpc_undefine_unretained(mpc_parser_t *p, int force);
+struct mpc_stream_t {
+  mpc_input_t *input;
+};
 
-static void mpc_undefine_or(mpc_parser_t *p) {
-  
-  int i;
-  for (i = 0; i < p->data.or.n; i++) {
-    mpc_undefine_unretained(p->data.or.xs[i], 0);
-  }
-  free(p->data.or.xs);
-  
+mpc_stream_t *mpc_stream_new(const char *filename, FILE *file) {
+  mpc_stream_t *s = malloc(sizeof(mpc_stream_t));
+  s->input = mpc_input_new_pipe(filename, file);
+  return s;
 }
 
-static void mpc_undefine_and(mpc_parser_t *p) {
-  
-  int i;
-  for (i = 0; i < p->data.and.n; i++) {
-    mpc_undefine_unretained(p->data.and.xs[i], 0);
-  }
-  free(p->data.and.xs);
-  free(p->data.and.dxs);
-  
+void mpc_stream_delete(mpc_stream_t *s) {
+  mpc_input_delete(s->input);
+  free(s);
 }
 
-static void mpc_undefine_unretained(mpc_parser_t *p, int force) {
-  
-  if (p->retained && !force) { return; }
-  
-  switch (p->type) {
-    
-    case MPC_TYPE_FAIL: free(p->data.fail.m); break;
-    
-    case MPC_TYPE_ONEOF: 
-    case MPC_TYPE_NONEOF:
-    case MPC_TYPE_STRING:
-      free(p->data.string.x); 
-      break;
-    
-    case MPC_TYPE_APPLY:    mpc_undefine_unretained(p->data.apply.x, 0);    break;
-    case MPC_TYPE_APPLY_TO: mpc_undefine_unretained(p->data.apply_to.x, 0); break;
-    case MPC_TYPE_PREDICT:  mpc_undefine_unretained(p->data.predict.x, 0);  break;
-    
-    case MPC_TYPE_MAYBE:
-    case MPC_TYPE_NOT:
-      mpc_undefine_unretained(p->data.not.x, 0);
-      break;
-    
-    case MPC_TYPE_EXPECT:
-      mpc_undefine_unretained(p->data.expect.x, 0);
-      free(p->data.expect.m);
-      break;
-      
-    case MPC_TYPE_MANY:
-    case MPC_TYPE_MANY1:
-    case MPC_TYPE_COUNT:
-      mpc_undefine_unretained(p->data.repeat.x, 0);
-      break;
-    
-    case MPC_TYPE_OR:  mpc_undefine_or(p);  break;
-    case MPC_TYPE_AND: mpc_undefine_and(p); break;
-    
-    default: break;
-  }
-  
-  if (!force) {
-    free(p->name);
-    free(p);
-  }
-  
+int mpc_stream_parse(mpc_stream_t *s, mpc_parser_t *p, mpc_result_t *r) {
+  return mpc_parse_input(s->input, p, r);
 }
 
-void mpc_delete(mpc_parser_t *p) {
-  if (p->retained) {
+int mpc_stream_eof(mpc_stream_t *s) {
+  mpc_input_t *i = s->input;
+  if (!mpc_input_buffer_in_range(i)) { mpc_input_buffer_fill(i); }
+  return mpc_input_terminated(i);
+}
 
-    if (p->type != MPC_TYPE_UNDEFINED) {
-      mpc_undefine_unretained(p, 0);
-    } 
-    
-    free(p->name);
-    free(p);
+/*
+** Parse Contexts
+**
+** A context holds an input and a stack which are
+** used again by every parse run through it. The
+** stack keeps its capacity rather than shrinking
+** as it pops and the marks are kept from one run
+** to the next, so once a context has seen its
+** largest input the engine stops asking for
+** memory. Only the values, errors and memo
+** entries of each parse are still allocated.
+*/
+
+enum { MPC_PARSE_CTX_SLOTS = 64 };
+
+struct mpc_parse_ctx_t {
+  mpc_input_t input;
+  mpc_stack_t stack;
+  size_t filename_slots;
+  mpc_flat_build_t flat;
+};
+
+mpc_parse_ctx_t *mpc_parse_ctx_new(void) {
   
-  } else {
-    mpc_undefine_unretained(p, 0);  
-  }
+  mpc_parse_ctx_t *c = malloc(sizeof(mpc_parse_ctx_t));
+  mpc_input_t *i = &c->input;
+  
+  i->filename = NULL;
+  i->type = MPC_INPUT_STRING;
+  i->state = mpc_state_new();
+  
+  i->string = NULL;
+  i->buffer = NULL;
+  i->file = NULL;
+  i->buffer_start = 0;
+  i->buffer_length = 0;
+  i->buffer_size = 0;
+  i->eof = 0;
+  i->suspended = 0;
+  
+  i->mapping = NULL;
+  i->mapping_length = 0;
+  i->length = 0;
+  
+  i->backtrack = 1;
+  i->marks_num = 0;
+  i->marks_slots = MPC_PARSE_CTX_SLOTS;
+  i->marks = malloc(sizeof(mpc_state_t) * i->marks_slots);
+  
+  mpc_stack_init(&c->stack);
+  c->stack.retain = 1;
+  c->stack.parsers_slots = MPC_PARSE_CTX_SLOTS;
+  c->stack.parsers = malloc(sizeof(mpc_parser_t*) * MPC_PARSE_CTX_SLOTS);
+  c->stack.states = malloc(sizeof(int) * MPC_PARSE_CTX_SLOTS);
+  c->stack.results_slots = MPC_PARSE_CTX_SLOTS;
+  c->stack.results = malloc(sizeof(mpc_result_t) * MPC_PARSE_CTX_SLOTS);
+  c->stack.returns = malloc(sizeof(int) * MPC_PARSE_CTX_SLOTS);
+  
+  c->filename_slots = 0;
+  
+  c->flat.nodes_num = 0;
+  c->flat.nodes_slots = 0;
+  c->flat.nodes = NULL;
+  c->flat.strings_num = 0;
+  c->flat.strings_slots = 0;
+  c->flat.strings = NULL;
+  c->flat.starts_num = 0;
+  c->flat.starts_slots = 0;
+  c->flat.starts = NULL;
+  
+  return c;
 }
 
-static void mpc_soft_delete(mpc_val_t *x) {
-  mpc_undefine_unretained(x, 0);
+void mpc_parse_ctx_errors(mpc_parse_ctx_t *c, int mode) {
+  c->stack.lazy = mode == MPC_ERRORS_FARTHEST;
 }
 
-static mpc_parser_t *mpc_undefined(void) {
-  mpc_parser_t *p = calloc(1, sizeof(mpc_parser_t));
-  p->retained = 0;
-  p->type = MPC_TYPE_UNDEFINED;
-  p->name = NULL;
-  return p;
+void mpc_parse_ctx_arena(mpc_parse_ctx_t *c, mpc_ast_arena_t *a) {
+  c->stack.arena = a;
 }
 
-mpc_parser_t *mpc_new(const char *name) {
-  mpc_parser_t *p = mpc_undefined();
-  p->retained = 1;
-  p->name = realloc(p->name, strlen(name) + 1);
-  strcpy(p->name, name);
-  return p;
+void mpc_parse_ctx_output(mpc_parse_ctx_t *c, int mode) {
+  c->stack.flat = mode == MPC_OUTPUT_FLAT ? &c->flat : NULL;
 }
 
-mpc_parser_t *mpc_undefine(mpc_parser_t *p) {
-  mpc_undefine_unretained(p, 1);
-  p->type = MPC_TYPE_UNDEFINED;
-  return p;
+void mpc_parse_ctx_delete(mpc_parse_ctx_t *c) {
+  free(c->flat.nodes);
+  free(c->flat.strings);
+  free(c->flat.starts);
+  mpc_stack_free(&c->stack);
+  free(c->input.filename);
+  free(c->input.marks);
+  free(c);
 }
 
-mpc_parser_t *mpc_define(mpc_parser_t *p, mpc_parser_t *a) {
+static int mpc_parse_ctx_n(mpc_parse_ctx_t *c, const char *filename, const char *string, size_t length, mpc_parser_t *p, mpc_result_t *r) {
   
-  if (p->retained) {
-    p->type = a->type;
-    p->data = a->data;
-  } else {
-    mpc_parser_t *a2 = mpc_failf("Attempt to assign to Unretained Parser!");
-    p->type = a2->type;
-    p->data = a2->data;
-    free(a2);
+  mpc_input_t *i = &c->input;
+  size_t n = strlen(filename) + 1;
+  
+  if (n > c->filename_slots) {
+    c->filename_slots = n;
+    i->filename = realloc(i->filename, n);
   }
+  memcpy(i->filename, filename, n);
   
-  free(a);
-  return p;  
-}
-
-void mpc_cleanup(int n, ...) {
-  int i;
-  mpc_parser_t **list = malloc(sizeof(mpc_parser_t*) * n);
+  i->state = mpc_state_new();
+  i->string = string;
+  i->length = length;
+  i->backtrack = 1;
+  i->marks_num = 0;
   
-  va_list va;
-  va_start(va, n);
-  for (i = 0; i < n; i++) { list[i] = va_arg(va, mpc_parser_t*); }
-  for (i = 0; i < n; i++) { mpc_undefine(list[i]); }
-  for (i = 0; i < n; i++) { mpc_delete(list[i]); }  
-  va_end(va);  
-
-  free(list);
-}
-
-mpc_parser_t *mpc_pass(void) {
-  mpc_parser_t *p = mpc_undefined();
-  p->type = MPC_TYPE_PASS;
-  return p;
+  mpc_stack_reset(&c->stack, i->filename);
+  mpc_stack_pushp(&c->stack, p);
+  
+  if (c->stack.flat == NULL) {
+    mpc_parse_run(i, &c->stack);
+    return mpc_stack_finish(&c->stack, r);
+  }
+  
+  mpc_flat_build_reset(&c->flat);
+  mpc_parse_run(i, &c->stack);
+  if (!mpc_stack_finish(&c->stack, r)) { return 0; }
+  r->output = mpc_flat_build_finish(&c->flat, r->output);
+  return 1;
 }
 
-mpc_parser_t *mpc_fail(const char *m) {
-  mpc_parser_t *p = mpc_undefined();
-  p->type = MPC_TYPE_FAIL;
-  p->data.fail.m = malloc(strlen(m) + 1);
-  strcpy(p->data.fail.m, m);
-  return p;
+int mpc_parse_ctx(mpc_parse_ctx_t *c, const char *filename, const char *string, mpc_parser_t *p, mpc_result_t *r) {
+  return mpc_parse_ctx_n(c, filename, string, strlen(string), p, r);
 }
 
 /*
-** As `snprintf` is not ANSI standard this 
-** function `mpc_failf` should be considered
-** unsafe.
-**
-** You have a few options if this is going to be
-** trouble.
-**
-** - Ensure the format string does not exceed
-**   the buffer length using precision specifiers
-**   such as `%.512s`.
-**
-** - Patch this function in your code base to 
-**   use `snprintf` or whatever variant your
-**   system supports.
-**
-** - Avoid it altogether.
+** Batch Parsing
 **
+** Each worker keeps one context and takes the
+** next unparsed job from the batch until none
+** are left. A job is either a file, which is
+** read whole into a buffer the worker keeps and
+** parsed in place, or a chunk of one string. So
+** once a worker has seen its largest job it only
+** allocates the outputs and errors. The calling
+** thread is one of the workers.
 */
 
-mpc_parser_t *mpc_failf(const char *fmt, ...) {
-  
-  va_list va;
-  char *buffer;
+enum { MPC_BATCH_BUFFER = 4096 };
 
-  mpc_parser_t *p = mpc_undefined();
-  p->type = MPC_TYPE_FAIL;
-  
-  va_start(va, fmt);
-  buffer = malloc(2048);
-  vsprintf(buffer, fmt, va);
-  va_end(va);
+typedef struct {
+  mpc_parser_t *parser;
+  const char **filenames;
+  const char *filename;
+  const char *string;
+  size_t *bounds;
+  mpc_result_t *results;
+  int *oks;
+  int num;
+  int next;
+  int stop;
+#ifdef MPC_USE_PTHREADS
+  pthread_mutex_t lock;
+#endif
+} mpc_batch_t;
+
+static int mpc_batch_take(mpc_batch_t *b) {
+  int j;
+#ifdef MPC_USE_PTHREADS
+  pthread_mutex_lock(&b->lock);
+#endif
+  j = b->next < b->stop ? b->next++ : -1;
+#ifdef MPC_USE_PTHREADS
+  pthread_mutex_unlock(&b->lock);
+#endif
+  return j;
+}
+
+/* Jobs after `j` which haven't been taken yet are skipped */
+static void mpc_batch_stop(mpc_batch_t *b, int j) {
+#ifdef MPC_USE_PTHREADS
+  pthread_mutex_lock(&b->lock);
+#endif
+  if (j + 1 < b->stop) { b->stop = j + 1; }
+#ifdef MPC_USE_PTHREADS
+  pthread_mutex_unlock(&b->lock);
+#endif
+}
+
+static void *mpc_batch_run_files(void *x) {
+  
+  mpc_batch_t *b = x;
+  mpc_parse_ctx_t *c = mpc_parse_ctx_new();
+  char *buffer = NULL;
+  size_t slots = 0, length, n;
+  FILE *f;
+  int j;
+  
+  while ((j = mpc_batch_take(b)) != -1) {
+    
+    f = fopen(b->filenames[j], "rb");
+    if (f == NULL) {
+      b->results[j].error = mpc_err_fail(b->filenames[j], mpc_state_new(), "Unable to open file!");
+      b->oks[j] = 0;
+      continue;
+    }
+    
+    length = 0;
+    for (;;) {
+      if (slots - length < 2) {
+        slots = slots ? slots * 2 : MPC_BATCH_BUFFER;
+        buffer = realloc(buffer, slots);
+      }
+      n = fread(buffer + length, 1, slots - length - 1, f);
+      if (n == 0) { break; }
+      length += n;
+    }
+    buffer[length] = '\0';
+    fclose(f);
+    
+    b->oks[j] = mpc_parse_ctx_n(c, b->filenames[j], buffer, length, b->parser, &b->results[j]);
+  }
   
-  buffer = realloc(buffer, strlen(buffer) + 1);
-  p->data.fail.m = buffer;
-  return p;
-
+  free(buffer);
+  mpc_parse_ctx_delete(c);
+  return NULL;
 }
 
-mpc_parser_t *mpc_lift_val(mpc_val_t *x) {
-  mpc_parser_t *p = mpc_undefined();
-  p->type = MPC_TYPE_LIFT_VAL;
-  p->data.lift.x = x;
-  return p;
+static void *mpc_batch_run_chunks(void *x) {
+  
+  mpc_batch_t *b = x;
+  mpc_parse_ctx_t *c = mpc_parse_ctx_new();
+  int j;
+  
+  while ((j = mpc_batch_take(b)) != -1) {
+    b->oks[j] = mpc_parse_ctx_n(c, b->filename, b->string + b->bounds[j],
+      b->bounds[j+1] - b->bounds[j], b->parser, &b->results[j]);
+    if (!b->oks[j]) { mpc_batch_stop(b, j); }
+  }
+  
+  mpc_parse_ctx_delete(c);
+  return NULL;
 }
 
-mpc_parser_t *mpc_lift(mpc_ctor_t lf) {
-  mpc_parser_t *p = mpc_undefined();
-  p->type = MPC_TYPE_LIFT;
-  p->data.lift.lf = lf;
-  return p;
+static void mpc_batch_work(mpc_batch_t *b, void *(*run)(void*), int nthreads) {
+  
+#ifdef MPC_USE_PTHREADS
+  
+  pthread_t *threads;
+  int i, started = 0;
+  
+  if (nthreads > b->num) { nthreads = b->num; }
+  if (nthreads < 1) { nthreads = 1; }
+  
+  pthread_mutex_init(&b->lock, NULL);
+  threads = malloc(sizeof(pthread_t) * nthreads);
+  
+  /* If a thread can't be started the others take its share */
+  for (i = 1; i < nthreads; i++) {
+    if (pthread_create(&threads[started], NULL, run, b) == 0) { started++; }
+  }
+  
+  run(b);
+  
+  for (i = 0; i < started; i++) { pthread_join(threads[i], NULL); }
+  free(threads);
+  pthread_mutex_destroy(&b->lock);
+  
+#else
+  (void)nthreads;
+  run(b);
+#endif
+  
 }
 
-mpc_parser_t *mpc_expect(mpc_parser_t *a, const char *expected) {
-  mpc_parser_t *p = mpc_undefined();
-  p->type = MPC_TYPE_EXPECT;
-  p->data.expect.x = a;
-  p->data.expect.m = malloc(strlen(expected) + 1);
-  strcpy(p->data.expect.m, expected);
-  return p;
+int mpc_parse_files(mpc_parser_t *p, const char **filenames, int n, mpc_result_t *rs, int *oks, int nthreads) {
+  
+  mpc_batch_t b;
+  int i, parsed = 0;
+  
+  b.parser = p;
+  b.filenames = filenames;
+  b.filename = NULL;
+  b.string = NULL;
+  b.bounds = NULL;
+  b.results = rs;
+  b.oks = oks;
+  b.num = n;
+  b.next = 0;
+  b.stop = n;
+  
+  mpc_batch_work(&b, mpc_batch_run_files, nthreads);
+  
+  for (i = 0; i < n; i++) { parsed += oks[i]; }
+  return parsed;
 }
 
 /*
-** As `snprintf` is not ANSI standard this 
-** function `mpc_expectf` should be considered
-** unsafe.
-**
-** You have a few options if this is going to be
-** trouble.
-**
-** - Ensure the format string does not exceed
-**   the buffer length using precision specifiers
-**   such as `%.512s`.
+** Split Parsing
 **
-** - Patch this function in your code base to 
-**   use `snprintf` or whatever variant your
-**   system supports.
-**
-** - Avoid it altogether.
+** A long run of top level forms is cut into
+** chunks by a scan which only looks at brackets,
+** strings and comments. A cut is only made just
+** after a bracket which closes a top level form
+** and only once the chunk has grown past its
+** share of the input, so there are a few chunks
+** for each thread. Each chunk is parsed on its
+** own and the forms under their roots are moved
+** under the root of the first.
 **
+** Because every chunk begins where a whole parse
+** would be looking for the next form the result
+** is the same. On failure the error of the first
+** chunk that failed is moved to where it is in
+** the whole input.
 */
 
-mpc_parser_t *mpc_expectf(mpc_parser_t *a, const char *fmt, ...) {
-  va_list va;
-  char *buffer;
+enum {
+  MPC_SPLIT_CHUNKS = 4,
+  MPC_SPLIT_MIN = 65536
+};
 
-  mpc_parser_t *p = mpc_undefined();
-  p->type = MPC_TYPE_EXPECT;
+#ifdef MPC_USE_SSE2
+
+static size_t mpc_split_find_sse2(const char *s, size_t n, const char *set) {
   
-  va_start(va, fmt);
-  buffer = malloc(2048);
-  vsprintf(buffer, fmt, va);
-  va_end(va);
+  int j, mask;
+  size_t k = 0;
+  __m128i v, m;
   
-  buffer = realloc(buffer, strlen(buffer) + 1);
-  p->data.expect.x = a;
-  p->data.expect.m = buffer;
-  return p;
+  while (k + 16 <= n) {
+    
+    v = _mm_loadu_si128((const __m128i*)(s + k));
+    m = _mm_setzero_si128();
+    for (j = 0; set[j]; j++) {
+      m = _mm_or_si128(m, _mm_cmpeq_epi8(v, _mm_set1_epi8(set[j])));
+    }
+    
+    mask = _mm_movemask_epi8(m);
+    if (mask) {
+      for (j = 0; !(mask & (1 << j)); j++);
+      return k + j;
+    }
+    
+    k += 16;
+  }
+  
+  return k;
 }
 
-/*
-** Basic Parsers
-*/
+#endif
 
-mpc_parser_t *mpc_any(void) {
-  mpc_parser_t *p = mpc_undefined();
-  p->type = MPC_TYPE_ANY;
-  return mpc_expect(p, "any character");
-}
-
-mpc_parser_t *mpc_char(char c) {
-  mpc_parser_t *p = mpc_undefined();
-  p->type = MPC_TYPE_SINGLE;
-  p->data.single.x = c;
-  return mpc_expectf(p, "'%c'", c);
-}
-
-mpc_parser_t *mpc_range(char s, char e) {
-  mpc_parser_t *p = mpc_undefined();
-  p->type = MPC_TYPE_RANGE;
-  p->data.range.x = s;
-  p->data.range.y = e;
-  return mpc_expectf(p, "character between '%c' and '%c'", s, e);
+/* Index of the first character of `s` in `set`, or `n` if there is none */
+static size_t mpc_split_find(const char *s, size_t n, const char *set) {
+  
+  size_t k = 0;
+  
+#ifdef MPC_USE_SSE2
+  k = mpc_split_find_sse2(s, n, set);
+#endif
+  
+  while (k < n && (s[k] == '\0' || strchr(set, s[k]) == NULL)) { k++; }
+  return k;
 }
 
-mpc_parser_t *mpc_oneof(const char *s) {
-  mpc_parser_t *p = mpc_undefined();
-  p->type = MPC_TYPE_ONEOF;
-  p->data.string.x = malloc(strlen(s) + 1);
-  strcpy(p->data.string.x, s);
-  return mpc_expectf(p, "one of '%s'", s);
+static int mpc_split_bounds(const char *s, size_t n, const mpc_split_t *sp, size_t *bounds, int max) {
+  
+  size_t k = 0, share = n / max;
+  int num = 1, depth = 0;
+  char *top = malloc(strlen(sp->open) + strlen(sp->close) + 3);
+  char str[3];
+  char c;
+  
+  sprintf(top, "%s%s", sp->open, sp->close);
+  if (sp->quote) { strncat(top, &sp->quote, 1); }
+  if (sp->comment) { strncat(top, &sp->comment, 1); }
+  
+  str[0] = sp->quote;
+  str[1] = sp->escape;
+  str[2] = '\0';
+  
+  bounds[0] = 0;
+  
+  while (num < max) {
+    
+    k += mpc_split_find(s + k, n - k, top);
+    if (k >= n) { break; }
+    c = s[k++];
+    
+    if (c == sp->quote) {
+      while (k < n) {
+        k += mpc_split_find(s + k, n - k, str);
+        if (k >= n) { break; }
+        if (s[k++] == sp->quote) { break; }
+        k++;
+      }
+    } else if (c == sp->comment) {
+      k += mpc_split_find(s + k, n - k, "\n");
+    } else if (strchr(sp->close, c)) {
+      if (depth > 0 && --depth == 0 && k >= share * num) { bounds[num++] = k; }
+    } else {
+      depth++;
+    }
+    
+  }
+  
+  bounds[num] = n;
+  free(top);
+  return num;
 }
 
-mpc_parser_t *mpc_noneof(const char *s) {
-  mpc_parser_t *p = mpc_undefined();
-  p->type = MPC_TYPE_NONEOF;
-  p->data.string.x = malloc(strlen(s) + 1);
-  strcpy(p->data.string.x, s);
-  return mpc_expectf(p, "one of '%s'", s);
-
+/* Moves an error in a chunk starting at `off` to where it is in `s` */
+static void mpc_split_err_move(mpc_err_t *e, const char *s, size_t off) {
+  
+  const char *x = s, *l = s;
+  int rows = 0;
+  
+  while ((x = memchr(x, '\n', (s + off) - x))) { rows++; l = ++x; }
+  
+  if (e->state.row == 0) { e->state.col += (int)((s + off) - l); }
+  e->state.row += rows;
+  e->state.pos += (long)off;
 }
 
-mpc_parser_t *mpc_satisfy(int(*f)(char)) {
-  mpc_parser_t *p = mpc_undefined();
-  p->type = MPC_TYPE_SATISFY;
-  p->data.satisfy.f = f;
-  return mpc_expectf(p, "character satisfying function %p", f);
+static mpc_ast_t *mpc_split_stitch(mpc_result_t *rs, int num) {
+  
+  mpc_ast_t *r = rs[0].output, *a;
+  mpc_ast_t **children;
+  int i, j, n = 0;
+  
+  for (j = 0; j < num; j++) {
+    n += ((mpc_ast_t*)rs[j].output)->children_num - 2;
+  }
+  
+  children = malloc(sizeof(mpc_ast_t*) * (n + 2));
+  children[0] = r->children[0];
+  n = 1;
+  
+  for (j = 0; j < num; j++) {
+    a = rs[j].output;
+    for (i = 1; i < a->children_num-1; i++) { children[n++] = a->children[i]; }
+    if (j > 0) { mpc_ast_delete(a->children[0]); }
+    if (j < num-1) { mpc_ast_delete(a->children[a->children_num-1]); }
+  }
+  
+  a = rs[num-1].output;
+  children[n++] = a->children[a->children_num-1];
+  
+  for (j = 1; j < num; j++) {
+    a = rs[j].output;
+    a->children_num = 0;
+    mpc_ast_delete(a);
+  }
+  
+  free(r->children);
+  r->children = children;
+  r->children_num = n;
+  return r;
 }
 
-mpc_parser_t *mpc_string(const char *s) {
-  mpc_parser_t *p = mpc_undefined();
-  p->type = MPC_TYPE_STRING;
-  p->data.string.x = malloc(strlen(s) + 1);
-  strcpy(p->data.string.x, s);
-  return mpc_expectf(p, "\"%s\"", s);
+int mpc_parse_split(const char *filename, const char *string, size_t length, mpc_parser_t *p, const mpc_split_t *s, int nthreads, mpc_result_t *r) {
+  
+  mpc_batch_t b;
+  int j, failed = -1, max;
+  
+  if (nthreads < 1) { nthreads = 1; }
+  max = nthreads * MPC_SPLIT_CHUNKS;
+  if ((size_t)max > length / MPC_SPLIT_MIN + 1) { max = (int)(length / MPC_SPLIT_MIN + 1); }
+  
+  b.parser = p;
+  b.filenames = NULL;
+  b.filename = filename;
+  b.string = string;
+  b.bounds = malloc(sizeof(size_t) * (max + 1));
+  b.num = mpc_split_bounds(string, length, s, b.bounds, max);
+  b.results = malloc(sizeof(mpc_result_t) * b.num);
+  b.oks = malloc(sizeof(int) * b.num);
+  b.next = 0;
+  b.stop = b.num;
+  
+  mpc_batch_work(&b, mpc_batch_run_chunks, nthreads);
+  
+  /* Chunks are taken in order so every one before `next` was parsed */
+  for (j = 0; j < b.next; j++) {
+    if (!b.oks[j] && failed == -1) { failed = j; }
+  }
+  
+  if (failed == -1) {
+    r->output = mpc_split_stitch(b.results, b.num);
+  } else {
+    r->error = b.results[failed].error;
+    mpc_split_err_move(r->error, string, b.bounds[failed]);
+    for (j = 0; j < b.next; j++) {
+      if (j == failed) { continue; }
+      if (b.oks[j]) { mpc_ast_delete(b.results[j].output); }
+      else { mpc_err_delete(b.results[j].error); }
+    }
+  }
+  
+  free(b.bounds);
+  free(b.results);
+  free(b.oks);
+  return failed == -1;
 }
 
 /*
-** Core Parsers
+** Recognition
+**
+** To only find out if some input parses, the
+** grammar is run by a loop of its own which
+** never calls a fold, apply or constructor and
+** never makes an output. Every result on the
+** stack is NULL, repeats drop each result as
+** soon as it arrives rather than keeping them
+** to fold, and errors are kept as the farthest
+** failure. The answer is the same as for
+** `mpc_parse`.
 */
 
-mpc_parser_t *mpc_apply(mpc_parser_t *a, mpc_apply_t f) {
-  mpc_parser_t *p = mpc_undefined();
-  p->type = MPC_TYPE_APPLY;
-  p->data.apply.x = a;
-  p->data.apply.f = f;
-  return p;
-}
+#define MPC_CONTINUE(st, x) mpc_stack_set_state(stk, st); mpc_stack_pushp(stk, x); continue
+#define MPC_SUCCESS() mpc_stack_popp(stk, &p, &st); mpc_stack_pushr(stk, mpc_result_out(NULL), 1); continue
+#define MPC_FAILURE(x) mpc_stack_popp(stk, &p, &st); mpc_stack_pushr(stk, mpc_result_err(x), 0); continue
+#define MPC_PRIMATIVE(f) if (f) { MPC_SUCCESS(); } else { MPC_FAILURE(mpc_stack_fail(stk, i, "Incorrect Input")); }
 
-mpc_parser_t *mpc_apply_to(mpc_parser_t *a, mpc_apply_to_t f, void *x) {
-  mpc_parser_t *p = mpc_undefined();
-  p->type = MPC_TYPE_APPLY_TO;
-  p->data.apply_to.x = a;
-  p->data.apply_to.f = f;
-  p->data.apply_to.d = x;
-  return p;
+static void mpc_recognize_run(mpc_input_t *i, mpc_stack_t *stk) {
+  
+  /* Stack */
+  int st = 0;
+  mpc_parser_t *p = NULL;
+  
+  /* Variables */
+  char *s;
+  mpc_result_t r;
+  mpc_memo_t *m;
+  mpc_err_t *e;
+  
+  while (!mpc_stack_empty(stk)) {
+    
+    mpc_stack_peepp(stk, &p, &st);
+    
+    switch (p->type) {
+      
+      /* Trivial Parsers */
+      
+      case MPC_TYPE_UNDEFINED: MPC_FAILURE(mpc_stack_fail(stk, i, "Parser Undefined!"));
+      case MPC_TYPE_FAIL:      MPC_FAILURE(mpc_stack_fail(stk, i, p->data.fail.m));
+      case MPC_TYPE_PASS:
+      case MPC_TYPE_LIFT:
+      case MPC_TYPE_LIFT_VAL:  MPC_SUCCESS();
+      
+      /* Basic Parsers */
+      
+      case MPC_TYPE_SOI:       MPC_PRIMATIVE(mpc_input_soi(i));
+      case MPC_TYPE_EOI:       MPC_PRIMATIVE(mpc_input_eoi(i));
+      case MPC_TYPE_ANY:       MPC_PRIMATIVE(mpc_input_any(i, NULL));
+      case MPC_TYPE_SINGLE:    MPC_PRIMATIVE(mpc_input_char(i, p->data.single.x, NULL));
+      case MPC_TYPE_SATISFY:   MPC_PRIMATIVE(mpc_input_satisfy(i, p->data.satisfy.f, NULL));
+      case MPC_TYPE_STRING:    MPC_PRIMATIVE(mpc_input_string(i, p->data.string.x, NULL));
+      case MPC_TYPE_CLASS:
+        if (mpc_input_class(i, p->data.class.x, NULL)) { MPC_SUCCESS(); }
+        if (p->data.class.err == NULL) { MPC_FAILURE(mpc_stack_fail(stk, i, "Incorrect Input")); }
+        MPC_FAILURE(mpc_stack_at(stk, i, p->data.class.err));
+      
+      case MPC_TYPE_REGEX:
+        if (mpc_regex_run(i, stk, &p->data.regex, NULL, &e)) { MPC_SUCCESS(); }
+        MPC_FAILURE(e);
+      
+      /* Application Parsers */
+      
+      case MPC_TYPE_EXPECT:
+        if (st == 0) { stk->quiet++; MPC_CONTINUE(1, p->data.expect.x); }
+        stk->quiet--;
+        if (mpc_stack_popr(stk, &r)) { MPC_SUCCESS(); }
+        MPC_FAILURE(mpc_stack_expect(stk, i, p->data.expect.m));
+      
+      /* The result of the child is theirs as it is */
+      case MPC_TYPE_APPLY:
+      case MPC_TYPE_APPLY_TO:
+        if (st == 0) { MPC_CONTINUE(1, p->data.apply.x); }
+        mpc_stack_popp(stk, &p, &st);
+        continue;
+      
+      case MPC_TYPE_PREDICT:
+        if (st == 0) { mpc_input_backtrack_disable(i); MPC_CONTINUE(1, p->data.predict.x); }
+        mpc_input_backtrack_enable(i);
+        mpc_stack_popp(stk, &p, &st);
+        continue;
+      
+      /* Optional Parsers */
+      
+      case MPC_TYPE_NOT:
+        if (st == 0) { mpc_input_mark(i); MPC_CONTINUE(1, p->data.not.x); }
+        if (mpc_stack_popr(stk, &r)) {
+          mpc_input_rewind(i);
+          MPC_FAILURE(mpc_stack_expect(stk, i, "opposite"));
+        }
+        mpc_input_unmark(i);
+        MPC_SUCCESS();
+      
+      case MPC_TYPE_MAYBE:
+        if (st == 0) { MPC_CONTINUE(1, p->data.not.x); }
+        mpc_stack_popr(stk, &r);
+        MPC_SUCCESS();
+      
+      /* Repeat Parsers */
+      
+      case MPC_TYPE_MANY:
+      case MPC_TYPE_MANY1:
+        if (st == 0 && mpc_span_single(p->data.repeat.x, &s)) {
+          if (mpc_span_skip(i, p) == 0 && p->type == MPC_TYPE_MANY1) {
+            MPC_FAILURE(mpc_err_many1(mpc_span_err(i, stk, p)));
+          }
+          mpc_span_err(i, stk, p);
+          MPC_SUCCESS();
+        }
+        if (st == 0) { MPC_CONTINUE(1, p->data.repeat.x); }
+        if (mpc_stack_popr(stk, &r)) { MPC_CONTINUE(st+1, p->data.repeat.x); }
+        if (st == 1 && p->type == MPC_TYPE_MANY1) { MPC_FAILURE(mpc_err_many1(r.error)); }
+        MPC_SUCCESS();
+      
+      case MPC_TYPE_COUNT:
+        if (st == 0) { mpc_input_mark(i); MPC_CONTINUE(1, p->data.repeat.x); }
+        if (mpc_stack_popr(stk, &r)) { MPC_CONTINUE(st+1, p->data.repeat.x); }
+        if (st != p->data.repeat.n+1) {
+          mpc_input_rewind(i);
+          MPC_FAILURE(mpc_err_count(r.error, p->data.repeat.n));
+        }
+        mpc_input_unmark(i);
+        MPC_SUCCESS();
+      
+      /* Combinatory Parsers */
+      
+      case MPC_TYPE_OR:
+        if (p->data.or.n == 0) { MPC_SUCCESS(); }
+        if (st > 0 && mpc_stack_peekr(stk, &r)) {
+          mpc_stack_popr_n(stk, st);
+          MPC_SUCCESS();
+        }
+        st = mpc_or_skip(i, stk, p, st);
+        if (st < p->data.or.n) { MPC_CONTINUE(st+1, p->data.or.xs[st]); }
+        MPC_FAILURE(mpc_stack_merger_err(stk, p->data.or.n));
+      
+      case MPC_TYPE_AND:
+        if (p->data.and.n == 0) { MPC_SUCCESS(); }
+        if (st == 0) { mpc_input_mark(i); MPC_CONTINUE(1, p->data.and.xs[0]); }
+        if (!mpc_stack_popr(stk, &r)) {
+          mpc_input_rewind(i);
+          MPC_FAILURE(r.error);
+        }
+        if (st < p->data.and.n) { MPC_CONTINUE(st+1, p->data.and.xs[st]); }
+        mpc_input_unmark(i);
+        MPC_SUCCESS();
+      
+      /* Memo Parsers */
+      
+      case MPC_TYPE_MEMO:
+        if (st == 0) {
+          m = mpc_stack_memo_find(stk, p, i->state.pos);
+          if (m) {
+            mpc_input_jump(i, m->state);
+            if (m->success) { MPC_SUCCESS(); }
+            MPC_FAILURE(NULL);
+          }
+          mpc_stack_memo_enter(stk, i);
+          MPC_CONTINUE(1, p->data.memo.x);
+        }
+        mpc_stack_memo_leave(stk, p, i);
+        mpc_stack_popp(stk, &p, &st);
+        continue;
+      
+      /* End */
+      
+      default:
+        MPC_FAILURE(mpc_stack_fail(stk, i, "Unknown Parser Type Id!"));
+    }
+  }
+  
 }
 
-mpc_parser_t *mpc_predictive(mpc_parser_t *a) {
-  mpc_parser_t *p = mpc_undefined();
-  p->type = MPC_TYPE_PREDICT;
-  p->data.predict.x = a;
-  return p;
-}
+#undef MPC_CONTINUE
+#undef MPC_SUCCESS
+#undef MPC_FAILURE
+#undef MPC_PRIMATIVE
 
-mpc_parser_t *mpc_not_lift(mpc_parser_t *a, mpc_dtor_t da, mpc_ctor_t lf) {
-  mpc_parser_t *p = mpc_undefined();
-  p->type = MPC_TYPE_NOT;
-  p->data.not.x = a;
-  p->data.not.dx = da;
-  p->data.not.lf = lf;
-  return p;
+int mpc_recognize(mpc_parser_t *p, const char *string, long *err_pos) {
+  
+  int success;
+  mpc_stack_t stk;
+  mpc_input_t *i = mpc_input_new_string("<mpc_recognize>", string);
+  
+  mpc_stack_init(&stk);
+  stk.lazy = 1;
+  stk.recognize = 1;
+  mpc_stack_reset(&stk, i->filename);
+  
+  mpc_stack_pushp(&stk, p);
+  mpc_recognize_run(i, &stk);
+  
+  success = stk.returns[0];
+  if (err_pos) { *err_pos = success ? -1 : (stk.far.pos < 0 ? 0 : stk.far.pos); }
+  
+  mpc_stack_memo_delete(&stk);
+  mpc_stack_free(&stk);
+  mpc_input_delete(i);
+  
+  return success;
 }
 
-mpc_parser_t *mpc_not(mpc_parser_t *a, mpc_dtor_t da) {
-  return mpc_not_lift(a, da, mpcf_ctor_null);
-}
+/*
+** Push Parsing
+**
+** Here the caller hands over input as it arrives
+** using `mpc_feed` and collects each value with
+** `mpc_push_next`. A parse which runs out of input
+** is suspended with its stack intact and resumes
+** from the same point when more is fed in, so
+** nothing is ever parsed twice.
+**
+** A value is only returned once its parser has
+** finished, which includes any lookahead it does
+** past the end of the value. For example a token
+** which strips trailing whitespace is not done
+** until it sees the next non-whitespace character
+** or the end of input.
+**
+** When a value fails to parse everything fed in
+** but not yet parsed is thrown away along with it,
+** and the next value is looked for in whatever is
+** fed in after.
+**
+** Deleting a push parser part way through a
+** value ends the input where it is and lets the
+** parse finish, so the partial results are freed
+** by the same destructors a failure would call.
+** Should the value still be complete without
+** any more input it is given to `d`.
+*/
 
-mpc_parser_t *mpc_maybe_lift(mpc_parser_t *a, mpc_ctor_t lf) {
-  mpc_parser_t *p = mpc_undefined();
-  p->type = MPC_TYPE_MAYBE;
-  p->data.not.x = a;
-  p->data.not.lf = lf;
-  return p;
-}
+struct mpc_push_t {
+  mpc_input_t *input;
+  mpc_parser_t *parser;
+  mpc_stack_t *stack;
+  mpc_dtor_t dtor;
+};
 
-mpc_parser_t *mpc_maybe(mpc_parser_t *a) {
-  return mpc_maybe_lift(a, mpcf_ctor_null);
+mpc_push_t *mpc_push_new(const char *filename, mpc_parser_t *p, mpc_dtor_t d) {
+  mpc_push_t *x = malloc(sizeof(mpc_push_t));
+  x->input = mpc_input_new_push(filename);
+  x->parser = p;
+  x->stack = NULL;
+  x->dtor = d;
+  return x;
 }
 
-mpc_parser_t *mpc_many(mpc_fold_t f, mpc_parser_t *a) {
-  mpc_parser_t *p = mpc_undefined();
-  p->type = MPC_TYPE_MANY;
-  p->data.repeat.x = a;
-  p->data.repeat.f = f;
-  return p;
+void mpc_push_delete(mpc_push_t *x) {
+  
+  mpc_result_t r;
+  
+  if (x->stack) {
+    x->input->eof = 1;
+    x->input->suspended = 0;
+    mpc_parse_run(x->input, x->stack);
+    if (mpc_stack_terminate(x->stack, &r)) {
+      x->dtor(r.output);
+    } else {
+      mpc_err_delete(r.error);
+    }
+  }
+  
+  mpc_input_delete(x->input);
+  free(x);
 }
 
-mpc_parser_t *mpc_many1(mpc_fold_t f, mpc_parser_t *a) {
-  mpc_parser_t *p = mpc_undefined();
-  p->type = MPC_TYPE_MANY1;
-  p->data.repeat.x = a;
-  p->data.repeat.f = f;
-  return p;
+void mpc_feed(mpc_push_t *x, const char *data, size_t n) {
+  mpc_input_buffer_feed(x->input, data, n);
 }
 
-mpc_parser_t *mpc_count(int n, mpc_fold_t f, mpc_parser_t *a, mpc_dtor_t da) {
-  mpc_parser_t *p = mpc_undefined();
-  p->type = MPC_TYPE_COUNT;
-  p->data.repeat.n = n;
-  p->data.repeat.f = f;
-  p->data.repeat.x = a;
-  p->data.repeat.dx = da;
-  return p;
+void mpc_push_end(mpc_push_t *x) {
+  x->input->eof = 1;
 }
 
-mpc_parser_t *mpc_or(int n, ...) {
-
-  int i;
-  va_list va;
-
-  mpc_parser_t *p = mpc_undefined();
+int mpc_push_next(mpc_push_t *x, mpc_result_t *r) {
   
-  p->type = MPC_TYPE_OR;
-  p->data.or.n = n;
-  p->data.or.xs = malloc(sizeof(mpc_parser_t*) * n);
+  mpc_input_t *i = x->input;
+  int success;
   
-  va_start(va, n);  
-  for (i = 0; i < n; i++) {
-    p->data.or.xs[i] = va_arg(va, mpc_parser_t*);
+  if (!x->stack) {
+    if (mpc_input_buffer_in_range(i)) {
+      x->stack = mpc_stack_new(i->filename);
+      mpc_stack_pushp(x->stack, x->parser);
+    } else {
+      return i->eof ? MPC_PUSH_DONE : MPC_PUSH_MORE;
+    }
   }
-  va_end(va);
   
-  return p;
-}
-
-mpc_parser_t *mpc_and(int n, mpc_fold_t f, ...) {
-
-  int i;
-  va_list va;
-
-  mpc_parser_t *p = mpc_undefined();
+  i->suspended = 0;
+  if (!mpc_parse_run(i, x->stack)) { return MPC_PUSH_MORE; }
   
-  p->type = MPC_TYPE_AND;
-  p->data.and.n = n;
-  p->data.and.f = f;
-  p->data.and.xs = malloc(sizeof(mpc_parser_t*) * n);
-  p->data.and.dxs = malloc(sizeof(mpc_dtor_t) * (n-1));
-
-  va_start(va, f);  
-  for (i = 0; i < n; i++) {
-    p->data.and.xs[i] = va_arg(va, mpc_parser_t*);
+  success = mpc_stack_terminate(x->stack, r);
+  x->stack = NULL;
+  
+  /* The failed input would only fail again, so it is dropped */
+  if (!success) {
+    while (mpc_input_buffer_in_range(i)) {
+      mpc_input_success(i, mpc_input_buffer_get(i), NULL);
+    }
   }
-  for (i = 0; i < (n-1); i++) {
-    p->data.and.dxs[i] = va_arg(va, mpc_dtor_t);
-  }  
-  va_end(va);
   
-  return p;
+  return success ? MPC_PUSH_OUTPUT : MPC_PUSH_ERROR;
 }
 
 /*
-** Common Parsers
+** Building a Parser
 */
 
-mpc_parser_t *mpc_eoi(void) {
-  mpc_parser_t *p = mpc_undefined();
-  p->type = MPC_TYPE_EOI;
-  return mpc_expect(p, "end of input");
-}
+static void mpc_undefine_unretained(mpc_parser_t *p, int force);
 
-mpc_parser_t *mpc_soi(void) {
-  mpc_parser_t *p = mpc_undefined();
-  p->type = MPC_TYPE_SOI;
-  return mpc_expect(p, "start of input");
+static void mpc_undefine_or(mpc_parser_t *p) {
+  
+  int i;
+  for (i = 0; i < p->data.or.n; i++) {
+    mpc_undefine_unretained(p->data.or.xs[i], 0);
+  }
+  free(p->data.or.xs);
+  mpc_or_first_delete(p);
+  
 }
 
-mpc_parser_t *mpc_whitespace(void) { return mpc_expect(mpc_oneof(" \f\n\r\t\v"), "whitespace"); }
-mpc_parser_t *mpc_whitespaces(void) { return mpc_expect(mpc_many(mpcf_strfold, mpc_whitespace()), "spaces"); }
-mpc_parser_t *mpc_blank(void) { return mpc_expect(mpc_apply(mpc_whitespaces(), mpcf_free), "whitespace"); }
-
-mpc_parser_t *mpc_newline(void) { return mpc_expect(mpc_char('\n'), "newline"); }
-mpc_parser_t *mpc_tab(void) { return mpc_expect(mpc_char('\t'), "tab"); }
-mpc_parser_t *mpc_escape(void) { return mpc_and(2, mpcf_strfold, mpc_char('\\'), mpc_any(), free); }
-
-mpc_parser_t *mpc_digit(void) { return mpc_expect(mpc_oneof("012345689"), "digit"); }
-mpc_parser_t *mpc_hexdigit(void) { return mpc_expect(mpc_oneof("0123456789ABCDEFabcdef"), "hex digit"); }
-mpc_parser_t *mpc_octdigit(void) { return mpc_expect(mpc_oneof("01234567"), "oct digit"); }
-mpc_parser_t *mpc_digits(void) { return mpc_expect(mpc_many1(mpcf_strfold, mpc_digit()), "digits"); }
-mpc_parser_t *mpc_hexdigits(void) { return mpc_expect(mpc_many1(mpcf_strfold, mpc_hexdigit()), "hex digits"); }
-mpc_parser_t *mpc_octdigits(void) { return mpc_expect(mpc_many1(mpcf_strfold, mpc_octdigit()), "oct digits"); }
-
-mpc_parser_t *mpc_lower(void) { return mpc_expect(mpc_oneof("abcdefghijklmnopqrstuvwxyz"), "lowercase letter"); }
-mpc_parser_t *mpc_upper(void) { return mpc_expect(mpc_oneof("ABCDEFGHIJKLMNOPQRSTUVWXYZ"), "uppercase letter"); }
-mpc_parser_t *mpc_alpha(void) { return mpc_expect(mpc_oneof("abcdefghijklmnopqrstuvwxyzABCDEFGHIJKLMNOPQRSTUVWXYZ"), "letter"); }
-mpc_parser_t *mpc_underscore(void) { return mpc_expect(mpc_char('_'), "underscore"); }
-mpc_parser_t *mpc_alphanum(void) { return mpc_expect(mpc_or(3, mpc_alpha(), mpc_digit(), mpc_underscore()), "alphanumeric"); }
-
-mpc_parser_t *mpc_int(void) { return mpc_expect(mpc_apply(mpc_digits(), mpcf_int), "integer"); }
-mpc_parser_t *mpc_hex(void) { return mpc_expect(mpc_apply(mpc_hexdigits(), mpcf_hex), "hexadecimal"); }
-mpc_parser_t *mpc_oct(void) { return mpc_expect(mpc_apply(mpc_octdigits(), mpcf_oct), "octadecimal"); }
-mpc_parser_t *mpc_number(void) { return mpc_expect(mpc_or(3, mpc_int(), mpc_hex(), mpc_oct()), "number"); }
-
-mpc_parser_t *mpc_real(void) {
+static void mpc_undefine_and(mpc_parser_t *p) {
+  
+  int i;
+  for (i = 0; i < p->data.and.n; i++) {
+    mpc_undefine_unretained(p->data.and.xs[i], 0);
+  }
+  free(p->data.and.xs);
+  free(p->data.and.dxs);
+  
+}
 
-  /* [+-]?\d+(\.\d+)?([eE][+-]?[0-9]+)? */
+static void mpc_undefine_unretained(mpc_parser_t *p, int force) {
   
-  mpc_parser_t *p0, *p1, *p2, *p30, *p31, *p32, *p3;
+  if (p->retained && !force) { return; }
   
-  p0 = mpc_maybe_lift(mpc_oneof("+-"), mpcf_ctor_str);
-  p1 = mpc_digits();
-  p2 = mpc_maybe_lift(mpc_and(2, mpcf_strfold, mpc_char('.'), mpc_digits(), free), mpcf_ctor_str);
-  p30 = mpc_oneof("eE");
-  p31 = mpc_maybe_lift(mpc_oneof("+-"), mpcf_ctor_str);
-  p32 = mpc_digits();
-  p3 = mpc_maybe_lift(mpc_and(3, mpcf_strfold, p30, p31, p32, free, free), mpcf_ctor_str);
+  switch (p->type) {
+    
+    case MPC_TYPE_FAIL: free(p->data.fail.m); break;
+    
+    case MPC_TYPE_STRING:
+      free(p->data.string.x); 
+      break;
+    
+    case MPC_TYPE_CLASS:
+      if (p->data.class.err) { mpc_err_delete(p->data.class.err); }
+      break;
+    
+    case MPC_TYPE_APPLY:    mpc_undefine_unretained(p->data.apply.x, 0);    break;
+    case MPC_TYPE_APPLY_TO: mpc_undefine_unretained(p->data.apply_to.x, 0); break;
+    case MPC_TYPE_PREDICT:  mpc_undefine_unretained(p->data.predict.x, 0);  break;
+    case MPC_TYPE_MEMO:     mpc_undefine_unretained(p->data.memo.x, 0);     break;
+    
+    case MPC_TYPE_REGEX:
+      mpc_undefine_unretained(p->data.regex.x, 0);
+      mpc_regex_delete(&p->data.regex);
+      break;
+    
+    case MPC_TYPE_MAYBE:
+    case MPC_TYPE_NOT:
+      mpc_undefine_unretained(p->data.not.x, 0);
+      break;
+    
+    case MPC_TYPE_EXPECT:
+      mpc_undefine_unretained(p->data.expect.x, 0);
+      free(p->data.expect.m);
+      break;
+      
+    case MPC_TYPE_MANY:
+    case MPC_TYPE_MANY1:
+    case MPC_TYPE_COUNT:
+      mpc_undefine_unretained(p->data.repeat.x, 0);
+      break;
+    
+    case MPC_TYPE_OR:  mpc_undefine_or(p);  break;
+    case MPC_TYPE_AND: mpc_undefine_and(p); break;
+    
+    default: break;
+  }
+  
+  if (!force) {
+    free(p->name);
+    free(p);
+  }
   
-  return mpc_expect(mpc_and(4, mpcf_strfold, p0, p1, p2, p3, free, free, free), "real");
-
 }
 
-mpc_parser_t *mpc_float(void) {
-  return mpc_expect(mpc_apply(mpc_real(), mpcf_float), "float");
-}
+void mpc_delete(mpc_parser_t *p) {
+  if (p->retained) {
 
-mpc_parser_t *mpc_char_lit(void) {
-  return mpc_expect(mpc_between(mpc_or(2, mpc_escape(), mpc_any()), free, "'", "'"), "char");
+    if (p->type != MPC_TYPE_UNDEFINED) {
+      mpc_undefine_unretained(p, 0);
+    } 
+    
+    free(p->name);
+    free(p);
+  
+  } else {
+    mpc_undefine_unretained(p, 0);  
+  }
 }
 
-mpc_parser_t *mpc_string_lit(void) {
-  mpc_parser_t *strchar = mpc_or(2, mpc_escape(), mpc_noneof("\""));
-  return mpc_expect(mpc_between(mpc_many(mpcf_strfold, strchar), free, "\"", "\""), "string");
+static void mpc_soft_delete(mpc_val_t *x) {
+  mpc_undefine_unretained(x, 0);
 }
 
-mpc_parser_t *mpc_regex_lit(void) {  
-  mpc_parser_t *regexchar = mpc_or(2, mpc_escape(), mpc_noneof("/"));
-  return mpc_expect(mpc_between(mpc_many(mpcf_strfold, regexchar), free, "/", "/"), "regex");
+static mpc_parser_t *mpc_undefined(void) {
+  mpc_parser_t *p = calloc(1, sizeof(mpc_parser_t));
+  p->retained = 0;
+  p->type = MPC_TYPE_UNDEFINED;
+  p->name = NULL;
+  return p;
 }
 
-mpc_parser_t *mpc_ident(void) {
-  mpc_parser_t *p0, *p1; 
-  p0 = mpc_or(2, mpc_alpha(), mpc_underscore());
-  p1 = mpc_many(mpcf_strfold, mpc_alphanum()); 
-  return mpc_and(2, mpcf_strfold, p0, p1, free);
+mpc_parser_t *mpc_new(const char *name) {
+  mpc_parser_t *p = mpc_undefined();
+  p->retained = 1;
+  p->name = realloc(p->name, strlen(name) + 1);
+  strcpy(p->name, name);
+  return p;
 }
 
-/*
-** Useful Parsers
-*/
-
-mpc_parser_t *mpc_startwith(mpc_parser_t *a) { return mpc_and(2, mpcf_snd, mpc_soi(), a, mpcf_dtor_null); }
-mpc_parser_t *mpc_endwith(mpc_parser_t *a, mpc_dtor_t da) { return mpc_and(2, mpcf_fst, a, mpc_eoi(), da); }
-mpc_parser_t *mpc_whole(mpc_parser_t *a, mpc_dtor_t da) { return mpc_and(3, mpcf_snd, mpc_soi(), a, mpc_eoi(), mpcf_dtor_null, da); }
-
-mpc_parser_t *mpc_stripl(mpc_parser_t *a) { return mpc_and(2, mpcf_snd, mpc_blank(), a, mpcf_dtor_null); }
-mpc_parser_t *mpc_stripr(mpc_parser_t *a) { return mpc_and(2, mpcf_fst, a, mpc_blank(), mpcf_dtor_null); }
-mpc_parser_t *mpc_strip(mpc_parser_t *a) { return mpc_and(3, mpcf_snd, mpc_blank(), a, mpc_blank(), mpcf_dtor_null, mpcf_dtor_null); }
-mpc_parser_t *mpc_tok(mpc_parser_t *a) { return mpc_and(2, mpcf_fst, a, mpc_blank(), mpcf_dtor_null); }
-mpc_parser_t *mpc_sym(const char *s) { return mpc_tok(mpc_string(s)); }
-
-mpc_parser_t *mpc_total(mpc_parser_t *a, mpc_dtor_t da) { return mpc_whole(mpc_strip(a), da); }
+mpc_parser_t *mpc_undefine(mpc_parser_t *p) {
+  mpc_undefine_unretained(p, 1);
+  p->type = MPC_TYPE_UNDEFINED;
+  return p;
+}
 
-mpc_parser_t *mpc_between(mpc_parser_t *a, mpc_dtor_t ad, const char *o, const char *c) {
-  return mpc_and(3, mpcf_snd_free,
-    mpc_string(o), a, mpc_string(c),
-    free, ad);
+mpc_parser_t *mpc_define(mpc_parser_t *p, mpc_parser_t *a) {
+  
+  if (p->retained) {
+    p->type = a->type;
+    p->data = a->data;
+  } else {
+    mpc_parser_t *a2 = mpc_failf("Attempt to assign to Unretained Parser!");
+    p->type = a2->type;
+    p->data = a2->data;
+    free(a2);
+  }
+  
+  free(a);
+  return p;  
 }
 
-mpc_parser_t *mpc_parens(mpc_parser_t *a, mpc_dtor_t ad)   { return mpc_between(a, ad, "(", ")"); }
-mpc_parser_t *mpc_braces(mpc_parser_t *a, mpc_dtor_t ad)   { return mpc_between(a, ad, "<", ">"); }
-mpc_parser_t *mpc_brackets(mpc_parser_t *a, mpc_dtor_t ad) { return mpc_between(a, ad, "{", "}"); }
-mpc_parser_t *mpc_squares(mpc_parser_t *a, mpc_dtor_t ad)  { return mpc_between(a, ad, "[", "]"); }
+void mpc_cleanup(int n, ...) {
+  int i;
+  mpc_parser_t **list = malloc(sizeof(mpc_parser_t*) * n);
+  
+  va_list va;
+  va_start(va, n);
+  for (i = 0; i < n; i++) { list[i] = va_arg(va, mpc_parser_t*); }
+  for (i = 0; i < n; i++) { mpc_undefine(list[i]); }
+  for (i = 0; i < n; i++) { mpc_delete(list[i]); }  
+  va_end(va);  
 
-mpc_parser_t *mpc_tok_between(mpc_parser_t *a, mpc_dtor_t ad, const char *o, const char *c) {
-  return mpc_and(3, mpcf_snd_free,
-    mpc_sym(o), mpc_tok(a), mpc_sym(c),
-    free, ad);
+  free(list);
 }
 
-mpc_parser_t *mpc_tok_parens(mpc_parser_t *a, mpc_dtor_t ad)   { return mpc_tok_between(a, ad, "(", ")"); }
-mpc_parser_t *mpc_tok_braces(mpc_parser_t *a, mpc_dtor_t ad)   { return mpc_tok_between(a, ad, "<", ">"); }
-mpc_parser_t *mpc_tok_brackets(mpc_parser_t *a, mpc_dtor_t ad) { return mpc_tok_between(a, ad, "{", "}"); }
-mpc_parser_t *mpc_tok_squares(mpc_parser_t *a, mpc_dtor_t ad)  { return mpc_tok_between(a, ad, "[", "]"); }
+mpc_parser_t *mpc_pass(void) {
+  mpc_parser_t *p = mpc_undefined();
+  p->type = MPC_TYPE_PASS;
+  return p;
+}
 
-/*
-** Regular Expression Parsers
-*/
+mpc_parser_t *mpc_fail(const char *m) {
+  mpc_parser_t *p = mpc_undefined();
+  p->type = MPC_TYPE_FAIL;
+  p->data.fail.m = malloc(strlen(m) + 1);
+  strcpy(p->data.fail.m, m);
+  return p;
+}
 
 /*
-** So here is a cute bootstrapping.
+** As `snprintf` is not ANSI standard this 
+** function `mpc_failf` should be considered
+** unsafe.
 **
-** I'm using the previously defined
-** mpc constructs and functions to
-** parse the user regex string and
-** construct a parser from it.
+** You have a few options if this is going to be
+** trouble.
 **
-** As it turns out lots of the standard
-** mpc functions look a lot like `fold`
-** functions and so can be used indirectly
-** by many of the parsing functions to build
-** a parser directly - as we are parsing.
+** - Ensure the format string does not exceed
+**   the buffer length using precision specifiers
+**   such as `%.512s`.
 **
-** This is certainly something that
-** would be less elegant/interesting 
-** in a two-phase parser which first
-** builds an AST and then traverses it
-** to generate the object.
+** - Patch this function in your code base to 
+**   use `snprintf` or whatever variant your
+**   system supports.
+**
+** - Avoid it altogether.
 **
-** This whole thing acts as a great
-** case study for how trivial it can be
-** to write a great parser in a few
-** lines of code using mpc.
 */
 
+mpc_parser_t *mpc_failf(const char *fmt, ...) {
+  
+  va_list va;
+  char *buffer;
+
+  mpc_parser_t *p = mpc_undefined();
+  p->type = MPC_TYPE_FAIL;
+  
+  va_start(va, fmt);
+  buffer = malloc(2048);
+  vsprintf(buffer, fmt, va);
+  va_end(va);
+  
+  buffer = realloc(buffer, strlen(buffer) + 1);
+  p->data.fail.m = buffer;
+  return p;
+
+}
+
+mpc_parser_t *mpc_lift_val(mpc_val_t *x) {
+  mpc_parser_t *p = mpc_undefined();
+  p->type = MPC_TYPE_LIFT_VAL;
+  p->data.lift.x = x;
+  return p;
+}
+
+mpc_parser_t *mpc_lift(mpc_ctor_t lf) {
+  mpc_parser_t *p = mpc_undefined();
+  p->type = MPC_TYPE_LIFT;
+  p->data.lift.lf = lf;
+  return p;
+}
+
+mpc_parser_t *mpc_expect(mpc_parser_t *a, const char *expected) {
+  mpc_parser_t *p = mpc_undefined();
+  p->type = MPC_TYPE_EXPECT;
+  p->data.expect.x = a;
+  p->data.expect.m = malloc(strlen(expected) + 1);
+  strcpy(p->data.expect.m, expected);
+  return p;
+}
+
 /*
+** As `snprintf` is not ANSI standard this 
+** function `mpc_expectf` should be considered
+** unsafe.
 **
-**  ### Regular Expression Grammar
+** You have a few options if this is going to be
+** trouble.
 **
-**      <regex> : <term> | (<term> "|" <regex>)
-**     
-**      <term> : <factor>*
+** - Ensure the format string does not exceed
+**   the buffer length using precision specifiers
+**   such as `%.512s`.
+**
+** - Patch this function in your code base to 
+**   use `snprintf` or whatever variant your
+**   system supports.
+**
+** - Avoid it altogether.
+**
+*/
+
+mpc_parser_t *mpc_expectf(mpc_parser_t *a, const char *fmt, ...) {
+  va_list va;
+  char *buffer;
+
+  mpc_parser_t *p = mpc_undefined();
+  p->type = MPC_TYPE_EXPECT;
+  
+  va_start(va, fmt);
+  buffer = malloc(2048);
+  vsprintf(buffer, fmt, va);
+  va_end(va);
+  
+  buffer = realloc(buffer, strlen(buffer) + 1);
+  p->data.expect.x = a;
+  p->data.expect.m = buffer;
+  return p;
+}
+
+/*
+** Basic Parsers
+*/
+
+mpc_parser_t *mpc_any(void) {
+  mpc_parser_t *p = mpc_undefined();
+  p->type = MPC_TYPE_ANY;
+  return mpc_expect(p, "any character");
+}
+
+mpc_parser_t *mpc_char(char c) {
+  mpc_parser_t *p = mpc_undefined();
+  p->type = MPC_TYPE_SINGLE;
+  p->data.single.x = c;
+  return mpc_expectf(p, "'%c'", c);
+}
+
+/*
+** Sets of characters are kept as a bitmap with
+** a bit for each of the 256 byte values, so that
+** matching is a single test however big the set.
+** As with `strchr` the terminator counts as part
+** of a `oneof` string. An `or` made only of sets
+** is merged into one, which keeps the error its
+** alternatives would have given together.
+*/
+
+static mpc_parser_t *mpc_class_new(void) {
+  mpc_parser_t *p = mpc_undefined();
+  p->type = MPC_TYPE_CLASS;
+  memset(p->data.class.x, 0, 32);
+  p->data.class.err = NULL;
+  p->data.class.ranges = 0;
+  p->data.class.negate = 0;
+  return p;
+}
+
+static void mpc_class_plan(mpc_pdata_class_t *c) {
+  
+  int i, j, n, neg;
+  
+  for (neg = 0; neg < 2; neg++) {
+    
+    n = 0;
+    for (i = 0; i < 256 && n <= 4; i = j) {
+      for (j = i; j < 256 && mpc_class_has(c->x, (char)j) != neg; j++);
+      if (j > i && n < 4) { c->lo[n] = i; c->width[n] = j - 1 - i; }
+      if (j > i) { n++; }
+      for (; j < 256 && mpc_class_has(c->x, (char)j) == neg; j++);
+    }
+    
+    if (n > 0 && n <= 4) {
+      c->ranges = n;
+      c->negate = neg;
+      return;
+    }
+  }
+  
+  c->ranges = 0;
+}
+
+mpc_parser_t *mpc_range(char s, char e) {
+  int c;
+  mpc_parser_t *p = mpc_class_new();
+  for (c = 0; c < 256; c++) {
+    if ((char)c >= s && (char)c <= e) { mpc_class_add(p->data.class.x, (char)c); }
+  }
+  mpc_class_plan(&p->data.class);
+  return mpc_expectf(p, "character between '%c' and '%c'", s, e);
+}
+
+mpc_parser_t *mpc_oneof(const char *s) {
+  const char *c;
+  mpc_parser_t *p = mpc_class_new();
+  mpc_class_add(p->data.class.x, '\0');
+  for (c = s; *c; c++) { mpc_class_add(p->data.class.x, *c); }
+  mpc_class_plan(&p->data.class);
+  return mpc_expectf(p, "one of '%s'", s);
+}
+
+mpc_parser_t *mpc_noneof(const char *s) {
+  int i;
+  const char *c;
+  mpc_parser_t *p = mpc_class_new();
+  for (i = 0; i < 32; i++) { p->data.class.x[i] = 0xFF; }
+  p->data.class.x[0] &= ~1;
+  for (c = s; *c; c++) {
+    p->data.class.x[(unsigned char)*c / 8] &= ~(1 << ((unsigned char)*c % 8));
+  }
+  mpc_class_plan(&p->data.class);
+  return mpc_expectf(p, "one of '%s'", s);
+
+}
+
+static int mpc_class_of(mpc_parser_t *p, unsigned char *chars, mpc_err_t **err) {
+  
+  int i, c;
+  unsigned char sub[32];
+  mpc_err_t **es;
+  
+  if (p->retained) { return 0; }
+  
+  switch (p->type) {
+    
+    case MPC_TYPE_EXPECT:
+      if (!mpc_class_of(p->data.expect.x, chars, err)) { return 0; }
+      mpc_err_delete(*err);
+      *err = mpc_err_new("", mpc_state_invalid(), p->data.expect.m);
+      return 1;
+    
+    case MPC_TYPE_CLASS:
+      memcpy(chars, p->data.class.x, 32);
+      *err = p->data.class.err
+        ? mpc_err_copy(p->data.class.err)
+        : mpc_err_fail("", mpc_state_invalid(), "Incorrect Input");
+      return 1;
+    
+    case MPC_TYPE_ANY:
+    case MPC_TYPE_SINGLE:
+      memset(chars, 0, 32);
+      for (c = 0; c < 256; c++) {
+        if (mpc_primitive_match(p, (char)c)) { chars[c / 8] |= 1 << (c % 8); }
+      }
+      *err = mpc_err_fail("", mpc_state_invalid(), "Incorrect Input");
+      return 1;
+    
+    case MPC_TYPE_OR:
+      if (p->data.or.n == 0) { return 0; }
+      memset(chars, 0, 32);
+      es = malloc(sizeof(mpc_err_t*) * p->data.or.n);
+      for (i = 0; i < p->data.or.n; i++) {
+        if (!mpc_class_of(p->data.or.xs[i], sub, &es[i])) {
+          while (i > 0) { mpc_err_delete(es[--i]); }
+          free(es);
+          return 0;
+        }
+        for (c = 0; c < 32; c++) { chars[c] |= sub[c]; }
+      }
+      *err = mpc_err_or(es, p->data.or.n);
+      free(es);
+      return 1;
+    
+    default: return 0;
+  }
+  
+}
+
+static mpc_parser_t *mpc_class_merge(mpc_parser_t *p) {
+  
+  int i;
+  mpc_err_t *err;
+  unsigned char chars[32];
+  
+  if (p->data.or.n < 2 || !mpc_class_of(p, chars, &err)) { return p; }
+  
+  for (i = 0; i < p->data.or.n; i++) { mpc_delete(p->data.or.xs[i]); }
+  free(p->data.or.xs);
+  
+  p->type = MPC_TYPE_CLASS;
+  memcpy(p->data.class.x, chars, 32);
+  p->data.class.err = err;
+  mpc_class_plan(&p->data.class);
+  return p;
+}
+
+mpc_parser_t *mpc_satisfy(int(*f)(char)) {
+  mpc_parser_t *p = mpc_undefined();
+  p->type = MPC_TYPE_SATISFY;
+  p->data.satisfy.f = f;
+  return mpc_expectf(p, "character satisfying function %p", f);
+}
+
+mpc_parser_t *mpc_string(const char *s) {
+  mpc_parser_t *p = mpc_undefined();
+  p->type = MPC_TYPE_STRING;
+  p->data.string.x = malloc(strlen(s) + 1);
+  strcpy(p->data.string.x, s);
+  return mpc_expectf(p, "\"%s\"", s);
+}
+
+/*
+** Core Parsers
+*/
+
+mpc_parser_t *mpc_apply(mpc_parser_t *a, mpc_apply_t f) {
+  mpc_parser_t *p = mpc_undefined();
+  p->type = MPC_TYPE_APPLY;
+  p->data.apply.x = a;
+  p->data.apply.f = f;
+  return p;
+}
+
+mpc_parser_t *mpc_apply_to(mpc_parser_t *a, mpc_apply_to_t f, void *x) {
+  mpc_parser_t *p = mpc_undefined();
+  p->type = MPC_TYPE_APPLY_TO;
+  p->data.apply_to.x = a;
+  p->data.apply_to.f = f;
+  p->data.apply_to.d = x;
+  return p;
+}
+
+mpc_parser_t *mpc_predictive(mpc_parser_t *a) {
+  mpc_parser_t *p = mpc_undefined();
+  p->type = MPC_TYPE_PREDICT;
+  p->data.predict.x = a;
+  return p;
+}
+
+/*
+** Memoising a parser caches its result at each
+** position it is run, so when backtracking runs
+** it again at the same place the cached result
+** is reused rather than parsed afresh. As values
+** are owned by whoever receives them, `cx` is
+** used to copy results in and out of the cache
+** and `dx` to delete them once the parse is over.
+*/
+
+mpc_parser_t *mpc_memo(mpc_parser_t *a, mpc_copy_t cx, mpc_dtor_t dx) {
+  mpc_parser_t *p = mpc_undefined();
+  p->type = MPC_TYPE_MEMO;
+  p->data.memo.x = a;
+  p->data.memo.cx = cx;
+  p->data.memo.dx = dx;
+  return p;
+}
+
+/*
+** The counts are kept on the parse stack rather
+** than the memo parsers, so they are those of this
+** parse alone and a grammar is never written to.
+*/
+
+int mpc_parse_memo_stats(const char *filename, const char *string, mpc_parser_t *p, mpc_result_t *r, long *hits, long *misses) {
+  int x;
+  mpc_input_t *i = mpc_input_new_string(filename, string);
+  mpc_stack_t *stk = mpc_stack_new(filename);
+  mpc_stack_pushp(stk, p);
+  mpc_parse_run(i, stk);
+  *hits = stk->memo_hits;
+  *misses = stk->memo_misses;
+  x = mpc_stack_terminate(stk, r);
+  mpc_input_delete(i);
+  return x;
+}
+
+mpc_parser_t *mpc_not_lift(mpc_parser_t *a, mpc_dtor_t da, mpc_ctor_t lf) {
+  mpc_parser_t *p = mpc_undefined();
+  p->type = MPC_TYPE_NOT;
+  p->data.not.x = a;
+  p->data.not.dx = da;
+  p->data.not.lf = lf;
+  return p;
+}
+
+mpc_parser_t *mpc_not(mpc_parser_t *a, mpc_dtor_t da) {
+  return mpc_not_lift(a, da, mpcf_ctor_null);
+}
+
+mpc_parser_t *mpc_maybe_lift(mpc_parser_t *a, mpc_ctor_t lf) {
+  mpc_parser_t *p = mpc_undefined();
+  p->type = MPC_TYPE_MAYBE;
+  p->data.not.x = a;
+  p->data.not.lf = lf;
+  return p;
+}
+
+mpc_parser_t *mpc_maybe(mpc_parser_t *a) {
+  return mpc_maybe_lift(a, mpcf_ctor_null);
+}
+
+mpc_parser_t *mpc_many(mpc_fold_t f, mpc_parser_t *a) {
+  mpc_parser_t *p = mpc_undefined();
+  p->type = MPC_TYPE_MANY;
+  p->data.repeat.x = a;
+  p->data.repeat.f = f;
+  return p;
+}
+
+mpc_parser_t *mpc_many1(mpc_fold_t f, mpc_parser_t *a) {
+  mpc_parser_t *p = mpc_undefined();
+  p->type = MPC_TYPE_MANY1;
+  p->data.repeat.x = a;
+  p->data.repeat.f = f;
+  return p;
+}
+
+mpc_parser_t *mpc_count(int n, mpc_fold_t f, mpc_parser_t *a, mpc_dtor_t da) {
+  mpc_parser_t *p = mpc_undefined();
+  p->type = MPC_TYPE_COUNT;
+  p->data.repeat.n = n;
+  p->data.repeat.f = f;
+  p->data.repeat.x = a;
+  p->data.repeat.dx = da;
+  return p;
+}
+
+mpc_parser_t *mpc_or(int n, ...) {
+
+  int i;
+  va_list va;
+
+  mpc_parser_t *p = mpc_undefined();
+  
+  p->type = MPC_TYPE_OR;
+  p->data.or.n = n;
+  p->data.or.xs = malloc(sizeof(mpc_parser_t*) * n);
+  p->data.or.first = NULL;
+  
+  va_start(va, n);  
+  for (i = 0; i < n; i++) {
+    p->data.or.xs[i] = va_arg(va, mpc_parser_t*);
+  }
+  va_end(va);
+  
+  return mpc_class_merge(p);
+}
+
+mpc_parser_t *mpc_and(int n, mpc_fold_t f, ...) {
+
+  int i;
+  va_list va;
+
+  mpc_parser_t *p = mpc_undefined();
+  
+  p->type = MPC_TYPE_AND;
+  p->data.and.n = n;
+  p->data.and.f = f;
+  p->data.and.xs = malloc(sizeof(mpc_parser_t*) * n);
+  p->data.and.dxs = malloc(sizeof(mpc_dtor_t) * (n-1));
+
+  va_start(va, f);  
+  for (i = 0; i < n; i++) {
+    p->data.and.xs[i] = va_arg(va, mpc_parser_t*);
+  }
+  for (i = 0; i < (n-1); i++) {
+    p->data.and.dxs[i] = va_arg(va, mpc_dtor_t);
+  }  
+  va_end(va);
+  
+  return p;
+}
+
+/*
+** Common Parsers
+*/
+
+mpc_parser_t *mpc_eoi(void) {
+  mpc_parser_t *p = mpc_undefined();
+  p->type = MPC_TYPE_EOI;
+  return mpc_expect(p, "end of input");
+}
+
+mpc_parser_t *mpc_soi(void) {
+  mpc_parser_t *p = mpc_undefined();
+  p->type = MPC_TYPE_SOI;
+  return mpc_expect(p, "start of input");
+}
+
+mpc_parser_t *mpc_whitespace(void) { return mpc_expect(mpc_oneof(" \f\n\r\t\v"), "whitespace"); }
+mpc_parser_t *mpc_whitespaces(void) { return mpc_expect(mpc_many(mpcf_strfold, mpc_whitespace()), "spaces"); }
+mpc_parser_t *mpc_blank(void) { return mpc_expect(mpc_apply(mpc_whitespaces(), mpcf_free), "whitespace"); }
+
+mpc_parser_t *mpc_newline(void) { return mpc_expect(mpc_char('\n'), "newline"); }
+mpc_parser_t *mpc_tab(void) { return mpc_expect(mpc_char('\t'), "tab"); }
+mpc_parser_t *mpc_escape(void) { return mpc_and(2, mpcf_strfold, mpc_char('\\'), mpc_any(), free); }
+
+mpc_parser_t *mpc_digit(void) { return mpc_expect(mpc_oneof("012345689"), "digit"); }
+mpc_parser_t *mpc_hexdigit(void) { return mpc_expect(mpc_oneof("0123456789ABCDEFabcdef"), "hex digit"); }
+mpc_parser_t *mpc_octdigit(void) { return mpc_expect(mpc_oneof("01234567"), "oct digit"); }
+mpc_parser_t *mpc_digits(void) { return mpc_expect(mpc_many1(mpcf_strfold, mpc_digit()), "digits"); }
+mpc_parser_t *mpc_hexdigits(void) { return mpc_expect(mpc_many1(mpcf_strfold, mpc_hexdigit()), "hex digits"); }
+mpc_parser_t *mpc_octdigits(void) { return mpc_expect(mpc_many1(mpcf_strfold, mpc_octdigit()), "oct digits"); }
+
+mpc_parser_t *mpc_lower(void) { return mpc_expect(mpc_oneof("abcdefghijklmnopqrstuvwxyz"), "lowercase letter"); }
+mpc_parser_t *mpc_upper(void) { return mpc_expect(mpc_oneof("ABCDEFGHIJKLMNOPQRSTUVWXYZ"), "uppercase letter"); }
+mpc_parser_t *mpc_alpha(void) { return mpc_expect(mpc_oneof("abcdefghijklmnopqrstuvwxyzABCDEFGHIJKLMNOPQRSTUVWXYZ"), "letter"); }
+mpc_parser_t *mpc_underscore(void) { return mpc_expect(mpc_char('_'), "underscore"); }
+mpc_parser_t *mpc_alphanum(void) { return mpc_expect(mpc_or(3, mpc_alpha(), mpc_digit(), mpc_underscore()), "alphanumeric"); }
+
+mpc_parser_t *mpc_int(void) { return mpc_expect(mpc_apply(mpc_digits(), mpcf_int), "integer"); }
+mpc_parser_t *mpc_hex(void) { return mpc_expect(mpc_apply(mpc_hexdigits(), mpcf_hex), "hexadecimal"); }
+mpc_parser_t *mpc_oct(void) { return mpc_expect(mpc_apply(mpc_octdigits(), mpcf_oct), "octadecimal"); }
+mpc_parser_t *mpc_number(void) { return mpc_expect(mpc_or(3, mpc_int(), mpc_hex(), mpc_oct()), "number"); }
+
+mpc_parser_t *mpc_real(void) {
+
+  /* [+-]?\d+(\.\d+)?([eE][+-]?[0-9]+)? */
+  
+  mpc_parser_t *p0, *p1, *p2, *p30, *p31, *p32, *p3;
+  
+  p0 = mpc_maybe_lift(mpc_oneof("+-"), mpcf_ctor_str);
+  p1 = mpc_digits();
+  p2 = mpc_maybe_lift(mpc_and(2, mpcf_strfold, mpc_char('.'), mpc_digits(), free), mpcf_ctor_str);
+  p30 = mpc_oneof("eE");
+  p31 = mpc_maybe_lift(mpc_oneof("+-"), mpcf_ctor_str);
+  p32 = mpc_digits();
+  p3 = mpc_maybe_lift(mpc_and(3, mpcf_strfold, p30, p31, p32, free, free), mpcf_ctor_str);
+  
+  return mpc_expect(mpc_and(4, mpcf_strfold, p0, p1, p2, p3, free, free, free), "real");
+
+}
+
+mpc_parser_t *mpc_float(void) {
+  return mpc_expect(mpc_apply(mpc_real(), mpcf_float), "float");
+}
+
+mpc_parser_t *mpc_char_lit(void) {
+  return mpc_expect(mpc_between(mpc_or(2, mpc_escape(), mpc_any()), free, "'", "'"), "char");
+}
+
+mpc_parser_t *mpc_string_lit(void) {
+  mpc_parser_t *strchar = mpc_or(2, mpc_escape(), mpc_noneof("\""));
+  return mpc_expect(mpc_between(mpc_many(mpcf_strfold, strchar), free, "\"", "\""), "string");
+}
+
+mpc_parser_t *mpc_regex_lit(void) {  
+  mpc_parser_t *regexchar = mpc_or(2, mpc_escape(), mpc_noneof("/"));
+  return mpc_expect(mpc_between(mpc_many(mpcf_strfold, regexchar), free, "/", "/"), "regex");
+}
+
+mpc_parser_t *mpc_ident(void) {
+  mpc_parser_t *p0, *p1; 
+  p0 = mpc_or(2, mpc_alpha(), mpc_underscore());
+  p1 = mpc_many(mpcf_strfold, mpc_alphanum()); 
+  return mpc_and(2, mpcf_strfold, p0, p1, free);
+}
+
+/*
+** Useful Parsers
+*/
+
+mpc_parser_t *mpc_startwith(mpc_parser_t *a) { return mpc_and(2, mpcf_snd, mpc_soi(), a, mpcf_dtor_null); }
+mpc_parser_t *mpc_endwith(mpc_parser_t *a, mpc_dtor_t da) { return mpc_and(2, mpcf_fst, a, mpc_eoi(), da); }
+mpc_parser_t *mpc_whole(mpc_parser_t *a, mpc_dtor_t da) { return mpc_and(3, mpcf_snd, mpc_soi(), a, mpc_eoi(), mpcf_dtor_null, da); }
+
+mpc_parser_t *mpc_stripl(mpc_parser_t *a) { return mpc_and(2, mpcf_snd, mpc_blank(), a, mpcf_dtor_null); }
+mpc_parser_t *mpc_stripr(mpc_parser_t *a) { return mpc_and(2, mpcf_fst, a, mpc_blank(), mpcf_dtor_null); }
+mpc_parser_t *mpc_strip(mpc_parser_t *a) { return mpc_and(3, mpcf_snd, mpc_blank(), a, mpc_blank(), mpcf_dtor_null, mpcf_dtor_null); }
+mpc_parser_t *mpc_tok(mpc_parser_t *a) { return mpc_and(2, mpcf_fst, a, mpc_blank(), mpcf_dtor_null); }
+mpc_parser_t *mpc_sym(const char *s) { return mpc_tok(mpc_string(s)); }
+
+mpc_parser_t *mpc_total(mpc_parser_t *a, mpc_dtor_t da) { return mpc_whole(mpc_strip(a), da); }
+
+mpc_parser_t *mpc_between(mpc_parser_t *a, mpc_dtor_t ad, const char *o, const char *c) {
+  return mpc_and(3, mpcf_snd_free,
+    mpc_string(o), a, mpc_string(c),
+    free, ad);
+}
+
+mpc_parser_t *mpc_parens(mpc_parser_t *a, mpc_dtor_t ad)   { return mpc_between(a, ad, "(", ")"); }
+mpc_parser_t *mpc_braces(mpc_parser_t *a, mpc_dtor_t ad)   { return mpc_between(a, ad, "<", ">"); }
+mpc_parser_t *mpc_brackets(mpc_parser_t *a, mpc_dtor_t ad) { return mpc_between(a, ad, "{", "}"); }
+mpc_parser_t *mpc_squares(mpc_parser_t *a, mpc_dtor_t ad)  { return mpc_between(a, ad, "[", "]"); }
+
+mpc_parser_t *mpc_tok_between(mpc_parser_t *a, mpc_dtor_t ad, const char *o, const char *c) {
+  return mpc_and(3, mpcf_snd_free,
+    mpc_sym(o), mpc_tok(a), mpc_sym(c),
+    free, ad);
+}
+
+mpc_parser_t *mpc_tok_parens(mpc_parser_t *a, mpc_dtor_t ad)   { return mpc_tok_between(a, ad, "(", ")"); }
+mpc_parser_t *mpc_tok_braces(mpc_parser_t *a, mpc_dtor_t ad)   { return mpc_tok_between(a, ad, "<", ">"); }
+mpc_parser_t *mpc_tok_brackets(mpc_parser_t *a, mpc_dtor_t ad) { return mpc_tok_between(a, ad, "{", "}"); }
+mpc_parser_t *mpc_tok_squares(mpc_parser_t *a, mpc_dtor_t ad)  { return mpc_tok_between(a, ad, "[", "]"); }
+
+/*
+** Regular Expression Parsers
+*/
+
+/*
+** So here is a cute bootstrapping.
+**
+** I'm using the previously defined
+** mpc constructs and functions to
+** parse the user regex string and
+** construct a parser from it.
+**
+** As it turns out lots of the standard
+** mpc functions look a lot like `fold`
+** functions and so can be used indirectly
+** by many of the parsing functions to build
+** a parser directly - as we are parsing.
+**
+** This is certainly something that
+** would be less elegant/interesting 
+** in a two-phase parser which first
+** builds an AST and then traverses it
+** to generate the object.
+**
+** This whole thing acts as a great
+** case study for how trivial it can be
+** to write a great parser in a few
+** lines of code using mpc.
+*/
+
+/*
+**
+**  ### Regular Expression Grammar
+**
+**      <regex> : <term> | (<term> "|" <regex>)
+**     
+**      <term> : <factor>*
+**
+**      <factor> : <base>
+**               | <base> "*"
+**               | <base> "+"
+**               | <base> "?"
+**               | <base> "{" <digits> "}"
+**           
+**      <base> : <char>
+**             | "\" <char>
+**             | "(" <regex> ")"
+**             | "[" <range> "]"
+*/
+
+static mpc_val_t *mpcf_re_or(int n, mpc_val_t **xs) {
+  if (xs[1] == NULL) { return xs[0]; }
+  else { return mpc_or(2, xs[0], xs[1]); }
+}
+
+static mpc_val_t *mpcf_re_and(int n, mpc_val_t **xs) {
+  int i;
+  mpc_parser_t *p = mpc_lift(mpcf_ctor_str);
+  for (i = 0; i < n; i++) {
+    p = mpc_and(2, mpcf_strfold, p, xs[i], free);
+  }
+  return p;
+}
+
+static mpc_val_t *mpcf_re_repeat(int n, mpc_val_t **xs) {
+  
+  int num;
+  if (xs[1] == NULL) { return xs[0]; }
+  if (strcmp(xs[1], "*") == 0) { free(xs[1]); return mpc_many(mpcf_strfold, xs[0]); }
+  if (strcmp(xs[1], "+") == 0) { free(xs[1]); return mpc_many1(mpcf_strfold, xs[0]); }
+  if (strcmp(xs[1], "?") == 0) { free(xs[1]); return mpc_maybe_lift(xs[0], mpcf_ctor_str); }
+  num = *(int*)xs[1];
+  free(xs[1]);
+  
+  return mpc_count(num, mpcf_strfold, xs[0], free);
+}
+
+static mpc_parser_t *mpc_re_escape_char(char c) {
+  switch (c) {
+    case 'a': return mpc_char('\a');
+    case 'f': return mpc_char('\f');
+    case 'n': return mpc_char('\n');
+    case 'r': return mpc_char('\r');
+    case 't': return mpc_char('\t');
+    case 'v': return mpc_char('\v');
+    case 'b': return mpc_char('\b');
+    case 'A': return mpc_and(2, mpcf_snd, mpc_soi(), mpc_lift(mpcf_ctor_str), free);
+    case 'Z': return mpc_and(2, mpcf_snd, mpc_eoi(), mpc_lift(mpcf_ctor_str), free);
+    case 'd': return mpc_digit();
+    case 'D': return mpc_not_lift(mpc_digit(), free, mpcf_ctor_str);
+    case 's': return mpc_whitespace();
+    case 'S': return mpc_not_lift(mpc_whitespace(), free, mpcf_ctor_str);
+    case 'w': return mpc_alphanum();
+    case 'W': return mpc_not_lift(mpc_alphanum(), free, mpcf_ctor_str);
+    default: return NULL;
+  }
+}
+
+static mpc_val_t *mpcf_re_escape(mpc_val_t *x) {
+  
+  char *s = x;
+  mpc_parser_t *p;
+  
+  /* Regex Special Characters */
+  if (s[0] == '.') { free(s); return mpc_any(); }
+  if (s[0] == '^') { free(s); return mpc_and(2, mpcf_snd, mpc_soi(), mpc_lift(mpcf_ctor_str), free); }
+  if (s[0] == '$') { free(s); return mpc_and(2, mpcf_snd, mpc_eoi(), mpc_lift(mpcf_ctor_str), free); }
+  
+  /* Regex Escape */
+  if (s[0] == '\\') {
+    p = mpc_re_escape_char(s[1]);
+    p = (p == NULL) ? mpc_char(s[1]) : p;
+    free(s);
+    return p;
+  }
+  
+  /* Regex Standard */
+  p = mpc_char(s[0]);
+  free(s);
+  return p;
+}
+
+static char *mpc_re_range_escape_char(char c) {
+  switch (c) {
+    case '-': return "-";
+    case 'a': return "\a";
+    case 'f': return "\f";
+    case 'n': return "\n";
+    case 'r': return "\r";
+    case 't': return "\t";
+    case 'v': return "\v";
+    case 'b': return "\b";
+    case 'd': return "0123456789";
+    case 's': return " \f\n\r\t\v";
+    case 'w': return "abcdefghijklmnopqrstuvwxyzABCDEFGHIJKLMNOPQRSTUVWXYZ0123456789_";
+    default: return NULL;
+  }
+}
+
+static mpc_val_t *mpcf_re_range(mpc_val_t *x) {
+  
+  mpc_parser_t *out;
+  char *range = calloc(1,1);
+  char *tmp = NULL;
+  char *s = x;
+  char start, end;
+  int i, j;
+  int comp = 0;
+  
+  if (s[0] == '\0') { free(x); return mpc_fail("Invalid Regex Range Expression"); } 
+  if (s[0] == '^' && 
+      s[1] == '\0') { free(x); return mpc_fail("Invalid Regex Range Expression"); }
+  
+  if (s[0] == '^') { comp = 1;}
+  
+  for (i = comp; i < strlen(s); i++){
+    
+    /* Regex Range Escape */
+    if (s[i] == '\\') {
+      tmp = mpc_re_range_escape_char(s[i+1]);
+      if (tmp != NULL) {
+        range = realloc(range, strlen(range) + strlen(tmp) + 1);
+        strcat(range, tmp);
+      } else {
+        range = realloc(range, strlen(range) + 1 + 1);
+        range[strlen(range) + 1] = '\0';
+        range[strlen(range) + 0] = s[i+1];      
+      }
+      i++;
+    }
+    
+    /* Regex Range...Range */
+    else if (s[i] == '-') {
+      if (s[i+1] == '\0' || i == 0) {
+          range = realloc(range, strlen(range) + strlen("-") + 1);
+          strcat(range, "-");
+      } else {
+        start = s[i-1]+1;
+        end = s[i+1]-1;
+        for (j = start; j <= end; j++) {
+          range = realloc(range, strlen(range) + 1 + 1);
+          range[strlen(range) + 1] = '\0';
+          range[strlen(range) + 0] = j;
+        }        
+      }
+    }
+    
+    /* Regex Range Normal */
+    else {
+      range = realloc(range, strlen(range) + 1 + 1);
+      range[strlen(range) + 1] = '\0';
+      range[strlen(range) + 0] = s[i];
+    }
+  
+  }
+  
+  out = comp ? mpc_noneof(range) : mpc_oneof(range);
+  
+  free(x);
+  free(range);
+  
+  return out;
+}
+
+/*
+** Once built, the parser for a regex is checked
+** to see if it fits the automaton above. It must
+** be a sequence of character classes, each maybe
+** repeated, with `^` only at the start. Anything
+** else, such as alternatives or repeated groups,
+** may need to backtrack and keeps the combinators.
+*/
+
+static int mpc_regex_items(mpc_pdata_regex_t *d, mpc_parser_t *p) {
+  
+  int i;
+  mpc_parser_t *a = p;
+  mpc_regex_item_t it;
+  
+  if (p->type == MPC_TYPE_LIFT) { return 1; }
+  
+  if (p->type == MPC_TYPE_AND && p->data.and.f == mpcf_strfold) {
+    for (i = 0; i < p->data.and.n; i++) {
+      if (!mpc_regex_items(d, p->data.and.xs[i])) { return 0; }
+    }
+    return 1;
+  }
+  
+  /* Anchors */
+  if (p->type == MPC_TYPE_AND && p->data.and.f == mpcf_snd && p->data.and.n == 2
+  &&  p->data.and.xs[0]->type == MPC_TYPE_EXPECT
+  &&  p->data.and.xs[1]->type == MPC_TYPE_LIFT) {
+    a = p->data.and.xs[0]->data.expect.x;
+    if (a->type == MPC_TYPE_SOI && d->items_num == 0 && d->soi == NULL) {
+      d->soi = mpc_err_new("", mpc_state_invalid(), p->data.and.xs[0]->data.expect.m);
+      return 1;
+    }
+    if (a->type != MPC_TYPE_EOI) { return 0; }
+    memset(it.chars, 0, 32);
+    it.kind = MPC_REGEX_EOI;
+    it.n = 0;
+    it.err = NULL;
+    it.fail = mpc_err_new("", mpc_state_invalid(), p->data.and.xs[0]->data.expect.m);
+  } else {
+    
+    switch (p->type) {
+      case MPC_TYPE_MANY:  it.kind = MPC_REGEX_MANY;  break;
+      case MPC_TYPE_MANY1: it.kind = MPC_REGEX_MANY1; break;
+      case MPC_TYPE_COUNT: it.kind = MPC_REGEX_COUNT; break;
+      case MPC_TYPE_MAYBE: it.kind = MPC_REGEX_MAYBE; break;
+      default:             it.kind = MPC_REGEX_ONE;   break;
+    }
+    
+    if (it.kind == MPC_REGEX_MAYBE) {
+      if (p->data.not.lf != mpcf_ctor_str) { return 0; }
+      a = p->data.not.x;
+    } else if (it.kind != MPC_REGEX_ONE) {
+      if (p->data.repeat.f != mpcf_strfold) { return 0; }
+      a = p->data.repeat.x;
+    }
+    
+    if (!mpc_class_of(a, it.chars, &it.err)) { return 0; }
+    
+    it.n = it.kind == MPC_REGEX_COUNT ? p->data.repeat.n : 0;
+    switch (it.kind) {
+      case MPC_REGEX_ONE:   it.fail = mpc_err_copy(it.err); break;
+      case MPC_REGEX_MANY1: it.fail = mpc_err_many1(mpc_err_copy(it.err)); break;
+      case MPC_REGEX_COUNT: it.fail = mpc_err_count(mpc_err_copy(it.err), it.n); break;
+      default:              it.fail = NULL; break;
+    }
+  }
+  
+  d->items_num++;
+  d->items = realloc(d->items, sizeof(mpc_regex_item_t) * d->items_num);
+  d->items[d->items_num-1] = it;
+  return 1;
+}
+
+static mpc_parser_t *mpc_regex_compile(mpc_parser_t *x) {
+  
+  int i, j;
+  mpc_parser_t *p;
+  mpc_pdata_regex_t d;
+  
+  d.x = x;
+  d.soi = NULL;
+  d.items_num = 0;
+  d.items = NULL;
+  d.states_num = 0;
+  d.base = NULL;
+  d.item = NULL;
+  d.table = NULL;
+  
+  if (!mpc_regex_items(&d, x)) { mpc_regex_delete(&d); return x; }
+  
+  d.base = malloc(sizeof(int) * (d.items_num + 1));
+  for (i = 0; i < d.items_num; i++) {
+    d.base[i] = d.states_num;
+    switch (d.items[i].kind) {
+      case MPC_REGEX_MANY1: d.states_num += 2; break;
+      case MPC_REGEX_COUNT: d.states_num += d.items[i].n + 2; break;
+      default:              d.states_num += 1; break;
+    }
+    if (d.states_num > MPC_REGEX_STATES) { mpc_regex_delete(&d); return x; }
+  }
+  d.base[d.items_num] = d.states_num;
+  
+  d.item = malloc(sizeof(int) * (d.states_num + 1));
+  for (i = 0; i < d.items_num; i++) {
+    for (j = d.base[i]; j < d.base[i+1]; j++) { d.item[j] = i; }
+  }
+  
+  /* Filled in whole here so that parsing only ever reads it */
+  d.table = malloc(sizeof(int) * (d.states_num * 257 + 1));
+  for (i = 0; i < d.states_num; i++) {
+    for (j = 0; j < 257; j++) { d.table[i * 257 + j] = mpc_regex_step(&d, i, j, NULL, NULL, NULL); }
+  }
+  
+  p = mpc_undefined();
+  p->type = MPC_TYPE_REGEX;
+  p->data.regex = d;
+  return p;
+}
+
+mpc_parser_t *mpc_re(const char *re) {
+  
+  char *err_msg;
+  mpc_parser_t *err_out;
+  mpc_result_t r;
+  mpc_parser_t *Regex, *Term, *Factor, *Base, *Range, *RegexEnclose; 
+  
+  Regex  = mpc_new("regex");
+  Term   = mpc_new("term");
+  Factor = mpc_new("factor");
+  Base   = mpc_new("base");
+  Range  = mpc_new("range");
+  
+  mpc_define(Regex, mpc_and(2, 
+    mpcf_re_or,
+    Term, 
+    mpc_maybe(mpc_and(2, mpcf_snd_free, mpc_char('|'), Regex, free)),
+    (mpc_dtor_t)mpc_delete
+  ));
+  
+  mpc_define(Term, mpc_many(mpcf_re_and, Factor));
+  
+  mpc_define(Factor, mpc_and(2, 
+    mpcf_re_repeat,
+    Base,
+    mpc_or(5,
+      mpc_char('*'), mpc_char('+'), mpc_char('?'),
+      mpc_brackets(mpc_int(), free),
+      mpc_pass()),
+    (mpc_dtor_t)mpc_delete
+  ));
+  
+  mpc_define(Base, mpc_or(4,
+    mpc_parens(Regex, (mpc_dtor_t)mpc_delete),
+    mpc_squares(Range, (mpc_dtor_t)mpc_delete),
+    mpc_apply(mpc_escape(), mpcf_re_escape),
+    mpc_apply(mpc_noneof(")|"), mpcf_re_escape)
+  ));
+  
+  mpc_define(Range, mpc_apply(
+    mpc_many(mpcf_strfold, mpc_or(2, mpc_escape(), mpc_noneof("]"))),
+    mpcf_re_range
+  ));
+  
+  RegexEnclose = mpc_whole(mpc_predictive(Regex), (mpc_dtor_t)mpc_delete);
+  
+  if(!mpc_parse("<mpc_re_compiler>", re, RegexEnclose, &r)) {
+    err_msg = mpc_err_string(r.error);
+    err_out = mpc_failf("Invalid Regex: %s", err_msg);
+    mpc_err_delete(r.error);  
+    free(err_msg);
+    r.output = err_out;
+  } else {
+    r.output = mpc_regex_compile(r.output);
+  }
+  
+  mpc_delete(RegexEnclose);
+  mpc_cleanup(5, Regex, Term, Factor, Base, Range);
+  
+  return r.output;
+  
+}
+
+/*
+** Common Fold Functions
+*/
+
+void mpcf_dtor_null(mpc_val_t *x) { return; }
+
+mpc_val_t *mpcf_ctor_null(void) { return NULL; }
+mpc_val_t *mpcf_ctor_str(void) { return calloc(1, 1); }
+mpc_val_t *mpcf_free(mpc_val_t *x) { free(x); return NULL; }
+
+mpc_val_t *mpcf_int(mpc_val_t *x) {
+  int *y = malloc(sizeof(int));
+  *y = strtol(x, NULL, 10);
+  free(x);
+  return y;
+}
+
+mpc_val_t *mpcf_hex(mpc_val_t *x) {
+  int *y = malloc(sizeof(int));
+  *y = strtol(x, NULL, 16);
+  free(x);
+  return y;
+}
+
+mpc_val_t *mpcf_oct(mpc_val_t *x) {
+  int *y = malloc(sizeof(int));
+  *y = strtol(x, NULL, 8);
+  free(x);
+  return y;
+}
+
+mpc_val_t *mpcf_float(mpc_val_t *x) {
+  float* y = malloc(sizeof(float));
+  *y = strtod(x, NULL);
+  free(x);
+  return y;
+}
+
+static char mpc_escape_input_c[]  = {
+  '\a', '\b', '\f', '\n', '\r',
+  '\t', '\v', '\\', '\'', '\"', '\0'};
+    
+static char *mpc_escape_output_c[] = {
+  "\\a", "\\b", "\\f", "\\n", "\\r", "\\t", 
+  "\\v", "\\\\", "\\'", "\\\"", "\\0", NULL};
+
+static char mpc_escape_input_raw_re[] = { '/' };
+static char *mpc_escape_output_raw_re[] = { "\\/", NULL };
+
+static char mpc_escape_input_raw_cstr[] = { '"' };
+static char *mpc_escape_output_raw_cstr[] = { "\\\"", NULL };
+
+static char mpc_escape_input_raw_cchar[] = { '\'' };
+static char *mpc_escape_output_raw_cchar[] = { "\\'", NULL };
+
+static mpc_val_t *mpcf_escape_new(mpc_val_t *x, char *input, char **output) {
+  
+  int i;
+  int found;
+  char *s = x;
+  char *y = calloc(1, 1);
+  char buff[2];
+  
+  while (*s) {
+    
+    i = 0;
+    found = 0;
+
+    while (output[i]) {
+      if (*s == input[i]) {
+        y = realloc(y, strlen(y) + strlen(output[i]) + 1);
+        strcat(y, output[i]);
+        found = 1;
+        break;
+      }
+      i++;
+    }
+    
+    if (!found) {
+      y = realloc(y, strlen(y) + 2);
+      buff[0] = *s; buff[1] = '\0';
+      strcat(y, buff);
+    }
+    
+    s++;
+  }
+  
+  
+  return y;
+}
+
+static mpc_val_t *mpcf_unescape_new(mpc_val_t *x, char *input, char **output) {
+  
+  int i;
+  int found = 0;
+  char *s = x;
+  char *y = calloc(1, 1);
+  char buff[2];
+
+  while (*s) {
+    
+    i = 0;
+    found = 0;
+    
+    while (output[i]) {
+      if ((*(s+0)) == output[i][0] &&
+          (*(s+1)) == output[i][1]) {
+        y = realloc(y, strlen(y) + 2);
+        buff[0] = input[i]; buff[1] = '\0';
+        strcat(y, buff);
+        found = 1;
+        s++;
+        break;
+      }
+      i++;
+    }
+      
+    if (!found) {
+      y = realloc(y, strlen(y) + 2);
+      buff[0] = *s; buff[1] = '\0';
+      strcat(y, buff);
+    }
+    
+    if (*s == '\0') { break; }
+    else { s++; }
+  }
+  
+  return y;
+  
+}
+
+mpc_val_t *mpcf_escape(mpc_val_t *x) {
+  mpc_val_t *y = mpcf_escape_new(x, mpc_escape_input_c, mpc_escape_output_c);
+  free(x);
+  return y;
+}
+
+mpc_val_t *mpcf_unescape(mpc_val_t *x) {
+  mpc_val_t *y = mpcf_unescape_new(x, mpc_escape_input_c, mpc_escape_output_c);
+  free(x);
+  return y;
+}
+
+mpc_val_t *mpcf_unescape_regex(mpc_val_t *x) {
+  mpc_val_t *y = mpcf_unescape_new(x, mpc_escape_input_raw_re, mpc_escape_output_raw_re);
+  free(x);
+  return y;  
+}
+
+mpc_val_t *mpcf_escape_string_raw(mpc_val_t *x) {
+  mpc_val_t *y = mpcf_escape_new(x, mpc_escape_input_raw_cstr, mpc_escape_output_raw_cstr);
+  free(x);
+  return y;
+}
+
+mpc_val_t *mpcf_unescape_string_raw(mpc_val_t *x) {
+  mpc_val_t *y = mpcf_unescape_new(x, mpc_escape_input_raw_cstr, mpc_escape_output_raw_cstr);
+  free(x);
+  return y;
+}
+
+mpc_val_t *mpcf_escape_char_raw(mpc_val_t *x) {
+  mpc_val_t *y = mpcf_escape_new(x, mpc_escape_input_raw_cchar, mpc_escape_output_raw_cchar);
+  free(x);
+  return y;
+}
+
+mpc_val_t *mpcf_unescape_char_raw(mpc_val_t *x) {
+  mpc_val_t *y = mpcf_unescape_new(x, mpc_escape_input_raw_cchar, mpc_escape_output_raw_cchar);
+  free(x);
+  return y;
+}
+
+mpc_val_t *mpcf_null(int n, mpc_val_t** xs) { return NULL; }
+mpc_val_t *mpcf_fst(int n, mpc_val_t **xs) { return xs[0]; }
+mpc_val_t *mpcf_snd(int n, mpc_val_t **xs) { return xs[1]; }
+mpc_val_t *mpcf_trd(int n, mpc_val_t **xs) { return xs[2]; }
+
+static mpc_val_t *mpcf_nth_free(int n, mpc_val_t **xs, int x) {
+  int i;
+  for (i = 0; i < n; i++) {
+    if (i != x) { free(xs[i]); }
+  }
+  return xs[x];
+}
+ 
+mpc_val_t *mpcf_fst_free(int n, mpc_val_t **xs) { return mpcf_nth_free(n, xs, 0); }
+mpc_val_t *mpcf_snd_free(int n, mpc_val_t **xs) { return mpcf_nth_free(n, xs, 1); }
+mpc_val_t *mpcf_trd_free(int n, mpc_val_t **xs) { return mpcf_nth_free(n, xs, 2); }
+
+mpc_val_t *mpcf_strfold(int n, mpc_val_t **xs) {
+  
+  char *x;
+  size_t l = 0, k;
+  int i;
+  
+  for (i = 0; i < n; i++) { l += strlen(xs[i]); }
+  
+  x = malloc(l + 1);
+  l = 0;
+  for (i = 0; i < n; i++) {
+    k = strlen(xs[i]);
+    memcpy(x + l, xs[i], k);
+    l += k;
+    free(xs[i]);
+  }
+  x[l] = '\0';
+  
+  return x;
+}
+
+mpc_val_t *mpcf_maths(int n, mpc_val_t **xs) {
+  
+  int **vs = (int**)xs;
+    
+  if (strcmp(xs[1], "*") == 0) { *vs[0] *= *vs[2]; }
+  if (strcmp(xs[1], "/") == 0) { *vs[0] /= *vs[2]; }
+  if (strcmp(xs[1], "%") == 0) { *vs[0] %= *vs[2]; }
+  if (strcmp(xs[1], "+") == 0) { *vs[0] += *vs[2]; }
+  if (strcmp(xs[1], "-") == 0) { *vs[0] -= *vs[2]; }
+  
+  free(xs[1]); free(xs[2]);
+  
+  return xs[0];
+}
+
+/*
+** Printing
+*/
+
+static void mpc_print_unretained(mpc_parser_t *p, int force) {
+  
+  /* TODO: Print Everything Escaped */
+  
+  int i, j, n;
+  char *s, *e;
+  char buff[2];
+  
+  if (p->retained && !force) {;
+    if (p->name) { printf("<%s>", p->name); }
+    else { printf("<anon>"); }
+    return;
+  }
+  
+  if (p->type == MPC_TYPE_UNDEFINED) { printf("<?>"); }
+  if (p->type == MPC_TYPE_PASS)   { printf("<:>"); }
+  if (p->type == MPC_TYPE_FAIL)   { printf("<!>"); }
+  if (p->type == MPC_TYPE_LIFT)   { printf("<#>"); }
+  if (p->type == MPC_TYPE_EXPECT) {
+    printf("%s", p->data.expect.m);
+    /*mpc_print_unretained(p->data.expect.x, 0);*/
+  }
+  
+  if (p->type == MPC_TYPE_SOI) { printf("<^>"); }
+  if (p->type == MPC_TYPE_EOI) { printf("<$>"); }
+  
+  if (p->type == MPC_TYPE_ANY) { printf("<.>"); }
+  if (p->type == MPC_TYPE_SATISFY) { printf("<f>"); }
+
+  if (p->type == MPC_TYPE_SINGLE) {
+    buff[0] = p->data.single.x; buff[1] = '\0';
+    s = mpcf_escape_new(
+      buff,
+      mpc_escape_input_c,
+      mpc_escape_output_c);
+    printf("'%s'", s);
+    free(s);
+  }
+  
+  if (p->type == MPC_TYPE_CLASS && p->data.class.err && p->data.class.err->expected_num) {
+    printf("(");
+    for (i = 0; i < p->data.class.err->expected_num; i++) {
+      printf(i ? " | %s" : "%s", p->data.class.err->expected[i]);
+    }
+    printf(")");
+  } else if (p->type == MPC_TYPE_CLASS) {
+    
+    /* Print whichever of the set or its complement is smaller */
+    for (i = 0, n = 0; i < 256; i++) { n += mpc_class_has(p->data.class.x, (char)i); }
+    e = malloc(257);
+    for (i = 1, j = 0; i < 256; i++) {
+      if (mpc_class_has(p->data.class.x, (char)i) == (n <= 128)) { e[j++] = (char)i; }
+    }
+    e[j] = '\0';
+    
+    s = mpcf_escape_new(
+      e,
+      mpc_escape_input_c,
+      mpc_escape_output_c);
+    printf(n <= 128 ? "[%s]" : "[^%s]", s);
+    free(s);
+    free(e);
+  }
+  
+  if (p->type == MPC_TYPE_STRING) {
+    s = mpcf_escape_new(
+      p->data.string.x,
+      mpc_escape_input_c,
+      mpc_escape_output_c);
+    printf("\"%s\"", s);
+    free(s);
+  }
+  
+  if (p->type == MPC_TYPE_APPLY)    { mpc_print_unretained(p->data.apply.x, 0); }
+  if (p->type == MPC_TYPE_APPLY_TO) { mpc_print_unretained(p->data.apply_to.x, 0); }
+  if (p->type == MPC_TYPE_PREDICT)  { mpc_print_unretained(p->data.predict.x, 0); }
+  if (p->type == MPC_TYPE_MEMO)     { mpc_print_unretained(p->data.memo.x, 0); }
+  if (p->type == MPC_TYPE_REGEX)    { mpc_print_unretained(p->data.regex.x, 0); }
+
+  if (p->type == MPC_TYPE_NOT)   { mpc_print_unretained(p->data.not.x, 0); printf("!"); }
+  if (p->type == MPC_TYPE_MAYBE) { mpc_print_unretained(p->data.not.x, 0); printf("?"); }
+
+  if (p->type == MPC_TYPE_MANY)  { mpc_print_unretained(p->data.repeat.x, 0); printf("*"); }
+  if (p->type == MPC_TYPE_MANY1) { mpc_print_unretained(p->data.repeat.x, 0); printf("+"); }
+  if (p->type == MPC_TYPE_COUNT) { mpc_print_unretained(p->data.repeat.x, 0); printf("{%i}", p->data.repeat.n); }
+  
+  if (p->type == MPC_TYPE_OR) {
+    printf("(");
+    for(i = 0; i < p->data.or.n-1; i++) {
+      mpc_print_unretained(p->data.or.xs[i], 0);
+      printf(" | ");
+    }
+    mpc_print_unretained(p->data.or.xs[p->data.or.n-1], 0);
+    printf(")");
+  }
+  
+  if (p->type == MPC_TYPE_AND) {
+    printf("(");
+    for(i = 0; i < p->data.and.n-1; i++) {
+      mpc_print_unretained(p->data.and.xs[i], 0);
+      printf(" ");
+    }
+    mpc_print_unretained(p->data.and.xs[p->data.and.n-1], 0);
+    printf(")");
+  }
+  
+}
+
+void mpc_print(mpc_parser_t *p) {
+  mpc_print_unretained(p, 1);
+  printf("\n");
+}
+
+/*
+** Analysis
+**
+** Every parser reachable from the roots is given
+** the set of characters it can begin with, and
+** flags for if it can match empty, if it can fail,
+** and if it can fail after consuming input. These
+** depend on one another through recursive rules
+** so they are found by updating every parser
+** until nothing changes.
+**
+** Each `or` keeps the sets of its alternatives
+** along with the error each gives when it fails
+** straight away, which is what lets the parser
+** pass over them without running them.
 **
-**      <factor> : <base>
-**               | <base> "*"
-**               | <base> "+"
-**               | <base> "?"
-**               | <base> "{" <digits> "}"
-**           
-**      <base> : <char>
-**             | "\" <char>
-**             | "(" <regex> ")"
-**             | "[" <range> "]"
+** Any named rule from which nothing reachable can
+** fail after consuming input never needs to
+** backtrack, so it is switched to predictive mode
+** for free.
 */
 
-static mpc_val_t *mpcf_re_or(int n, mpc_val_t **xs) {
-  if (xs[1] == NULL) { return xs[0]; }
-  else { return mpc_or(2, xs[0], xs[1]); }
+typedef struct {
+  mpc_parser_t *p;
+  unsigned char first[32];
+  char nullable;
+  char fallible;
+  char partial;
+  char unsafe;
+  char visiting;
+  char done;
+  mpc_err_t *err;
+} mpc_node_t;
+
+typedef struct {
+  int num;
+  int slots;
+  mpc_node_t *nodes;
+  int table_slots;
+  int *table;
+} mpc_graph_t;
+
+static int mpc_graph_children(mpc_parser_t *p) {
+  switch (p->type) {
+    case MPC_TYPE_EXPECT:
+    case MPC_TYPE_APPLY:
+    case MPC_TYPE_APPLY_TO:
+    case MPC_TYPE_PREDICT:
+    case MPC_TYPE_NOT:
+    case MPC_TYPE_MAYBE:
+    case MPC_TYPE_MANY:
+    case MPC_TYPE_MANY1:
+    case MPC_TYPE_COUNT:
+    case MPC_TYPE_MEMO:
+    case MPC_TYPE_REGEX: return 1;
+    case MPC_TYPE_OR:   return p->data.or.n;
+    case MPC_TYPE_AND:  return p->data.and.n;
+    default: return 0;
+  }
 }
 
-static mpc_val_t *mpcf_re_and(int n, mpc_val_t **xs) {
-  int i;
-  mpc_parser_t *p = mpc_lift(mpcf_ctor_str);
-  for (i = 0; i < n; i++) {
-    p = mpc_and(2, mpcf_strfold, p, xs[i], free);
+static mpc_parser_t *mpc_graph_child(mpc_parser_t *p, int k) {
+  switch (p->type) {
+    case MPC_TYPE_EXPECT:   return p->data.expect.x;
+    case MPC_TYPE_APPLY:    return p->data.apply.x;
+    case MPC_TYPE_APPLY_TO: return p->data.apply_to.x;
+    case MPC_TYPE_PREDICT:  return p->data.predict.x;
+    case MPC_TYPE_NOT:
+    case MPC_TYPE_MAYBE:    return p->data.not.x;
+    case MPC_TYPE_MANY:
+    case MPC_TYPE_MANY1:
+    case MPC_TYPE_COUNT:    return p->data.repeat.x;
+    case MPC_TYPE_MEMO:     return p->data.memo.x;
+    case MPC_TYPE_REGEX:    return p->data.regex.x;
+    case MPC_TYPE_OR:       return p->data.or.xs[k];
+    case MPC_TYPE_AND:      return p->data.and.xs[k];
+    default: return NULL;
   }
-  return p;
 }
 
-static mpc_val_t *mpcf_re_repeat(int n, mpc_val_t **xs) {
+static mpc_node_t *mpc_graph_find(mpc_graph_t *g, mpc_parser_t *p) {
   
-  int num;
-  if (xs[1] == NULL) { return xs[0]; }
-  if (strcmp(xs[1], "*") == 0) { free(xs[1]); return mpc_many(mpcf_strfold, xs[0]); }
-  if (strcmp(xs[1], "+") == 0) { free(xs[1]); return mpc_many1(mpcf_strfold, xs[0]); }
-  if (strcmp(xs[1], "?") == 0) { free(xs[1]); return mpc_maybe_lift(xs[0], mpcf_ctor_str); }
-  num = *(int*)xs[1];
-  free(xs[1]);
+  unsigned long j = mpc_memo_hash(p, 0) & (g->table_slots-1);
+  while (g->table[j]) {
+    if (g->nodes[g->table[j]-1].p == p) { return &g->nodes[g->table[j]-1]; }
+    j = (j+1) & (g->table_slots-1);
+  }
   
-  return mpc_count(num, mpcf_strfold, xs[0], free);
+  return NULL;
 }
 
-static mpc_parser_t *mpc_re_escape_char(char c) {
-  switch (c) {
-    case 'a': return mpc_char('\a');
-    case 'f': return mpc_char('\f');
-    case 'n': return mpc_char('\n');
-    case 'r': return mpc_char('\r');
-    case 't': return mpc_char('\t');
-    case 'v': return mpc_char('\v');
-    case 'b': return mpc_char('\b');
-    case 'A': return mpc_and(2, mpcf_snd, mpc_soi(), mpc_lift(mpcf_ctor_str), free);
-    case 'Z': return mpc_and(2, mpcf_snd, mpc_eoi(), mpc_lift(mpcf_ctor_str), free);
-    case 'd': return mpc_digit();
-    case 'D': return mpc_not_lift(mpc_digit(), free, mpcf_ctor_str);
-    case 's': return mpc_whitespace();
-    case 'S': return mpc_not_lift(mpc_whitespace(), free, mpcf_ctor_str);
-    case 'w': return mpc_alphanum();
-    case 'W': return mpc_not_lift(mpc_alphanum(), free, mpcf_ctor_str);
-    default: return NULL;
+static void mpc_graph_index(mpc_graph_t *g, int k) {
+  unsigned long j = mpc_memo_hash(g->nodes[k].p, 0) & (g->table_slots-1);
+  while (g->table[j]) { j = (j+1) & (g->table_slots-1); }
+  g->table[j] = k+1;
+}
+
+static void mpc_graph_insert(mpc_graph_t *g, mpc_parser_t *p) {
+  
+  int k;
+  
+  if (mpc_graph_find(g, p)) { return; }
+  
+  if (g->num == g->slots) {
+    g->slots = g->slots * 2 + 16;
+    g->nodes = realloc(g->nodes, sizeof(mpc_node_t) * g->slots);
+  }
+  
+  memset(&g->nodes[g->num], 0, sizeof(mpc_node_t));
+  g->nodes[g->num].p = p;
+  g->num++;
+  
+  if (g->num * 2 > g->table_slots) {
+    g->table_slots *= 2;
+    free(g->table);
+    g->table = calloc(g->table_slots, sizeof(int));
+    for (k = 0; k < g->num; k++) { mpc_graph_index(g, k); }
+  } else {
+    mpc_graph_index(g, g->num-1);
   }
+  
 }
 
-static mpc_val_t *mpcf_re_escape(mpc_val_t *x) {
+static void mpc_graph_init(mpc_graph_t *g, int n, mpc_parser_t **ps) {
   
-  char *s = x;
-  mpc_parser_t *p;
+  int i, k;
   
-  /* Regex Special Characters */
-  if (s[0] == '.') { free(s); return mpc_any(); }
-  if (s[0] == '^') { free(s); return mpc_and(2, mpcf_snd, mpc_soi(), mpc_lift(mpcf_ctor_str), free); }
-  if (s[0] == '$') { free(s); return mpc_and(2, mpcf_snd, mpc_eoi(), mpc_lift(mpcf_ctor_str), free); }
+  g->num = 0;
+  g->slots = 0;
+  g->nodes = NULL;
+  g->table_slots = 64;
+  g->table = calloc(g->table_slots, sizeof(int));
   
-  /* Regex Escape */
-  if (s[0] == '\\') {
-    p = mpc_re_escape_char(s[1]);
-    p = (p == NULL) ? mpc_char(s[1]) : p;
-    free(s);
-    return p;
+  for (i = 0; i < n; i++) { mpc_graph_insert(g, ps[i]); }
+  
+  /* Nodes are appended as they are found so this walks them all */
+  for (i = 0; i < g->num; i++) {
+    for (k = 0; k < mpc_graph_children(g->nodes[i].p); k++) {
+      mpc_graph_insert(g, mpc_graph_child(g->nodes[i].p, k));
+    }
   }
   
-  /* Regex Standard */
-  p = mpc_char(s[0]);
-  free(s);
-  return p;
 }
 
-static char *mpc_re_range_escape_char(char c) {
-  switch (c) {
-    case '-': return "-";
-    case 'a': return "\a";
-    case 'f': return "\f";
-    case 'n': return "\n";
-    case 'r': return "\r";
-    case 't': return "\t";
-    case 'v': return "\v";
-    case 'b': return "\b";
-    case 'd': return "0123456789";
-    case 's': return " \f\n\r\t\v";
-    case 'w': return "abcdefghijklmnopqrstuvwxyzABCDEFGHIJKLMNOPQRSTUVWXYZ0123456789_";
-    default: return NULL;
+static void mpc_graph_delete(mpc_graph_t *g) {
+  int i;
+  for (i = 0; i < g->num; i++) {
+    if (g->nodes[i].err) { mpc_err_delete(g->nodes[i].err); }
   }
+  free(g->nodes);
+  free(g->table);
 }
 
-static mpc_val_t *mpcf_re_range(mpc_val_t *x) {
-  
-  mpc_parser_t *out;
-  char *range = calloc(1,1);
-  char *tmp = NULL;
-  char *s = x;
-  char start, end;
-  int i, j;
-  int comp = 0;
+static int mpc_graph_primitive(mpc_parser_t *p, char x) {
+  switch (p->type) {
+    case MPC_TYPE_SATISFY: return 1;
+    case MPC_TYPE_STRING:  return p->data.string.x[0] != '\0' && p->data.string.x[0] == x;
+    default: return mpc_primitive_match(p, x);
+  }
+}
+
+static int mpc_graph_consumes(mpc_node_t *n) {
+  int i;
+  for (i = 0; i < 32; i++) { if (n->first[i]) { return 1; } }
+  return 0;
+}
+
+static void mpc_graph_first_add(unsigned char *first, mpc_node_t *x) {
+  int i;
+  for (i = 0; i < 32; i++) { first[i] |= x->first[i]; }
+}
+
+static int mpc_graph_update(mpc_graph_t *g, mpc_node_t *n) {
   
-  if (s[0] == '\0') { free(x); return mpc_fail("Invalid Regex Range Expression"); } 
-  if (s[0] == '^' && 
-      s[1] == '\0') { free(x); return mpc_fail("Invalid Regex Range Expression"); }
+  int i, c, consumed;
+  mpc_parser_t *p = n->p;
+  mpc_node_t *x;
+  unsigned char first[32];
+  char nullable = 0, fallible = 1, partial = 0, unsafe = 0;
   
-  if (s[0] == '^') { comp = 1;}
+  memset(first, 0, 32);
   
-  for (i = comp; i < strlen(s); i++){
+  switch (p->type) {
     
-    /* Regex Range Escape */
-    if (s[i] == '\\') {
-      tmp = mpc_re_range_escape_char(s[i+1]);
-      if (tmp != NULL) {
-        range = realloc(range, strlen(range) + strlen(tmp) + 1);
-        strcat(range, tmp);
-      } else {
-        range = realloc(range, strlen(range) + 1 + 1);
-        range[strlen(range) + 1] = '\0';
-        range[strlen(range) + 0] = s[i+1];      
+    case MPC_TYPE_UNDEFINED:
+      memset(first, 0xFF, 32);
+      nullable = 1; partial = 1;
+    break;
+    
+    case MPC_TYPE_PASS:
+    case MPC_TYPE_LIFT:
+    case MPC_TYPE_LIFT_VAL: nullable = 1; fallible = 0; break;
+    
+    case MPC_TYPE_SOI:
+    case MPC_TYPE_EOI: nullable = 1; break;
+    
+    case MPC_TYPE_ANY:
+    case MPC_TYPE_SINGLE:
+    case MPC_TYPE_CLASS:
+    case MPC_TYPE_SATISFY:
+    case MPC_TYPE_STRING:
+      for (c = 0; c < 256; c++) {
+        if (mpc_graph_primitive(p, (char)c)) { first[c / 8] |= 1 << (c % 8); }
       }
-      i++;
-    }
+      if (p->type == MPC_TYPE_STRING) {
+        nullable = p->data.string.x[0] == '\0';
+        partial = strlen(p->data.string.x) > 1;
+      }
+    break;
     
-    /* Regex Range...Range */
-    else if (s[i] == '-') {
-      if (s[i+1] == '\0' || i == 0) {
-          range = realloc(range, strlen(range) + strlen("-") + 1);
-          strcat(range, "-");
-      } else {
-        start = s[i-1]+1;
-        end = s[i+1]-1;
-        for (j = start; j <= end; j++) {
-          range = realloc(range, strlen(range) + 1 + 1);
-          range[strlen(range) + 1] = '\0';
-          range[strlen(range) + 0] = j;
-        }        
+    case MPC_TYPE_EXPECT:
+    case MPC_TYPE_APPLY:
+    case MPC_TYPE_APPLY_TO:
+    case MPC_TYPE_PREDICT:
+    case MPC_TYPE_MANY1:
+    case MPC_TYPE_MEMO:
+    case MPC_TYPE_REGEX:
+      x = mpc_graph_find(g, mpc_graph_child(p, 0));
+      mpc_graph_first_add(first, x);
+      nullable = x->nullable; fallible = x->fallible; partial = x->partial;
+    break;
+    
+    case MPC_TYPE_MAYBE:
+    case MPC_TYPE_MANY:
+      x = mpc_graph_find(g, mpc_graph_child(p, 0));
+      mpc_graph_first_add(first, x);
+      nullable = 1; fallible = 0; partial = x->partial;
+    break;
+    
+    case MPC_TYPE_NOT:
+      x = mpc_graph_find(g, mpc_graph_child(p, 0));
+      nullable = 1; partial = x->partial || mpc_graph_consumes(x);
+    break;
+    
+    case MPC_TYPE_COUNT:
+      x = mpc_graph_find(g, mpc_graph_child(p, 0));
+      if (p->data.repeat.n == 0) { nullable = 1; fallible = 0; break; }
+      mpc_graph_first_add(first, x);
+      nullable = x->nullable; fallible = x->fallible;
+      partial = x->partial || (p->data.repeat.n > 1 && mpc_graph_consumes(x));
+    break;
+    
+    case MPC_TYPE_OR:
+      if (p->data.or.n == 0) { nullable = 1; fallible = 0; break; }
+      for (i = 0; i < p->data.or.n; i++) {
+        x = mpc_graph_find(g, p->data.or.xs[i]);
+        mpc_graph_first_add(first, x);
+        nullable = nullable || x->nullable;
+        fallible = fallible && x->fallible;
+        partial = partial || x->partial;
       }
-    }
+    break;
     
-    /* Regex Range Normal */
-    else {
-      range = realloc(range, strlen(range) + 1 + 1);
-      range[strlen(range) + 1] = '\0';
-      range[strlen(range) + 0] = s[i];
-    }
-  
+    case MPC_TYPE_AND:
+      nullable = 1; fallible = 0; consumed = 0;
+      for (i = 0; i < p->data.and.n; i++) {
+        x = mpc_graph_find(g, p->data.and.xs[i]);
+        if (nullable) { mpc_graph_first_add(first, x); }
+        nullable = nullable && x->nullable;
+        fallible = fallible || x->fallible;
+        partial = partial || x->partial || (consumed && x->fallible);
+        consumed = consumed || mpc_graph_consumes(x);
+      }
+    break;
+    
+    default: break;
   }
   
-  out = comp ? mpc_noneof(range) : mpc_oneof(range);
+  unsafe = partial;
+  for (i = 0; i < mpc_graph_children(p); i++) {
+    unsafe = unsafe || mpc_graph_find(g, mpc_graph_child(p, i))->unsafe;
+  }
   
-  free(x);
-  free(range);
+  if (memcmp(first, n->first, 32) == 0
+  &&  nullable == n->nullable && fallible == n->fallible
+  &&  partial == n->partial && unsafe == n->unsafe) { return 0; }
   
-  return out;
+  memcpy(n->first, first, 32);
+  n->nullable = nullable;
+  n->fallible = fallible;
+  n->partial = partial;
+  n->unsafe = unsafe;
+  return 1;
 }
 
-mpc_parser_t *mpc_re(const char *re) {
+static mpc_err_t *mpc_graph_err(mpc_graph_t *g, mpc_node_t *n) {
   
-  char *err_msg;
-  mpc_parser_t *err_out;
-  mpc_result_t r;
-  mpc_parser_t *Regex, *Term, *Factor, *Base, *Range, *RegexEnclose; 
+  int i;
+  mpc_parser_t *p = n->p;
+  mpc_node_t *x;
+  mpc_err_t *e, **es;
   
-  Regex  = mpc_new("regex");
-  Term   = mpc_new("term");
-  Factor = mpc_new("factor");
-  Base   = mpc_new("base");
-  Range  = mpc_new("range");
+  if (n->done || n->visiting) { return n->err; }
+  n->visiting = 1;
   
-  mpc_define(Regex, mpc_and(2, 
-    mpcf_re_or,
-    Term, 
-    mpc_maybe(mpc_and(2, mpcf_snd_free, mpc_char('|'), Regex, free)),
-    (mpc_dtor_t)mpc_delete
-  ));
+  switch (p->type) {
+    
+    case MPC_TYPE_FAIL:
+      n->err = mpc_err_fail("", mpc_state_invalid(), p->data.fail.m);
+    break;
+    
+    case MPC_TYPE_ANY:
+    case MPC_TYPE_SINGLE:
+    case MPC_TYPE_SATISFY:
+    case MPC_TYPE_STRING:
+      n->err = mpc_err_fail("", mpc_state_invalid(), "Incorrect Input");
+    break;
+    
+    case MPC_TYPE_CLASS:
+      n->err = p->data.class.err
+        ? mpc_err_copy(p->data.class.err)
+        : mpc_err_fail("", mpc_state_invalid(), "Incorrect Input");
+    break;
+    
+    case MPC_TYPE_EXPECT:
+      n->err = mpc_err_new("", mpc_state_invalid(), p->data.expect.m);
+    break;
+    
+    case MPC_TYPE_APPLY:
+    case MPC_TYPE_APPLY_TO:
+    case MPC_TYPE_PREDICT:
+    case MPC_TYPE_MEMO:
+    case MPC_TYPE_REGEX:
+      e = mpc_graph_err(g, mpc_graph_find(g, mpc_graph_child(p, 0)));
+      if (e) { n->err = mpc_err_copy(e); }
+    break;
+    
+    case MPC_TYPE_MANY1:
+      e = mpc_graph_err(g, mpc_graph_find(g, mpc_graph_child(p, 0)));
+      if (e) { n->err = mpc_err_many1(mpc_err_copy(e)); }
+    break;
+    
+    case MPC_TYPE_COUNT:
+      e = mpc_graph_err(g, mpc_graph_find(g, mpc_graph_child(p, 0)));
+      if (e && p->data.repeat.n > 0) { n->err = mpc_err_count(mpc_err_copy(e), p->data.repeat.n); }
+    break;
+    
+    case MPC_TYPE_AND:
+      if (p->data.and.n == 0) { break; }
+      x = mpc_graph_find(g, p->data.and.xs[0]);
+      e = x->nullable ? NULL : mpc_graph_err(g, x);
+      if (e) { n->err = mpc_err_copy(e); }
+    break;
+    
+    case MPC_TYPE_OR:
+      if (p->data.or.n == 0) { break; }
+      es = malloc(sizeof(mpc_err_t*) * p->data.or.n);
+      for (i = 0; i < p->data.or.n; i++) {
+        x = mpc_graph_find(g, p->data.or.xs[i]);
+        e = x->nullable ? NULL : mpc_graph_err(g, x);
+        if (e == NULL) { break; }
+        es[i] = mpc_err_copy(e);
+      }
+      if (i == p->data.or.n) {
+        n->err = mpc_err_or(es, p->data.or.n);
+      } else {
+        while (i > 0) { mpc_err_delete(es[--i]); }
+      }
+      free(es);
+    break;
+    
+    default: break;
+  }
+  
+  n->visiting = 0;
+  n->done = 1;
+  return n->err;
+}
+
+static void mpc_graph_annotate(mpc_graph_t *g, mpc_node_t *n) {
+  
+  int i;
+  mpc_parser_t *p = n->p;
+  mpc_node_t *x;
+  mpc_err_t *e;
+  
+  mpc_or_first_delete(p);
+  if (p->data.or.n == 0) { return; }
   
-  mpc_define(Term, mpc_many(mpcf_re_and, Factor));
+  p->data.or.first = malloc(sizeof(mpc_first_t) * p->data.or.n);
+  for (i = 0; i < p->data.or.n; i++) {
+    x = mpc_graph_find(g, p->data.or.xs[i]);
+    e = mpc_graph_err(g, x);
+    memcpy(p->data.or.first[i].chars, x->first, 32);
+    p->data.or.first[i].nullable = x->nullable;
+    p->data.or.first[i].err = e ? mpc_err_copy(e) : NULL;
+  }
   
-  mpc_define(Factor, mpc_and(2, 
-    mpcf_re_repeat,
-    Base,
-    mpc_or(5,
-      mpc_char('*'), mpc_char('+'), mpc_char('?'),
-      mpc_brackets(mpc_int(), free),
-      mpc_pass()),
-    (mpc_dtor_t)mpc_delete
-  ));
+}
+
+static void mpc_analyse_all(int n, mpc_parser_t **ps) {
   
-  mpc_define(Base, mpc_or(4,
-    mpc_parens(Regex, (mpc_dtor_t)mpc_delete),
-    mpc_squares(Range, (mpc_dtor_t)mpc_delete),
-    mpc_apply(mpc_escape(), mpcf_re_escape),
-    mpc_apply(mpc_noneof(")|"), mpcf_re_escape)
-  ));
+  int i, changed;
+  mpc_graph_t g;
+  mpc_parser_t *p, *b;
   
-  mpc_define(Range, mpc_apply(
-    mpc_many(mpcf_strfold, mpc_or(2, mpc_escape(), mpc_noneof("]"))),
-    mpcf_re_range
-  ));
+  mpc_graph_init(&g, n, ps);
   
-  RegexEnclose = mpc_whole(mpc_predictive(Regex), (mpc_dtor_t)mpc_delete);
+  do {
+    changed = 0;
+    for (i = g.num-1; i >= 0; i--) {
+      changed = mpc_graph_update(&g, &g.nodes[i]) || changed;
+    }
+  } while (changed);
   
-  if(!mpc_parse("<mpc_re_compiler>", re, RegexEnclose, &r)) {
-    err_msg = mpc_err_string(r.error);
-    err_out = mpc_failf("Invalid Regex: %s", err_msg);
-    mpc_err_delete(r.error);  
-    free(err_msg);
-    r.output = err_out;
+  for (i = 0; i < g.num; i++) {
+    if (g.nodes[i].p->type == MPC_TYPE_OR) { mpc_graph_annotate(&g, &g.nodes[i]); }
   }
   
-  mpc_delete(RegexEnclose);
-  mpc_cleanup(5, Regex, Term, Factor, Base, Range);
-  
-  return r.output;
+  for (i = 0; i < g.num; i++) {
+    p = g.nodes[i].p;
+    if (!p->retained || g.nodes[i].unsafe
+    ||  p->type == MPC_TYPE_UNDEFINED
+    ||  p->type == MPC_TYPE_PREDICT) { continue; }
+    b = mpc_undefined();
+    b->type = p->type;
+    b->data = p->data;
+    p->type = MPC_TYPE_PREDICT;
+    p->data.predict.x = b;
+  }
   
+  mpc_graph_delete(&g);
+}
+
+void mpc_analyse(mpc_parser_t *p) {
+  mpc_analyse_all(1, &p);
 }
 
 /*
-** Common Fold Functions
+** Optimisation
+**
+** Rewrites a parser into one that gives the same
+** results and errors with fewer steps. Unretained
+** parsers have just one parent, so they can be
+** merged, moved and freed. Retained parsers stay
+** where they are but their bodies are rewritten
+** in turn.
 */
 
-void mpcf_dtor_null(mpc_val_t *x) { return; }
+enum {
+  MPC_OPTIMISE_NONE = 0,
+  MPC_OPTIMISE_SEQ  = 1,
+  MPC_OPTIMISE_STR  = 2
+};
 
-mpc_val_t *mpcf_ctor_null(void) { return NULL; }
-mpc_val_t *mpcf_ctor_str(void) { return calloc(1, 1); }
-mpc_val_t *mpcf_free(mpc_val_t *x) { free(x); return NULL; }
+typedef struct {
+  int num;
+  int slots;
+  mpc_parser_t **todo;
+  int table_slots;
+  mpc_parser_t **table;
+  int factor;
+} mpc_optimiser_t;
 
-mpc_val_t *mpcf_int(mpc_val_t *x) {
-  int *y = malloc(sizeof(int));
-  *y = strtol(x, NULL, 10);
-  free(x);
-  return y;
-}
+/*
+** `mpca_and` folds pairwise with `mpcf_fold_ast`.
+** That leaves a single non-NULL result alone and
+** splices anything else, so a chain flattened into
+** one `and` must fold like this to stay the same.
+*/
 
-mpc_val_t *mpcf_hex(mpc_val_t *x) {
-  int *y = malloc(sizeof(int));
-  *y = strtol(x, NULL, 16);
-  free(x);
-  return y;
+static mpc_val_t *mpc_optimise_fold(int n, mpc_val_t **xs) {
+  
+  int i, j = 0, k = 0;
+  for (i = 0; i < n; i++) { if (xs[i]) { j = i; k++; } }
+  
+  if (k == 0) { return NULL; }
+  if (k == 1) { return xs[j]; }
+  return mpcf_fold_ast(n, xs);
 }
 
-mpc_val_t *mpcf_oct(mpc_val_t *x) {
-  int *y = malloc(sizeof(int));
-  *y = strtol(x, NULL, 8);
-  free(x);
-  return y;
+static int mpc_optimise_kind(mpc_parser_t *p) {
+  
+  int i;
+  
+  if (p->type != MPC_TYPE_AND || p->data.and.n < 2) { return MPC_OPTIMISE_NONE; }
+  
+  for (i = 1; i < p->data.and.n-1; i++) {
+    if (p->data.and.dxs[i] != p->data.and.dxs[0]) { return MPC_OPTIMISE_NONE; }
+  }
+  
+  if (p->data.and.f == mpc_optimise_fold) { return MPC_OPTIMISE_SEQ; }
+  if (p->data.and.f == mpcf_fold_ast && p->data.and.n == 2) { return MPC_OPTIMISE_SEQ; }
+  if (p->data.and.f == mpcf_strfold) { return MPC_OPTIMISE_STR; }
+  return MPC_OPTIMISE_NONE;
 }
 
-mpc_val_t *mpcf_float(mpc_val_t *x) {
-  float* y = malloc(sizeof(float));
-  *y = strtod(x, NULL);
-  free(x);
-  return y;
+static int mpc_optimise_joins(mpc_parser_t *x, int kind, mpc_dtor_t d) {
+  return !x->retained
+    && mpc_optimise_kind(x) == kind
+    && x->data.and.dxs[0] == d;
 }
 
-static char mpc_escape_input_c[]  = {
-  '\a', '\b', '\f', '\n', '\r',
-  '\t', '\v', '\\', '\'', '\"', '\0'};
-    
-static char *mpc_escape_output_c[] = {
-  "\\a", "\\b", "\\f", "\\n", "\\r", "\\t", 
-  "\\v", "\\\\", "\\'", "\\\"", "\\0", NULL};
-
-static char mpc_escape_input_raw_re[] = { '/' };
-static char *mpc_escape_output_raw_re[] = { "\\/", NULL };
-
-static char mpc_escape_input_raw_cstr[] = { '"' };
-static char *mpc_escape_output_raw_cstr[] = { "\\\"", NULL };
-
-static char mpc_escape_input_raw_cchar[] = { '\'' };
-static char *mpc_escape_output_raw_cchar[] = { "\\'", NULL };
-
-static mpc_val_t *mpcf_escape_new(mpc_val_t *x, char *input, char **output) {
+static int mpc_optimise_eq(mpc_parser_t *a, mpc_parser_t *b) {
   
   int i;
-  int found;
-  char *s = x;
-  char *y = calloc(1, 1);
-  char buff[2];
   
-  while (*s) {
+  if (a == b) { return 1; }
+  if (a->retained || b->retained || a->type != b->type) { return 0; }
+  
+  switch (a->type) {
     
-    i = 0;
-    found = 0;
-
-    while (output[i]) {
-      if (*s == input[i]) {
-        y = realloc(y, strlen(y) + strlen(output[i]) + 1);
-        strcat(y, output[i]);
-        found = 1;
-        break;
+    case MPC_TYPE_PASS:
+    case MPC_TYPE_SOI:
+    case MPC_TYPE_EOI:
+    case MPC_TYPE_ANY: return 1;
+    
+    case MPC_TYPE_FAIL:     return strcmp(a->data.fail.m, b->data.fail.m) == 0;
+    case MPC_TYPE_LIFT:     return a->data.lift.lf == b->data.lift.lf;
+    case MPC_TYPE_LIFT_VAL: return a->data.lift.x == b->data.lift.x;
+    case MPC_TYPE_SINGLE:   return a->data.single.x == b->data.single.x;
+    case MPC_TYPE_SATISFY:  return a->data.satisfy.f == b->data.satisfy.f;
+    case MPC_TYPE_STRING:   return strcmp(a->data.string.x, b->data.string.x) == 0;
+    
+    case MPC_TYPE_CLASS:
+      return a->data.class.err == NULL && b->data.class.err == NULL
+        && memcmp(a->data.class.x, b->data.class.x, 32) == 0;
+    
+    case MPC_TYPE_EXPECT:
+      return strcmp(a->data.expect.m, b->data.expect.m) == 0
+        && mpc_optimise_eq(a->data.expect.x, b->data.expect.x);
+    
+    case MPC_TYPE_APPLY:
+      return a->data.apply.f == b->data.apply.f
+        && mpc_optimise_eq(a->data.apply.x, b->data.apply.x);
+    
+    case MPC_TYPE_APPLY_TO:
+      return a->data.apply_to.f == b->data.apply_to.f
+        && a->data.apply_to.d == b->data.apply_to.d
+        && mpc_optimise_eq(a->data.apply_to.x, b->data.apply_to.x);
+    
+    case MPC_TYPE_PREDICT: return mpc_optimise_eq(a->data.predict.x, b->data.predict.x);
+    case MPC_TYPE_REGEX:   return mpc_optimise_eq(a->data.regex.x, b->data.regex.x);
+    
+    case MPC_TYPE_NOT:
+    case MPC_TYPE_MAYBE:
+      return a->data.not.dx == b->data.not.dx
+        && a->data.not.lf == b->data.not.lf
+        && mpc_optimise_eq(a->data.not.x, b->data.not.x);
+    
+    case MPC_TYPE_MANY:
+    case MPC_TYPE_MANY1:
+    case MPC_TYPE_COUNT:
+      return a->data.repeat.n == b->data.repeat.n
+        && a->data.repeat.f == b->data.repeat.f
+        && a->data.repeat.dx == b->data.repeat.dx
+        && mpc_optimise_eq(a->data.repeat.x, b->data.repeat.x);
+    
+    case MPC_TYPE_MEMO:
+      return a->data.memo.cx == b->data.memo.cx
+        && a->data.memo.dx == b->data.memo.dx
+        && mpc_optimise_eq(a->data.memo.x, b->data.memo.x);
+    
+    case MPC_TYPE_OR:
+      if (a->data.or.n != b->data.or.n) { return 0; }
+      for (i = 0; i < a->data.or.n; i++) {
+        if (!mpc_optimise_eq(a->data.or.xs[i], b->data.or.xs[i])) { return 0; }
       }
-      i++;
-    }
+      return 1;
     
-    if (!found) {
-      y = realloc(y, strlen(y) + 2);
-      buff[0] = *s; buff[1] = '\0';
-      strcat(y, buff);
-    }
+    case MPC_TYPE_AND:
+      if (a->data.and.n != b->data.and.n || a->data.and.f != b->data.and.f) { return 0; }
+      for (i = 0; i < a->data.and.n; i++) {
+        if (!mpc_optimise_eq(a->data.and.xs[i], b->data.and.xs[i])) { return 0; }
+      }
+      for (i = 0; i < a->data.and.n-1; i++) {
+        if (a->data.and.dxs[i] != b->data.and.dxs[i]) { return 0; }
+      }
+      return 1;
     
-    s++;
+    default: return 0;
   }
-  
-  
-  return y;
 }
 
-static mpc_val_t *mpcf_unescape_new(mpc_val_t *x, char *input, char **output) {
+/* Returns the child `p` is equivalent to, if any */
+static mpc_parser_t *mpc_optimise_single(mpc_parser_t *p) {
   
-  int i;
-  int found = 0;
-  char *s = x;
-  char *y = calloc(1, 1);
-  char buff[2];
-
-  while (*s) {
+  mpc_parser_t *x;
+  
+  switch (p->type) {
     
-    i = 0;
-    found = 0;
+    case MPC_TYPE_AND:
+      if (p->data.and.n != 1) { return NULL; }
+      if (p->data.and.f != mpc_optimise_fold
+      &&  p->data.and.f != mpcf_fold_ast
+      &&  p->data.and.f != mpcf_strfold) { return NULL; }
+      return p->data.and.xs[0];
     
-    while (output[i]) {
-      if ((*(s+0)) == output[i][0] &&
-          (*(s+1)) == output[i][1]) {
-        y = realloc(y, strlen(y) + 2);
-        buff[0] = input[i]; buff[1] = '\0';
-        strcat(y, buff);
-        found = 1;
-        s++;
-        break;
-      }
-      i++;
-    }
-      
-    if (!found) {
-      y = realloc(y, strlen(y) + 2);
-      buff[0] = *s; buff[1] = '\0';
-      strcat(y, buff);
-    }
+    case MPC_TYPE_OR:
+      return p->data.or.n == 1 ? p->data.or.xs[0] : NULL;
     
-    if (*s == '\0') { break; }
-    else { s++; }
+    /* An `expect` around something that cannot fail does nothing */
+    case MPC_TYPE_EXPECT:
+      x = p->data.expect.x;
+      if (x->retained) { return NULL; }
+      if (x->type == MPC_TYPE_PASS
+      ||  x->type == MPC_TYPE_LIFT
+      ||  x->type == MPC_TYPE_LIFT_VAL
+      ||  x->type == MPC_TYPE_MAYBE
+      ||  x->type == MPC_TYPE_MANY) { return x; }
+      return NULL;
+    
+    default: return NULL;
   }
-  
-  return y;
-  
 }
 
-mpc_val_t *mpcf_escape(mpc_val_t *x) {
-  mpc_val_t *y = mpcf_escape_new(x, mpc_escape_input_c, mpc_escape_output_c);
-  free(x);
-  return y;
+/* Frees what `p` owns apart from its children */
+static void mpc_optimise_release(mpc_parser_t *p) {
+  switch (p->type) {
+    case MPC_TYPE_AND:
+      free(p->data.and.xs);
+      free(p->data.and.dxs);
+    break;
+    case MPC_TYPE_OR:
+      mpc_or_first_delete(p);
+      free(p->data.or.xs);
+    break;
+    case MPC_TYPE_EXPECT:
+      free(p->data.expect.m);
+    break;
+    default: break;
+  }
 }
 
-mpc_val_t *mpcf_unescape(mpc_val_t *x) {
-  mpc_val_t *y = mpcf_unescape_new(x, mpc_escape_input_c, mpc_escape_output_c);
-  free(x);
-  return y;
+static mpc_parser_t *mpc_optimise_collapse(mpc_parser_t *p) {
+  mpc_parser_t *x = mpc_optimise_single(p);
+  if (x == NULL) { return p; }
+  mpc_optimise_release(p);
+  free(p);
+  return x;
 }
 
-mpc_val_t *mpcf_unescape_regex(mpc_val_t *x) {
-  mpc_val_t *y = mpcf_unescape_new(x, mpc_escape_input_raw_re, mpc_escape_output_raw_re);
-  free(x);
-  return y;  
+static int mpc_optimise_fusable(mpc_parser_t *x) {
+  return !x->retained
+    && ((x->type == MPC_TYPE_SINGLE && x->data.single.x != '\0')
+    ||   x->type == MPC_TYPE_STRING);
 }
 
-mpc_val_t *mpcf_escape_string_raw(mpc_val_t *x) {
-  mpc_val_t *y = mpcf_escape_new(x, mpc_escape_input_raw_cstr, mpc_escape_output_raw_cstr);
-  free(x);
-  return y;
+static void mpc_optimise_fuse(mpc_parser_t *x, mpc_parser_t *y) {
+  
+  char *s;
+  size_t l;
+  
+  if (x->type == MPC_TYPE_SINGLE) {
+    s = malloc(2);
+    s[0] = x->data.single.x;
+    s[1] = '\0';
+    x->type = MPC_TYPE_STRING;
+    x->data.string.x = s;
+  }
+  
+  l = strlen(x->data.string.x);
+  if (y->type == MPC_TYPE_SINGLE) {
+    x->data.string.x = realloc(x->data.string.x, l + 2);
+    x->data.string.x[l] = y->data.single.x;
+    x->data.string.x[l+1] = '\0';
+  } else {
+    x->data.string.x = realloc(x->data.string.x, l + strlen(y->data.string.x) + 1);
+    strcpy(x->data.string.x + l, y->data.string.x);
+  }
+  
+  mpc_undefine_unretained(y, 0);
 }
 
-mpc_val_t *mpcf_unescape_string_raw(mpc_val_t *x) {
-  mpc_val_t *y = mpcf_unescape_new(x, mpc_escape_input_raw_cstr, mpc_escape_output_raw_cstr);
-  free(x);
-  return y;
+/*
+** Splices child `and`s of the same kind into `p`
+** and drops any `pass`, whose NULL the fold skips.
+** Runs of characters fuse into one string only when
+** `p` sits directly under an `expect`, because the
+** error for a string is reported at its start.
+*/
+
+static void mpc_optimise_and(mpc_parser_t *p, int expect) {
+  
+  int i, j, n, m, passes;
+  int kind = mpc_optimise_kind(p);
+  mpc_dtor_t d;
+  mpc_parser_t *x, **xs;
+  
+  if (kind == MPC_OPTIMISE_NONE) { return; }
+  d = p->data.and.dxs[0];
+  
+  n = 0; passes = 0;
+  for (i = 0; i < p->data.and.n; i++) {
+    x = p->data.and.xs[i];
+    n += mpc_optimise_joins(x, kind, d) ? x->data.and.n : 1;
+    passes += !x->retained && x->type == MPC_TYPE_PASS;
+  }
+  
+  if (kind == MPC_OPTIMISE_SEQ && passes == n) { passes--; }
+  if (kind != MPC_OPTIMISE_SEQ) { passes = 0; }
+  
+  xs = malloc(sizeof(mpc_parser_t*) * n);
+  m = 0;
+  
+  for (i = 0; i < p->data.and.n; i++) {
+    x = p->data.and.xs[i];
+    if (mpc_optimise_joins(x, kind, d)) {
+      for (j = 0; j < x->data.and.n; j++) { xs[m++] = x->data.and.xs[j]; }
+      mpc_optimise_release(x);
+      free(x);
+    } else if (passes && !x->retained && x->type == MPC_TYPE_PASS) {
+      mpc_undefine_unretained(x, 0);
+      passes--;
+    } else if (kind == MPC_OPTIMISE_STR && expect && m > 0
+    &&  mpc_optimise_fusable(xs[m-1]) && mpc_optimise_fusable(x)) {
+      mpc_optimise_fuse(xs[m-1], x);
+    } else {
+      xs[m++] = x;
+    }
+  }
+  
+  free(p->data.and.xs);
+  free(p->data.and.dxs);
+  
+  p->data.and.n = m;
+  p->data.and.f = kind == MPC_OPTIMISE_SEQ ? mpc_optimise_fold : mpcf_strfold;
+  p->data.and.xs = realloc(xs, sizeof(mpc_parser_t*) * m);
+  p->data.and.dxs = m > 1 ? malloc(sizeof(mpc_dtor_t) * (m-1)) : NULL;
+  for (i = 0; i < m-1; i++) { p->data.and.dxs[i] = d; }
+  
 }
 
-mpc_val_t *mpcf_escape_char_raw(mpc_val_t *x) {
-  mpc_val_t *y = mpcf_escape_new(x, mpc_escape_input_raw_cchar, mpc_escape_output_raw_cchar);
-  free(x);
-  return y;
+static void mpc_optimise_or(mpc_parser_t *p, int factor);
+
+/* Strips the first parser off an `and` */
+static mpc_parser_t *mpc_optimise_tail(mpc_parser_t *p) {
+  
+  mpc_parser_t *x;
+  
+  p->data.and.n--;
+  memmove(p->data.and.xs, p->data.and.xs+1, sizeof(mpc_parser_t*) * p->data.and.n);
+  memmove(p->data.and.dxs, p->data.and.dxs+1, sizeof(mpc_dtor_t) * (p->data.and.n-1));
+  
+  if (p->data.and.n > 1) { return p; }
+  
+  x = p->data.and.xs[0];
+  mpc_optimise_release(p);
+  free(p);
+  return x;
+}
+
+/*
+** Turns `a b | a c` into `a (b | c)`. Both fold
+** kinds are associative and `a` gives the same
+** result and errors both times it runs, so only
+** the second run is lost.
+*/
+
+static mpc_parser_t *mpc_optimise_factor(mpc_parser_t **xs, int n, int kind) {
+  
+  int i;
+  mpc_parser_t *p = mpc_undefined();
+  mpc_parser_t *q = mpc_undefined();
+  mpc_dtor_t d = xs[0]->data.and.dxs[0];
+  
+  p->type = MPC_TYPE_AND;
+  p->data.and.n = 2;
+  p->data.and.f = kind == MPC_OPTIMISE_SEQ ? mpc_optimise_fold : mpcf_strfold;
+  p->data.and.xs = malloc(sizeof(mpc_parser_t*) * 2);
+  p->data.and.dxs = malloc(sizeof(mpc_dtor_t));
+  p->data.and.xs[0] = xs[0]->data.and.xs[0];
+  p->data.and.xs[1] = q;
+  p->data.and.dxs[0] = d;
+  
+  q->type = MPC_TYPE_OR;
+  q->data.or.n = n;
+  q->data.or.xs = malloc(sizeof(mpc_parser_t*) * n);
+  q->data.or.first = NULL;
+  
+  for (i = 0; i < n; i++) {
+    if (i > 0) { mpc_undefine_unretained(xs[i]->data.and.xs[0], 0); }
+    q->data.or.xs[i] = mpc_optimise_tail(xs[i]);
+  }
+  
+  mpc_optimise_or(q, 1);
+  p->data.and.xs[1] = mpc_optimise_collapse(q);
+  mpc_optimise_and(p, 0);
+  
+  return p;
 }
 
-mpc_val_t *mpcf_unescape_char_raw(mpc_val_t *x) {
-  mpc_val_t *y = mpcf_unescape_new(x, mpc_escape_input_raw_cchar, mpc_escape_output_raw_cchar);
-  free(x);
-  return y;
+static int mpc_optimise_shares(mpc_parser_t *x, mpc_parser_t *y, int kind) {
+  return mpc_optimise_joins(y, kind, x->data.and.dxs[0])
+    && mpc_optimise_eq(x->data.and.xs[0], y->data.and.xs[0]);
 }
 
-mpc_val_t *mpcf_null(int n, mpc_val_t** xs) { return NULL; }
-mpc_val_t *mpcf_fst(int n, mpc_val_t **xs) { return xs[0]; }
-mpc_val_t *mpcf_snd(int n, mpc_val_t **xs) { return xs[1]; }
-mpc_val_t *mpcf_trd(int n, mpc_val_t **xs) { return xs[2]; }
+/*
+** Splices child `or`s into `p`, drops anything after
+** an alternative that always succeeds, and if
+** `factor` is set factors out prefixes shared by
+** neighbouring alternatives.
+*/
 
-static mpc_val_t *mpcf_nth_free(int n, mpc_val_t **xs, int x) {
-  int i;
-  for (i = 0; i < n; i++) {
-    if (i != x) { free(xs[i]); }
+static void mpc_optimise_or(mpc_parser_t *p, int factor) {
+  
+  int i, j, n, m, kind;
+  mpc_parser_t *x, **xs;
+  
+  mpc_or_first_delete(p);
+  
+  n = 0;
+  for (i = 0; i < p->data.or.n; i++) {
+    x = p->data.or.xs[i];
+    n += (!x->retained && x->type == MPC_TYPE_OR && x->data.or.n > 0) ? x->data.or.n : 1;
   }
-  return xs[x];
+  
+  xs = malloc(sizeof(mpc_parser_t*) * n);
+  m = 0;
+  
+  for (i = 0; i < p->data.or.n; i++) {
+    x = p->data.or.xs[i];
+    if (!x->retained && x->type == MPC_TYPE_OR && x->data.or.n > 0) {
+      for (j = 0; j < x->data.or.n; j++) { xs[m++] = x->data.or.xs[j]; }
+      mpc_optimise_release(x);
+      free(x);
+    } else {
+      xs[m++] = x;
+    }
+  }
+  
+  for (i = 0; i < m; i++) {
+    if (!xs[i]->retained && xs[i]->type == MPC_TYPE_PASS) {
+      for (j = i+1; j < m; j++) { mpc_undefine_unretained(xs[j], 0); }
+      m = i+1;
+    }
+  }
+  
+  free(p->data.or.xs);
+  p->data.or.xs = xs;
+  p->data.or.n = 0;
+  
+  for (i = 0; i < m; i = j) {
+    x = xs[i];
+    kind = x->retained || !factor ? MPC_OPTIMISE_NONE : mpc_optimise_kind(x);
+    for (j = i+1; kind && j < m && mpc_optimise_shares(x, xs[j], kind); j++);
+    if (j == i+1) {
+      xs[p->data.or.n++] = x;
+    } else {
+      xs[p->data.or.n++] = mpc_optimise_factor(xs+i, j-i, kind);
+    }
+  }
+  
 }
- 
-mpc_val_t *mpcf_fst_free(int n, mpc_val_t **xs) { return mpcf_nth_free(n, xs, 0); }
-mpc_val_t *mpcf_snd_free(int n, mpc_val_t **xs) { return mpcf_nth_free(n, xs, 1); }
-mpc_val_t *mpcf_trd_free(int n, mpc_val_t **xs) { return mpcf_nth_free(n, xs, 2); }
 
-mpc_val_t *mpcf_strfold(int n, mpc_val_t **xs) {
-  char *x = calloc(1, 1);
+static void mpc_optimise_visit(mpc_optimiser_t *o, mpc_parser_t *p) {
+  
   int i;
-  for (i = 0; i < n; i++) {
-    x = realloc(x, strlen(x) + strlen(xs[i]) + 1);
-    strcat(x, xs[i]);
-    free(xs[i]);
+  unsigned long j;
+  mpc_parser_t **table;
+  
+  if (o->num * 2 >= o->table_slots) {
+    table = o->table;
+    o->table_slots *= 2;
+    o->table = calloc(o->table_slots, sizeof(mpc_parser_t*));
+    for (i = 0; i < o->table_slots / 2; i++) {
+      if (table[i] == NULL) { continue; }
+      j = mpc_memo_hash(table[i], 0) & (o->table_slots-1);
+      while (o->table[j]) { j = (j+1) & (o->table_slots-1); }
+      o->table[j] = table[i];
+    }
+    free(table);
   }
-  return x;
+  
+  j = mpc_memo_hash(p, 0) & (o->table_slots-1);
+  while (o->table[j]) {
+    if (o->table[j] == p) { return; }
+    j = (j+1) & (o->table_slots-1);
+  }
+  o->table[j] = p;
+  
+  if (o->num == o->slots) {
+    o->slots = o->slots ? o->slots * 2 : 16;
+    o->todo = realloc(o->todo, sizeof(mpc_parser_t*) * o->slots);
+  }
+  o->todo[o->num++] = p;
+  
 }
 
-mpc_val_t *mpcf_maths(int n, mpc_val_t **xs) {
+static mpc_parser_t *mpc_optimise_node(mpc_optimiser_t *o, mpc_parser_t *p, int expect);
+
+static void mpc_optimise_body(mpc_optimiser_t *o, mpc_parser_t *p, int expect) {
   
-  int **vs = (int**)xs;
-    
-  if (strcmp(xs[1], "*") == 0) { *vs[0] *= *vs[2]; }
-  if (strcmp(xs[1], "/") == 0) { *vs[0] /= *vs[2]; }
-  if (strcmp(xs[1], "%") == 0) { *vs[0] %= *vs[2]; }
-  if (strcmp(xs[1], "+") == 0) { *vs[0] += *vs[2]; }
-  if (strcmp(xs[1], "-") == 0) { *vs[0] -= *vs[2]; }
+  int i;
+  mpc_parser_t *x;
   
-  free(xs[1]); free(xs[2]);
+  switch (p->type) {
+    
+    case MPC_TYPE_EXPECT:
+      p->data.expect.x = mpc_optimise_node(o, p->data.expect.x, 1);
+      x = p->data.expect.x;
+      if (!x->retained && x->type == MPC_TYPE_EXPECT) {
+        p->data.expect.x = x->data.expect.x;
+        mpc_optimise_release(x);
+        free(x);
+      }
+    break;
+    
+    case MPC_TYPE_APPLY:    p->data.apply.x = mpc_optimise_node(o, p->data.apply.x, 0); break;
+    case MPC_TYPE_APPLY_TO: p->data.apply_to.x = mpc_optimise_node(o, p->data.apply_to.x, 0); break;
+    case MPC_TYPE_PREDICT:  p->data.predict.x = mpc_optimise_node(o, p->data.predict.x, 0); break;
+    case MPC_TYPE_MEMO:     p->data.memo.x = mpc_optimise_node(o, p->data.memo.x, 0); break;
+    
+    case MPC_TYPE_NOT:
+    case MPC_TYPE_MAYBE:
+      p->data.not.x = mpc_optimise_node(o, p->data.not.x, 0);
+    break;
+    
+    case MPC_TYPE_MANY:
+    case MPC_TYPE_MANY1:
+    case MPC_TYPE_COUNT:
+      p->data.repeat.x = mpc_optimise_node(o, p->data.repeat.x, 0);
+    break;
+    
+    case MPC_TYPE_OR:
+      for (i = 0; i < p->data.or.n; i++) {
+        p->data.or.xs[i] = mpc_optimise_node(o, p->data.or.xs[i], 0);
+      }
+      mpc_optimise_or(p, o->factor);
+    break;
+    
+    case MPC_TYPE_AND:
+      for (i = 0; i < p->data.and.n; i++) {
+        p->data.and.xs[i] = mpc_optimise_node(o, p->data.and.xs[i], 0);
+      }
+      mpc_optimise_and(p, expect);
+    break;
+    
+    /* Regular expressions already run on their own automaton */
+    default: break;
+  }
   
-  return xs[0];
+}
+
+static mpc_parser_t *mpc_optimise_node(mpc_optimiser_t *o, mpc_parser_t *p, int expect) {
+  if (p->retained) { mpc_optimise_visit(o, p); return p; }
+  mpc_optimise_body(o, p, expect);
+  return mpc_optimise_collapse(p);
 }
 
 /*
-** Printing
+** Factoring lets an alternative be reached after
+** another has consumed input, which a predictive
+** parser never allows. Being predictive is passed
+** on to every rule run from inside `mpc_predictive`
+** so factoring is left off for any grammar using it.
 */
 
-static void mpc_print_unretained(mpc_parser_t *p, int force) {
-  
-  /* TODO: Print Everything Escaped */
-  
+static int mpc_optimise_predicts_node(mpc_optimiser_t *o, mpc_parser_t *p);
+
+static int mpc_optimise_predicts(mpc_optimiser_t *o, mpc_parser_t *p) {
   int i;
-  char *s, *e;
-  char buff[2];
-  
-  if (p->retained && !force) {;
-    if (p->name) { printf("<%s>", p->name); }
-    else { printf("<anon>"); }
-    return;
+  if (p->type == MPC_TYPE_PREDICT) { return 1; }
+  for (i = 0; i < mpc_graph_children(p); i++) {
+    if (mpc_optimise_predicts_node(o, mpc_graph_child(p, i))) { return 1; }
   }
+  return 0;
+}
+
+static int mpc_optimise_predicts_node(mpc_optimiser_t *o, mpc_parser_t *p) {
+  if (p->retained) { mpc_optimise_visit(o, p); return 0; }
+  return mpc_optimise_predicts(o, p);
+}
+
+static void mpc_optimise_all(int n, mpc_parser_t **ps) {
   
-  if (p->type == MPC_TYPE_UNDEFINED) { printf("<?>"); }
-  if (p->type == MPC_TYPE_PASS)   { printf("<:>"); }
-  if (p->type == MPC_TYPE_FAIL)   { printf("<!>"); }
-  if (p->type == MPC_TYPE_LIFT)   { printf("<#>"); }
-  if (p->type == MPC_TYPE_EXPECT) {
-    printf("%s", p->data.expect.m);
-    /*mpc_print_unretained(p->data.expect.x, 0);*/
-  }
+  int i;
+  mpc_optimiser_t o;
+  mpc_parser_t *p, *x;
   
-  if (p->type == MPC_TYPE_SOI) { printf("<^>"); }
-  if (p->type == MPC_TYPE_EOI) { printf("<$>"); }
+  o.num = 0;
+  o.slots = 0;
+  o.todo = NULL;
+  o.table_slots = 64;
+  o.table = calloc(o.table_slots, sizeof(mpc_parser_t*));
+  o.factor = 1;
   
-  if (p->type == MPC_TYPE_ANY) { printf("<.>"); }
-  if (p->type == MPC_TYPE_SATISFY) { printf("<f>"); }
-
-  if (p->type == MPC_TYPE_SINGLE) {
-    buff[0] = p->data.single.x; buff[1] = '\0';
-    s = mpcf_escape_new(
-      buff,
-      mpc_escape_input_c,
-      mpc_escape_output_c);
-    printf("'%s'", s);
-    free(s);
+  for (i = 0; i < n; i++) {
+    if (ps[i] != NULL) { mpc_optimise_visit(&o, ps[i]); }
   }
   
-  if (p->type == MPC_TYPE_RANGE) {
-    buff[0] = p->data.range.x; buff[1] = '\0';
-    s = mpcf_escape_new(
-      buff,
-      mpc_escape_input_c,
-      mpc_escape_output_c);
-    buff[0] = p->data.range.y; buff[1] = '\0';
-    e = mpcf_escape_new(
-      buff,
-      mpc_escape_input_c,
-      mpc_escape_output_c);
-    printf("[%s-%s]", s, e);
-    free(s);
-    free(e);
+  for (i = 0; i < o.num; i++) {
+    if (mpc_optimise_predicts(&o, o.todo[i])) { o.factor = 0; break; }
   }
   
-  if (p->type == MPC_TYPE_ONEOF) {
-    s = mpcf_escape_new(
-      p->data.string.x,
-      mpc_escape_input_c,
-      mpc_escape_output_c);
-    printf("[%s]", s);
-    free(s);
+  /* Retained parsers are appended as they are found */
+  for (i = 0; i < o.num; i++) {
+    
+    p = o.todo[i];
+    mpc_optimise_body(&o, p, 0);
+    
+    /* A root cannot be replaced, so the child moves into it */
+    while ((x = mpc_optimise_single(p)) && !x->retained) {
+      mpc_optimise_release(p);
+      p->type = x->type;
+      p->data = x->data;
+      free(x);
+    }
+    
   }
   
-  if (p->type == MPC_TYPE_NONEOF) {
-    s = mpcf_escape_new(
-      p->data.string.x,
-      mpc_escape_input_c,
-      mpc_escape_output_c);
-    printf("[^%s]", s);
-    free(s);
+  free(o.todo);
+  free(o.table);
+}
+
+void mpc_optimise(mpc_parser_t *p) {
+  mpc_optimise_all(1, &p);
+}
+
+/*
+** Compilation
+**
+** A grammar can be lowered into one array of
+** instructions, each naming its children by
+** their distance from it, and run by a loop of
+** its own. The loop is the engine above with the
+** parser stack swapped for a compact stack of
+** program counters and states, so the results
+** and errors are exactly the same.
+**
+** Instructions keep a pointer back to the parser
+** they were made from for their data. So a
+** program must be deleted before its grammar is
+** and the grammar must not be changed meanwhile.
+*/
+
+typedef struct {
+  char type;
+  int n;
+  int x;
+  mpc_parser_t *p;
+} mpc_instr_t;
+
+struct mpc_program_t {
+  int code_num;
+  mpc_instr_t *code;
+  int *links;
+};
+
+typedef struct {
+  int pc;
+  int st;
+} mpc_program_frame_t;
+
+static int mpc_compile_children(mpc_parser_t *p) {
+  return p->type == MPC_TYPE_REGEX ? 0 : mpc_graph_children(p);
+}
+
+mpc_program_t *mpc_compile(mpc_parser_t *p) {
+  
+  int k, j, links_num;
+  mpc_graph_t g;
+  mpc_parser_t *x;
+  mpc_instr_t *c;
+  mpc_program_t *prog = malloc(sizeof(mpc_program_t));
+  
+  /* Nodes are numbered in the order they are found */
+  g.num = 0;
+  g.slots = 0;
+  g.nodes = NULL;
+  g.table_slots = 64;
+  g.table = calloc(g.table_slots, sizeof(int));
+  
+  mpc_graph_insert(&g, p);
+  links_num = 0;
+  for (k = 0; k < g.num; k++) {
+    x = g.nodes[k].p;
+    for (j = 0; j < mpc_compile_children(x); j++) {
+      mpc_graph_insert(&g, mpc_graph_child(x, j));
+    }
+    if (x->type == MPC_TYPE_OR || x->type == MPC_TYPE_AND) { links_num += mpc_graph_children(x); }
   }
   
-  if (p->type == MPC_TYPE_STRING) {
-    s = mpcf_escape_new(
-      p->data.string.x,
-      mpc_escape_input_c,
-      mpc_escape_output_c);
-    printf("\"%s\"", s);
-    free(s);
+  prog->code_num = g.num;
+  prog->code = malloc(sizeof(mpc_instr_t) * g.num);
+  prog->links = malloc(sizeof(int) * (links_num ? links_num : 1));
+  
+  links_num = 0;
+  for (k = 0; k < g.num; k++) {
+    
+    x = g.nodes[k].p;
+    c = &prog->code[k];
+    c->type = x->type;
+    c->p = x;
+    c->n = 0;
+    c->x = 0;
+    
+    if (x->type == MPC_TYPE_OR || x->type == MPC_TYPE_AND) {
+      c->n = mpc_graph_children(x);
+      c->x = links_num;
+      for (j = 0; j < c->n; j++) {
+        prog->links[links_num++] = (int)(mpc_graph_find(&g, mpc_graph_child(x, j)) - g.nodes) - k;
+      }
+    } else if (mpc_compile_children(x)) {
+      c->x = (int)(mpc_graph_find(&g, mpc_graph_child(x, 0)) - g.nodes) - k;
+    }
+    
   }
   
-  if (p->type == MPC_TYPE_APPLY)    { mpc_print_unretained(p->data.apply.x, 0); }
-  if (p->type == MPC_TYPE_APPLY_TO) { mpc_print_unretained(p->data.apply_to.x, 0); }
-  if (p->type == MPC_TYPE_PREDICT)  { mpc_print_unretained(p->data.predict.x, 0); }
+  mpc_graph_delete(&g);
+  return prog;
+}
 
-  if (p->type == MPC_TYPE_NOT)   { mpc_print_unretained(p->data.not.x, 0); printf("!"); }
-  if (p->type == MPC_TYPE_MAYBE) { mpc_print_unretained(p->data.not.x, 0); printf("?"); }
+void mpc_program_delete(mpc_program_t *c) {
+  free(c->code);
+  free(c->links);
+  free(c);
+}
 
-  if (p->type == MPC_TYPE_MANY)  { mpc_print_unretained(p->data.repeat.x, 0); printf("*"); }
-  if (p->type == MPC_TYPE_MANY1) { mpc_print_unretained(p->data.repeat.x, 0); printf("+"); }
-  if (p->type == MPC_TYPE_COUNT) { mpc_print_unretained(p->data.repeat.x, 0); printf("{%i}", p->data.repeat.n); }
+#define MPC_CONTINUE(t, y) fs[fn-1].st = t; if (fn == fslots) { fslots *= 2; fs = realloc(fs, sizeof(mpc_program_frame_t) * fslots); } fs[fn].pc = pc + (y); fs[fn].st = 0; fn++; continue
+#define MPC_SUCCESS(x) fn--; mpc_stack_pushr(stk, mpc_result_out(x), 1); continue
+#define MPC_FAILURE(x) fn--; mpc_stack_pushr(stk, mpc_result_err(x), 0); continue
+#define MPC_PRIMATIVE(x, f) if (f) { MPC_SUCCESS(x); } else { MPC_FAILURE(mpc_stack_fail(stk, i, "Incorrect Input")); }
+#define MPC_LINK(k) (prog->links[c->x + (k)])
+
+static void mpc_program_run(mpc_input_t *i, mpc_stack_t *stk, mpc_program_t *prog) {
   
-  if (p->type == MPC_TYPE_OR) {
-    printf("(");
-    for(i = 0; i < p->data.or.n-1; i++) {
-      mpc_print_unretained(p->data.or.xs[i], 0);
-      printf(" | ");
-    }
-    mpc_print_unretained(p->data.or.xs[p->data.or.n-1], 0);
-    printf(")");
-  }
+  /* Stack */
+  int fn = 1, fslots = 64;
+  mpc_program_frame_t *fs = malloc(sizeof(mpc_program_frame_t) * fslots);
+  int pc, st;
+  mpc_instr_t *c;
+  mpc_parser_t *p;
   
-  if (p->type == MPC_TYPE_AND) {
-    printf("(");
-    for(i = 0; i < p->data.and.n-1; i++) {
-      mpc_print_unretained(p->data.and.xs[i], 0);
-      printf(" ");
+  /* Variables */
+  char *s;
+  int n;
+  mpc_result_t r;
+  mpc_memo_t *m;
+  mpc_err_t *e;
+  
+  fs[0].pc = 0;
+  fs[0].st = 0;
+  
+  while (fn) {
+    
+    pc = fs[fn-1].pc;
+    st = fs[fn-1].st;
+    c = &prog->code[pc];
+    p = c->p;
+    
+    switch (c->type) {
+      
+      /* Trivial Parsers */
+      
+      case MPC_TYPE_UNDEFINED: MPC_FAILURE(mpc_stack_fail(stk, i, "Parser Undefined!"));
+      case MPC_TYPE_PASS:      MPC_SUCCESS(NULL);
+      case MPC_TYPE_FAIL:      MPC_FAILURE(mpc_stack_fail(stk, i, p->data.fail.m));
+      case MPC_TYPE_LIFT:      MPC_SUCCESS(p->data.lift.lf());
+      case MPC_TYPE_LIFT_VAL:  MPC_SUCCESS(p->data.lift.x);
+      
+      /* Basic Parsers */
+      
+      case MPC_TYPE_SOI:       MPC_PRIMATIVE(NULL, mpc_input_soi(i));
+      case MPC_TYPE_EOI:       MPC_PRIMATIVE(NULL, mpc_input_eoi(i));
+      case MPC_TYPE_ANY:       MPC_PRIMATIVE(s, mpc_input_any(i, &s));
+      case MPC_TYPE_SINGLE:    MPC_PRIMATIVE(s, mpc_input_char(i, p->data.single.x, &s));
+      case MPC_TYPE_CLASS:
+        if (mpc_input_class(i, p->data.class.x, &s)) { MPC_SUCCESS(s); }
+        if (p->data.class.err == NULL) { MPC_FAILURE(mpc_stack_fail(stk, i, "Incorrect Input")); }
+        MPC_FAILURE(mpc_stack_at(stk, i, p->data.class.err));
+      case MPC_TYPE_SATISFY:   MPC_PRIMATIVE(s, mpc_input_satisfy(i, p->data.satisfy.f, &s));
+      case MPC_TYPE_STRING:    MPC_PRIMATIVE(s, mpc_input_string(i, p->data.string.x, &s));
+      
+      case MPC_TYPE_REGEX:
+        if (mpc_regex_run(i, stk, &p->data.regex, &s, &e) > 0) { MPC_SUCCESS(s); }
+        MPC_FAILURE(e);
+      
+      /* Application Parsers */
+      
+      case MPC_TYPE_EXPECT:
+        if (st == 0) { stk->quiet++; MPC_CONTINUE(1, c->x); }
+        stk->quiet--;
+        if (mpc_stack_popr(stk, &r)) { MPC_SUCCESS(r.output); }
+        mpc_err_delete(r.error);
+        MPC_FAILURE(mpc_stack_expect(stk, i, p->data.expect.m));
+      
+      case MPC_TYPE_APPLY:
+        if (st == 0) { MPC_CONTINUE(1, c->x); }
+        if (mpc_stack_popr(stk, &r)) { MPC_SUCCESS(p->data.apply.f(r.output)); }
+        MPC_FAILURE(r.error);
+      
+      case MPC_TYPE_APPLY_TO:
+        if (st == 0) { MPC_CONTINUE(1, c->x); }
+        if (mpc_stack_popr(stk, &r)) { MPC_SUCCESS(p->data.apply_to.f(r.output, p->data.apply_to.d)); }
+        MPC_FAILURE(r.error);
+      
+      case MPC_TYPE_PREDICT:
+        if (st == 0) { mpc_input_backtrack_disable(i); MPC_CONTINUE(1, c->x); }
+        mpc_input_backtrack_enable(i);
+        fn--;
+        continue;
+      
+      /* Optional Parsers */
+      
+      case MPC_TYPE_NOT:
+        if (st == 0) { mpc_input_mark(i); MPC_CONTINUE(1, c->x); }
+        if (mpc_stack_popr(stk, &r)) {
+          mpc_input_rewind(i);
+          p->data.not.dx(r.output);
+          MPC_FAILURE(mpc_stack_expect(stk, i, "opposite"));
+        }
+        mpc_input_unmark(i);
+        mpc_stack_err(stk, r.error);
+        MPC_SUCCESS(p->data.not.lf());
+      
+      case MPC_TYPE_MAYBE:
+        if (st == 0) { MPC_CONTINUE(1, c->x); }
+        if (mpc_stack_popr(stk, &r)) { MPC_SUCCESS(r.output); }
+        mpc_stack_err(stk, r.error);
+        MPC_SUCCESS(p->data.not.lf());
+      
+      /* Repeat Parsers */
+      
+      case MPC_TYPE_MANY:
+        if (st == 0 && mpc_span_possible(i, p)) {
+          s = mpc_span_scan(i, p, &n);
+          mpc_stack_err(stk, mpc_span_err(i, stk, p));
+          MPC_SUCCESS(s);
+        }
+        if (st == 0 || mpc_stack_peekr(stk, &r)) { MPC_CONTINUE(st+1, c->x); }
+        mpc_stack_popr(stk, &r);
+        mpc_stack_err(stk, r.error);
+        MPC_SUCCESS(mpc_stack_merger_out(stk, st-1, p->data.repeat.f));
+      
+      case MPC_TYPE_MANY1:
+        if (st == 0 && mpc_span_possible(i, p)) {
+          s = mpc_span_scan(i, p, &n);
+          if (n == 0) {
+            free(s);
+            MPC_FAILURE(mpc_err_many1(mpc_span_err(i, stk, p)));
+          }
+          mpc_stack_err(stk, mpc_span_err(i, stk, p));
+          MPC_SUCCESS(s);
+        }
+        if (st == 0 || mpc_stack_peekr(stk, &r)) { MPC_CONTINUE(st+1, c->x); }
+        mpc_stack_popr(stk, &r);
+        if (st == 1) { MPC_FAILURE(mpc_err_many1(r.error)); }
+        mpc_stack_err(stk, r.error);
+        MPC_SUCCESS(mpc_stack_merger_out(stk, st-1, p->data.repeat.f));
+      
+      case MPC_TYPE_COUNT:
+        if (st == 0) { mpc_input_mark(i); MPC_CONTINUE(st+1, c->x); }
+        if (mpc_stack_peekr(stk, &r)) { MPC_CONTINUE(st+1, c->x); }
+        mpc_stack_popr(stk, &r);
+        if (st != (p->data.repeat.n+1)) {
+          mpc_stack_popr_out_single(stk, st-1, p->data.repeat.dx);
+          mpc_input_rewind(i);
+          MPC_FAILURE(mpc_err_count(r.error, p->data.repeat.n));
+        }
+        mpc_stack_err(stk, r.error);
+        mpc_input_unmark(i);
+        MPC_SUCCESS(mpc_stack_merger_out(stk, st-1, p->data.repeat.f));
+      
+      /* Combinatory Parsers */
+      
+      case MPC_TYPE_OR:
+        if (c->n == 0) { MPC_SUCCESS(NULL); }
+        if (st > 0 && mpc_stack_peekr(stk, &r)) {
+          mpc_stack_popr(stk, &r);
+          mpc_stack_popr_err(stk, st-1);
+          MPC_SUCCESS(r.output);
+        }
+        st = mpc_or_skip(i, stk, p, st);
+        if (st < c->n) { MPC_CONTINUE(st+1, MPC_LINK(st)); }
+        MPC_FAILURE(mpc_stack_merger_err(stk, c->n));
+      
+      case MPC_TYPE_AND:
+        if (c->n == 0) { MPC_SUCCESS(p->data.and.f(0, NULL)); }
+        if (st == 0) { mpc_input_mark(i); MPC_CONTINUE(1, MPC_LINK(0)); }
+        if (!mpc_stack_peekr(stk, &r)) {
+          mpc_input_rewind(i);
+          mpc_stack_popr(stk, &r);
+          mpc_stack_popr_out(stk, st-1, p->data.and.dxs);
+          MPC_FAILURE(r.error);
+        }
+        if (st < c->n) { MPC_CONTINUE(st+1, MPC_LINK(st)); }
+        mpc_input_unmark(i);
+        MPC_SUCCESS(mpc_stack_merger_out(stk, c->n, p->data.and.f));
+      
+      /* Memo Parsers */
+      
+      case MPC_TYPE_MEMO:
+        if (st == 0) {
+          m = mpc_stack_memo_find(stk, p, i->state.pos);
+          if (m) {
+            stk->memo_hits++;
+            mpc_input_jump(i, m->state);
+            mpc_stack_err(stk, mpc_err_copy(m->err));
+            if (m->success) { MPC_SUCCESS(p->data.memo.cx(m->result.output)); }
+            MPC_FAILURE(mpc_err_copy(m->result.error));
+          }
+          stk->memo_misses++;
+          mpc_stack_memo_enter(stk, i);
+          MPC_CONTINUE(1, c->x);
+        }
+        mpc_stack_memo_leave(stk, p, i);
+        fn--;
+        continue;
+      
+      default:
+        MPC_FAILURE(mpc_stack_fail(stk, i, "Unknown Parser Type Id!"));
     }
-    mpc_print_unretained(p->data.and.xs[p->data.and.n-1], 0);
-    printf(")");
   }
   
+  free(fs);
 }
 
-void mpc_print(mpc_parser_t *p) {
-  mpc_print_unretained(p, 1);
-  printf("\n");
+#undef MPC_CONTINUE
+#undef MPC_SUCCESS
+#undef MPC_FAILURE
+#undef MPC_PRIMATIVE
+#undef MPC_LINK
+
+int mpc_parse_compiled(const char *filename, const char *string, mpc_program_t *c, mpc_result_t *r) {
+  int x;
+  mpc_input_t *i = mpc_input_new_string(filename, string);
+  mpc_stack_t *stk = mpc_stack_new(i->filename);
+  mpc_program_run(i, stk, c);
+  x = mpc_stack_terminate(stk, r);
+  mpc_input_delete(i);
+  return x;
 }
 
 /*
@@ -2419,6 +6200,8 @@ mpc_ast_t *mpc_ast_new(const char *tag, const char *contents) {
   
   a->children_num = 0;
   a->children = NULL;
+  a->rule = 0;
+  a->rules = 0;
   return a;
   
 }
@@ -2454,6 +6237,25 @@ mpc_ast_t *mpc_ast_add_root(mpc_ast_t *a) {
   return r;
 }
 
+mpc_ast_t *mpc_ast_copy(mpc_ast_t *a) {
+  
+  int i;
+  mpc_ast_t *r;
+  
+  if (a == NULL) { return a; }
+  
+  r = mpc_ast_new(a->tag, a->contents);
+  r->rule = a->rule;
+  r->rules = a->rules;
+  r->children_num = a->children_num;
+  r->children = a->children_num ? malloc(sizeof(mpc_ast_t*) * a->children_num) : NULL;
+  for (i = 0; i < a->children_num; i++) {
+    r->children[i] = mpc_ast_copy(a->children[i]);
+  }
+  
+  return r;
+}
+
 int mpc_ast_eq(mpc_ast_t *a, mpc_ast_t *b) {
   
   int i;
@@ -2491,6 +6293,18 @@ mpc_ast_t *mpc_ast_tag(mpc_ast_t *a, const char *t) {
   return a;
 }
 
+static mpc_ast_t *mpc_ast_add_rule_id(mpc_ast_t *a, int id) {
+  if (id <= 0) { return a; }
+  if (a->rule == 0) { a->rule = id; }
+  if (id <= MPC_AST_RULES_MAX) { a->rules |= 1UL << (id-1); }
+  return a;
+}
+
+mpc_ast_t *mpc_ast_add_rule(mpc_ast_t *a, const char *t, int id) {
+  if (a == NULL) { return a; }
+  return mpc_ast_add_rule_id(mpc_ast_add_tag(a, t), id);
+}
+
 static void mpc_ast_print_depth(mpc_ast_t *a, int d) {
   
   int i;
@@ -2548,81 +6362,641 @@ mpc_val_t *mpcf_fold_ast(int n, mpc_val_t **xs) {
   
   }
   
-  return r;
-}
-
-mpc_val_t *mpcf_str_ast(mpc_val_t *c) {
-  mpc_ast_t *a = mpc_ast_new("", c);
-  free(c);
-  return a;
-}
-
-mpc_parser_t *mpca_tag(mpc_parser_t *a, const char *t) {
-  return mpc_apply_to(a, (mpc_apply_to_t)mpc_ast_tag, (void*)t);
+  return r;
+}
+
+mpc_val_t *mpcf_str_ast(mpc_val_t *c) {
+  mpc_ast_t *a = mpc_ast_new("", c);
+  free(c);
+  return a;
+}
+
+mpc_parser_t *mpca_tag(mpc_parser_t *a, const char *t) {
+  return mpc_apply_to(a, (mpc_apply_to_t)mpc_ast_tag, (void*)t);
+}
+
+mpc_parser_t *mpca_add_tag(mpc_parser_t *a, const char *t) {
+  return mpc_apply_to(a, (mpc_apply_to_t)mpc_ast_add_tag, (void*)t);
+}
+
+/* Tags with the name and id of the rule `r` as it is when parsing */
+static mpc_val_t *mpcaf_add_rule(mpc_val_t *x, void *r) {
+  mpc_parser_t *p = r;
+  return mpc_ast_add_rule(x, p->name, p->id);
+}
+
+mpc_parser_t *mpca_root(mpc_parser_t *a) {
+  return mpc_apply(a, (mpc_apply_t)mpc_ast_add_root);
+}
+
+mpc_parser_t *mpca_not(mpc_parser_t *a) { return mpc_not(a, (mpc_dtor_t)mpc_ast_delete); }
+mpc_parser_t *mpca_maybe(mpc_parser_t *a) { return mpc_maybe(a); }
+mpc_parser_t *mpca_many(mpc_parser_t *a) { return mpc_many(mpcf_fold_ast, a); }
+mpc_parser_t *mpca_many1(mpc_parser_t *a) { return mpc_many1(mpcf_fold_ast, a); }
+mpc_parser_t *mpca_count(int n, mpc_parser_t *a) { return mpc_count(n, mpcf_fold_ast, a, (mpc_dtor_t)mpc_ast_delete); }
+
+mpc_parser_t *mpca_or(int n, ...) {
+
+  int i;
+  va_list va;
+
+  mpc_parser_t *p = mpc_undefined();
+  
+  p->type = MPC_TYPE_OR;
+  p->data.or.n = n;
+  p->data.or.xs = malloc(sizeof(mpc_parser_t*) * n);
+  p->data.or.first = NULL;
+  
+  va_start(va, n);  
+  for (i = 0; i < n; i++) {
+    p->data.or.xs[i] = va_arg(va, mpc_parser_t*);
+  }
+  va_end(va);
+  
+  return p;
+  
+}
+
+mpc_parser_t *mpca_and(int n, ...) {
+  
+  int i;
+  va_list va;
+  
+  mpc_parser_t *p = mpc_undefined();
+  
+  p->type = MPC_TYPE_AND;
+  p->data.and.n = n;
+  p->data.and.f = mpcf_fold_ast;
+  p->data.and.xs = malloc(sizeof(mpc_parser_t*) * n);
+  p->data.and.dxs = malloc(sizeof(mpc_dtor_t) * (n-1));
+  
+  va_start(va, n);
+  for (i = 0; i < n; i++) {
+    p->data.and.xs[i] = va_arg(va, mpc_parser_t*);
+  }
+  for (i = 0; i < (n-1); i++) {
+    p->data.and.dxs[i] = (mpc_dtor_t)mpc_ast_delete;
+  }    
+  va_end(va);
+  
+  return p;  
+}
+
+mpc_parser_t *mpca_total(mpc_parser_t *a) { return mpc_total(a, (mpc_dtor_t)mpc_ast_delete); }
+mpc_parser_t *mpca_memo(mpc_parser_t *a) { return mpc_memo(a, (mpc_copy_t)mpc_ast_copy, (mpc_dtor_t)mpc_ast_delete); }
+
+/*
+** AST Arenas
+**
+** An arena is a chain of blocks which are bumped
+** through as nodes, strings and child arrays are
+** asked for. Clearing it just moves back to the
+** first block, and blocks are only given back
+** when the arena is deleted.
+**
+** Nothing in an arena is freed or grown on its
+** own. Tags are rebuilt into new strings rather
+** than reallocated, a fold counts the children it
+** will have so it makes one array of the right
+** size, and the "" contents of inner nodes are
+** all shared.
+*/
+
+enum { MPC_AST_ARENA_BLOCK = 4096 };
+
+typedef union {
+  void *p;
+  double d;
+  long l;
+} mpc_ast_arena_align_t;
+
+typedef struct mpc_ast_block_t {
+  struct mpc_ast_block_t *next;
+  size_t size;
+  size_t used;
+  mpc_ast_arena_align_t data[1];
+} mpc_ast_block_t;
+
+struct mpc_ast_arena_t {
+  mpc_ast_block_t *first;
+  mpc_ast_block_t *block;
+};
+
+static char mpc_ast_arena_empty[] = "";
+
+mpc_ast_arena_t *mpc_ast_arena_new(void) {
+  mpc_ast_arena_t *a = malloc(sizeof(mpc_ast_arena_t));
+  a->first = NULL;
+  a->block = NULL;
+  return a;
+}
+
+void mpc_ast_arena_clear(mpc_ast_arena_t *a) {
+  a->block = a->first;
+  if (a->block) { a->block->used = 0; }
+}
+
+void mpc_ast_arena_delete(mpc_ast_arena_t *a) {
+  mpc_ast_block_t *b = a->first, *n;
+  while (b) {
+    n = b->next;
+    free(b);
+    b = n;
+  }
+  free(a);
+}
+
+static void *mpc_ast_arena_alloc(mpc_ast_arena_t *a, size_t n) {
+  
+  mpc_ast_block_t *b = a->block, *x;
+  size_t size;
+  
+  n = (n + sizeof(mpc_ast_arena_align_t) - 1) / sizeof(mpc_ast_arena_align_t) * sizeof(mpc_ast_arena_align_t);
+  
+  if (b && b->used + n <= b->size) {
+    b->used += n;
+    return (char*)b->data + b->used - n;
+  }
+  
+  /* Blocks left over from before the last clear are used again */
+  if (b && b->next && n <= b->next->size) {
+    x = b->next;
+  } else {
+    size = b ? b->size * 2 : MPC_AST_ARENA_BLOCK;
+    if (size < n) { size = n; }
+    x = malloc(sizeof(mpc_ast_block_t) + size);
+    x->size = size;
+    x->next = b ? b->next : NULL;
+    if (b) { b->next = x; } else { a->first = x; }
+  }
+  
+  x->used = n;
+  a->block = x;
+  return x->data;
+}
+
+static char *mpc_ast_arena_str(mpc_ast_arena_t *a, const char *x) {
+  size_t n = strlen(x) + 1;
+  char *r;
+  if (n == 1) { return mpc_ast_arena_empty; }
+  r = mpc_ast_arena_alloc(a, n);
+  memcpy(r, x, n);
+  return r;
+}
+
+static mpc_ast_t *mpc_ast_arena_node(mpc_ast_arena_t *a, const char *tag, const char *contents) {
+  mpc_ast_t *r = mpc_ast_arena_alloc(a, sizeof(mpc_ast_t));
+  r->tag = mpc_ast_arena_str(a, tag);
+  r->contents = mpc_ast_arena_str(a, contents);
+  r->children_num = 0;
+  r->children = NULL;
+  r->rule = 0;
+  r->rules = 0;
+  return r;
+}
+
+static mpc_ast_t *mpc_ast_arena_add_root(mpc_ast_arena_t *a, mpc_ast_t *x) {
+  mpc_ast_t *r;
+  if (x == NULL || x->children_num <= 1) { return x; }
+  r = mpc_ast_arena_node(a, ">", "");
+  r->children_num = 1;
+  r->children = mpc_ast_arena_alloc(a, sizeof(mpc_ast_t*));
+  r->children[0] = x;
+  return r;
+}
+
+static mpc_ast_t *mpc_ast_arena_tag(mpc_ast_arena_t *a, mpc_ast_t *x, const char *t) {
+  x->tag = mpc_ast_arena_str(a, t);
+  return x;
+}
+
+static mpc_ast_t *mpc_ast_arena_add_tag(mpc_ast_arena_t *a, mpc_ast_t *x, const char *t) {
+  size_t n, m;
+  char *tag;
+  if (x == NULL) { return x; }
+  n = strlen(t);
+  m = strlen(x->tag);
+  tag = mpc_ast_arena_alloc(a, n + 1 + m + 1);
+  memcpy(tag, t, n);
+  tag[n] = '|';
+  memcpy(tag + n + 1, x->tag, m + 1);
+  x->tag = tag;
+  return x;
+}
+
+/* Strings in an arena are never changed in place so a copy shares them */
+static mpc_ast_t *mpc_ast_arena_copy(mpc_ast_arena_t *a, mpc_ast_t *x) {
+  
+  int i;
+  mpc_ast_t *r;
+  
+  if (x == NULL) { return x; }
+  
+  r = mpc_ast_arena_alloc(a, sizeof(mpc_ast_t));
+  *r = *x;
+  if (x->children_num) {
+    r->children = mpc_ast_arena_alloc(a, sizeof(mpc_ast_t*) * x->children_num);
+    for (i = 0; i < x->children_num; i++) {
+      r->children[i] = mpc_ast_arena_copy(a, x->children[i]);
+    }
+  }
+  
+  return r;
+}
+
+/* Gives the same tree as `mpcf_fold_ast`, or `mpc_optimise_fold` when `seq` is set */
+static mpc_val_t *mpc_ast_arena_fold(mpc_ast_arena_t *a, int n, mpc_val_t **xs, int seq) {
+  
+  int i, j, k = 0;
+  mpc_ast_t **as = (mpc_ast_t**)xs;
+  mpc_ast_t *r;
+  
+  if (seq) {
+    for (i = 0, j = 0; i < n; i++) { if (xs[i]) { j = i; k++; } }
+    if (k == 0) { return NULL; }
+    if (k == 1) { return xs[j]; }
+  }
+  
+  if (n == 0) { return NULL; }
+  if (n == 1) { return xs[0]; }
+  if (n == 2 && xs[1] == NULL) { return xs[0]; }
+  if (n == 2 && xs[0] == NULL) { return xs[1]; }
+  
+  r = mpc_ast_arena_node(a, ">", "");
+  
+  for (i = 0; i < n; i++) {
+    if (as[i] == NULL) { continue; }
+    r->children_num += as[i]->children_num > 0 ? as[i]->children_num : 1;
+  }
+  
+  if (r->children_num == 0) { return r; }
+  
+  r->children = mpc_ast_arena_alloc(a, sizeof(mpc_ast_t*) * r->children_num);
+  
+  for (i = 0, k = 0; i < n; i++) {
+    if (as[i] == NULL) { continue; }
+    if (as[i]->children_num > 0) {
+      for (j = 0; j < as[i]->children_num; j++) {
+        r->children[k++] = as[i]->children[j];
+      }
+    } else {
+      r->children[k++] = as[i];
+    }
+  }
+  
+  return r;
+}
+
+/*
+** Flat ASTs
+**
+** The table a flat AST is built in only ever grows.
+** Nodes which end up outside the final tree, from
+** alternatives that failed or from folds which took
+** their children, are left where they are. When the
+** parse ends the tree is copied out of the table in
+** preorder, and each distinct tag is copied once.
+*/
+
+static mpc_val_t *mpc_flat_val(int k) { return (mpc_val_t*)(size_t)(k + 1); }
+static int mpc_flat_index(mpc_val_t *x) { return (int)(size_t)x - 1; }
+
+static void mpc_flat_build_reset(mpc_flat_build_t *b) {
+  b->nodes_num = 0;
+  b->starts_num = 0;
+  if (b->strings_slots == 0) {
+    b->strings_slots = 256;
+    b->strings = malloc(b->strings_slots);
+  }
+  /* Offset 0 is the empty string */
+  b->strings[0] = '\0';
+  b->strings_num = 1;
+}
+
+/* With `x` NULL room is made for `n` characters without copying any */
+static long mpc_flat_build_string(mpc_flat_build_t *b, const char *x, long n) {
+  long r = b->strings_num;
+  if (n == 0) { return 0; }
+  while (b->strings_num + n + 1 > b->strings_slots) {
+    b->strings_slots = b->strings_slots * 2;
+    b->strings = realloc(b->strings, b->strings_slots);
+  }
+  if (x) { memcpy(b->strings + r, x, n); }
+  b->strings[r + n] = '\0';
+  b->strings_num += n + 1;
+  return r;
+}
+
+static int mpc_flat_build_node(mpc_flat_build_t *b) {
+  
+  mpc_flat_node_t *x;
+  
+  if (b->nodes_num == b->nodes_slots) {
+    b->nodes_slots = b->nodes_slots * 2 + 64;
+    b->nodes = realloc(b->nodes, sizeof(mpc_flat_node_t) * b->nodes_slots);
+  }
+  
+  x = &b->nodes[b->nodes_num];
+  x->tag = 0;
+  x->contents = 0;
+  x->rule = 0;
+  x->rules = 0;
+  x->start = 0;
+  x->length = 0;
+  x->first = -1;
+  x->last = -1;
+  x->next = -1;
+  x->children_num = 0;
+  return b->nodes_num++;
+}
+
+static void mpc_flat_build_link(mpc_flat_build_t *b, int r, int k) {
+  mpc_flat_node_t *x = &b->nodes[r];
+  if (x->first == -1) { x->first = k; } else { b->nodes[x->last].next = k; }
+  x->last = k;
+  x->children_num++;
+  b->nodes[k].next = -1;
+}
+
+static mpc_val_t *mpc_flat_build_leaf(mpc_flat_build_t *b, const char *x, long start) {
+  long n = strlen(x);
+  int k = mpc_flat_build_node(b);
+  b->nodes[k].contents = mpc_flat_build_string(b, x, n);
+  b->nodes[k].start = start;
+  b->nodes[k].length = n;
+  return mpc_flat_val(k);
+}
+
+static mpc_val_t *mpc_flat_build_add_root(mpc_flat_build_t *b, mpc_val_t *x) {
+  int k, r;
+  if (x == NULL) { return x; }
+  k = mpc_flat_index(x);
+  if (b->nodes[k].children_num <= 1) { return x; }
+  r = mpc_flat_build_node(b);
+  b->nodes[r].tag = mpc_flat_build_string(b, ">", 1);
+  b->nodes[r].start = b->nodes[k].start;
+  b->nodes[r].length = b->nodes[k].length;
+  mpc_flat_build_link(b, r, k);
+  return mpc_flat_val(r);
+}
+
+static mpc_val_t *mpc_flat_build_tag(mpc_flat_build_t *b, mpc_val_t *x, const char *t, int add, int id) {
+  
+  int k;
+  long n, m, tag;
+  
+  if (x == NULL) { return x; }
+  k = mpc_flat_index(x);
+  n = strlen(t);
+  
+  if (!add) {
+    b->nodes[k].tag = mpc_flat_build_string(b, t, n);
+    return x;
+  }
+  
+  /* Made in place at the end of the strings, which may move as they grow */
+  m = strlen(b->strings + b->nodes[k].tag);
+  tag = mpc_flat_build_string(b, NULL, n + 1 + m);
+  b->strings[tag + n] = '|';
+  memcpy(b->strings + tag + n + 1, b->strings + b->nodes[k].tag, m);
+  memcpy(b->strings + tag, t, n);
+  b->nodes[k].tag = tag;
+  
+  if (id > 0) {
+    if (b->nodes[k].rule == 0) { b->nodes[k].rule = id; }
+    if (id <= MPC_AST_RULES_MAX) { b->nodes[k].rules |= 1UL << (id-1); }
+  }
+  
+  return x;
+}
+
+static mpc_val_t *mpc_flat_build_copy(mpc_flat_build_t *b, mpc_val_t *x) {
+  
+  int k, r, c;
+  
+  if (x == NULL) { return x; }
+  
+  k = mpc_flat_index(x);
+  r = mpc_flat_build_node(b);
+  b->nodes[r] = b->nodes[k];
+  b->nodes[r].first = -1;
+  b->nodes[r].last = -1;
+  b->nodes[r].next = -1;
+  b->nodes[r].children_num = 0;
+  
+  for (c = b->nodes[k].first; c != -1; c = b->nodes[c].next) {
+    mpc_flat_build_link(b, r, mpc_flat_index(mpc_flat_build_copy(b, mpc_flat_val(c))));
+  }
+  
+  return mpc_flat_val(r);
+}
+
+/* Gives the same tree as `mpcf_fold_ast`, or `mpc_optimise_fold` when `seq` is set */
+static mpc_val_t *mpc_flat_build_fold(mpc_flat_build_t *b, int n, mpc_val_t **xs, int seq) {
+  
+  int i, j = 0, k = 0, r, c, next;
+  mpc_flat_node_t *x;
+  
+  if (seq) {
+    for (i = 0; i < n; i++) { if (xs[i]) { j = i; k++; } }
+    if (k == 0) { return NULL; }
+    if (k == 1) { return xs[j]; }
+  }
+  
+  if (n == 0) { return NULL; }
+  if (n == 1) { return xs[0]; }
+  if (n == 2 && xs[1] == NULL) { return xs[0]; }
+  if (n == 2 && xs[0] == NULL) { return xs[1]; }
+  
+  r = mpc_flat_build_node(b);
+  b->nodes[r].tag = mpc_flat_build_string(b, ">", 1);
+  
+  for (i = 0; i < n; i++) {
+    if (xs[i] == NULL) { continue; }
+    k = mpc_flat_index(xs[i]);
+    if (b->nodes[k].children_num == 0) {
+      mpc_flat_build_link(b, r, k);
+      continue;
+    }
+    for (c = b->nodes[k].first; c != -1; c = next) {
+      next = b->nodes[c].next;
+      mpc_flat_build_link(b, r, c);
+    }
+  }
+  
+  x = &b->nodes[r];
+  if (x->children_num > 0) {
+    x->start = b->nodes[x->first].start;
+    x->length = b->nodes[x->last].start + b->nodes[x->last].length - x->start;
+  }
+  
+  return mpc_flat_val(r);
 }
 
-mpc_parser_t *mpca_add_tag(mpc_parser_t *a, const char *t) {
-  return mpc_apply_to(a, (mpc_apply_to_t)mpc_ast_add_tag, (void*)t);
+typedef struct {
+  int num;
+  int slots;
+  long *offsets;
+  long strings_slots;
+} mpc_flat_tags_t;
+
+static unsigned long mpc_flat_hash(const char *x) {
+  unsigned long h = 5381;
+  while (*x) { h = h * 33 + (unsigned char)*x++; }
+  return h;
+}
+
+static long mpc_flat_string(mpc_flat_t *f, mpc_flat_tags_t *t, const char *x) {
+  long n = strlen(x), r = f->strings_num;
+  if (n == 0) { return 0; }
+  while (r + n + 1 > t->strings_slots) {
+    t->strings_slots *= 2;
+    f->strings = realloc(f->strings, t->strings_slots);
+  }
+  memcpy(f->strings + r, x, n + 1);
+  f->strings_num += n + 1;
+  return r;
 }
 
-mpc_parser_t *mpca_root(mpc_parser_t *a) {
-  return mpc_apply(a, (mpc_apply_t)mpc_ast_add_root);
+/* The table of tags is kept at most half full */
+static void mpc_flat_tags_grow(mpc_flat_t *f, mpc_flat_tags_t *t) {
+  
+  int i, j, slots = t->slots;
+  long *offsets = t->offsets;
+  
+  t->slots = t->slots * 2;
+  t->offsets = calloc(t->slots, sizeof(long));
+  
+  for (j = 0; j < slots; j++) {
+    if (offsets[j] == 0) { continue; }
+    i = mpc_flat_hash(f->strings + offsets[j]) & (t->slots-1);
+    while (t->offsets[i]) { i = (i+1) & (t->slots-1); }
+    t->offsets[i] = offsets[j];
+  }
+  
+  free(offsets);
 }
 
-mpc_parser_t *mpca_not(mpc_parser_t *a) { return mpc_not(a, (mpc_dtor_t)mpc_ast_delete); }
-mpc_parser_t *mpca_maybe(mpc_parser_t *a) { return mpc_maybe(a); }
-mpc_parser_t *mpca_many(mpc_parser_t *a) { return mpc_many(mpcf_fold_ast, a); }
-mpc_parser_t *mpca_many1(mpc_parser_t *a) { return mpc_many1(mpcf_fold_ast, a); }
-mpc_parser_t *mpca_count(int n, mpc_parser_t *a) { return mpc_count(n, mpcf_fold_ast, a, (mpc_dtor_t)mpc_ast_delete); }
-
-mpc_parser_t *mpca_or(int n, ...) {
-
+static long mpc_flat_intern(mpc_flat_t *f, mpc_flat_tags_t *t, const char *x) {
+  
   int i;
-  va_list va;
-
-  mpc_parser_t *p = mpc_undefined();
   
-  p->type = MPC_TYPE_OR;
-  p->data.or.n = n;
-  p->data.or.xs = malloc(sizeof(mpc_parser_t*) * n);
+  if (*x == '\0') { return 0; }
+  if ((t->num + 1) * 2 > t->slots) { mpc_flat_tags_grow(f, t); }
   
-  va_start(va, n);  
-  for (i = 0; i < n; i++) {
-    p->data.or.xs[i] = va_arg(va, mpc_parser_t*);
+  i = mpc_flat_hash(x) & (t->slots-1);
+  while (t->offsets[i]) {
+    if (strcmp(f->strings + t->offsets[i], x) == 0) { return t->offsets[i]; }
+    i = (i+1) & (t->slots-1);
   }
-  va_end(va);
-  
-  return p;
   
+  t->num++;
+  t->offsets[i] = mpc_flat_string(f, t, x);
+  return t->offsets[i];
 }
 
-mpc_parser_t *mpca_and(int n, ...) {
+static int mpc_flat_count(mpc_flat_build_t *b, int k) {
+  int c, n = 1;
+  for (c = b->nodes[k].first; c != -1; c = b->nodes[c].next) { n += mpc_flat_count(b, c); }
+  return n;
+}
+
+static int mpc_flat_place(mpc_flat_t *f, mpc_flat_tags_t *t, mpc_flat_build_t *b, int k) {
   
-  int i;
-  va_list va;
+  int c, m, prev = -1;
+  int n = f->nodes_num++;
+  mpc_flat_node_t *x = &b->nodes[k];
   
-  mpc_parser_t *p = mpc_undefined();
+  f->first[n] = -1;
+  f->next[n] = -1;
+  f->children_num[n] = x->children_num;
+  f->rule[n] = x->rule;
+  f->rules[n] = x->rules;
+  f->tag[n] = mpc_flat_intern(f, t, b->strings + x->tag);
+  f->contents[n] = mpc_flat_string(f, t, b->strings + x->contents);
+  f->start[n] = x->start;
+  f->length[n] = x->length;
   
-  p->type = MPC_TYPE_AND;
-  p->data.and.n = n;
-  p->data.and.f = mpcf_fold_ast;
-  p->data.and.xs = malloc(sizeof(mpc_parser_t*) * n);
-  p->data.and.dxs = malloc(sizeof(mpc_dtor_t) * (n-1));
+  for (c = x->first; c != -1; c = b->nodes[c].next) {
+    m = mpc_flat_place(f, t, b, c);
+    if (prev == -1) { f->first[n] = m; } else { f->next[prev] = m; }
+    prev = m;
+  }
   
-  va_start(va, n);
-  for (i = 0; i < n; i++) {
-    p->data.and.xs[i] = va_arg(va, mpc_parser_t*);
+  return n;
+}
+
+static mpc_flat_t *mpc_flat_build_finish(mpc_flat_build_t *b, mpc_val_t *x) {
+  
+  int n = x ? mpc_flat_count(b, mpc_flat_index(x)) : 0;
+  mpc_flat_t *f = malloc(sizeof(mpc_flat_t));
+  mpc_flat_tags_t t;
+  
+  f->nodes_num = 0;
+  f->first = malloc(sizeof(int) * n);
+  f->next = malloc(sizeof(int) * n);
+  f->children_num = malloc(sizeof(int) * n);
+  f->rule = malloc(sizeof(int) * n);
+  f->rules = malloc(sizeof(unsigned long) * n);
+  f->tag = malloc(sizeof(long) * n);
+  f->contents = malloc(sizeof(long) * n);
+  f->start = malloc(sizeof(long) * n);
+  f->length = malloc(sizeof(long) * n);
+  
+  t.num = 0;
+  t.slots = 64;
+  t.offsets = calloc(t.slots, sizeof(long));
+  t.strings_slots = 256;
+  f->strings = malloc(t.strings_slots);
+  f->strings[0] = '\0';
+  f->strings_num = 1;
+  
+  if (x) { mpc_flat_place(f, &t, b, mpc_flat_index(x)); }
+  
+  free(t.offsets);
+  f->strings = realloc(f->strings, f->strings_num);
+  return f;
+}
+
+void mpc_flat_delete(mpc_flat_t *f) {
+  if (f == NULL) { return; }
+  free(f->first);
+  free(f->next);
+  free(f->children_num);
+  free(f->rule);
+  free(f->rules);
+  free(f->tag);
+  free(f->contents);
+  free(f->start);
+  free(f->length);
+  free(f->strings);
+  free(f);
+}
+
+int mpc_flat_first(mpc_flat_t *f, int n) { return f->first[n]; }
+int mpc_flat_next(mpc_flat_t *f, int n) { return f->next[n]; }
+const char *mpc_flat_tag(mpc_flat_t *f, int n) { return f->strings + f->tag[n]; }
+const char *mpc_flat_contents(mpc_flat_t *f, int n) { return f->strings + f->contents[n]; }
+
+mpc_ast_t *mpc_flat_ast(mpc_flat_t *f, int n) {
+  
+  int c, i = 0;
+  mpc_ast_t *a;
+  
+  if (n < 0 || n >= f->nodes_num) { return NULL; }
+  
+  a = mpc_ast_new(mpc_flat_tag(f, n), mpc_flat_contents(f, n));
+  a->rule = f->rule[n];
+  a->rules = f->rules[n];
+  a->children_num = f->children_num[n];
+  a->children = a->children_num ? malloc(sizeof(mpc_ast_t*) * a->children_num) : NULL;
+  for (c = f->first[n]; c != -1; c = f->next[c]) {
+    a->children[i++] = mpc_flat_ast(f, c);
   }
-  for (i = 0; i < (n-1); i++) {
-    p->data.and.dxs[i] = (mpc_dtor_t)mpc_ast_delete;
-  }    
-  va_end(va);
   
-  return p;  
+  return a;
 }
 
-mpc_parser_t *mpca_total(mpc_parser_t *a) { return mpc_total(a, (mpc_dtor_t)mpc_ast_delete); }
-
 /*
 ** Grammar Parser
 */
@@ -2741,6 +7115,10 @@ static mpc_parser_t *mpca_grammar_find_parser(char *x, mpca_grammar_st_t *st) {
 
     i = strtol(x, NULL, 10);
     
+    if (st->va == NULL) {
+      return mpc_failf("No Parser in position %i! No Parsers supplied!", i);
+    }
+    
     while (st->parsers_num <= i) {
       st->parsers_num++;
       st->parsers = realloc(st->parsers, sizeof(mpc_parser_t*) * st->parsers_num);
@@ -2748,6 +7126,7 @@ static mpc_parser_t *mpca_grammar_find_parser(char *x, mpca_grammar_st_t *st) {
       if (st->parsers[st->parsers_num-1] == NULL) {
         return mpc_failf("No Parser in position %i! Only supplied %i Parsers!", i, st->parsers_num);
       }
+      st->parsers[st->parsers_num-1]->id = st->parsers_num;
     }
     
     return st->parsers[st->parsers_num-1];
@@ -2761,6 +7140,14 @@ static mpc_parser_t *mpca_grammar_find_parser(char *x, mpca_grammar_st_t *st) {
       if (p->name && strcmp(p->name, x) == 0) { return p; }
     }
     
+    /* Without supplied Parsers make a new one */
+    if (st->va == NULL) {
+      st->parsers_num++;
+      st->parsers = realloc(st->parsers, sizeof(mpc_parser_t*) * st->parsers_num);
+      st->parsers[st->parsers_num-1] = mpc_new(x);
+      return st->parsers[st->parsers_num-1];
+    }
+    
     /* Search New Parsers */
     while (1) {
     
@@ -2774,6 +7161,8 @@ static mpc_parser_t *mpca_grammar_find_parser(char *x, mpca_grammar_st_t *st) {
         return mpc_failf("Unknown Parser '%s'!", x);
       }
       
+      p->id = st->parsers_num;
+      
       if (p->name && strcmp(p->name, x) == 0) { return p; }
       
     }
@@ -2789,7 +7178,7 @@ static mpc_val_t *mpcaf_grammar_id(mpc_val_t *x, void *s) {
   free(x);
 
   if (p->name) {
-    return mpca_root(mpca_add_tag(p, p->name));
+    return mpca_root(mpc_apply_to(p, mpcaf_add_rule, p));
   } else {
     return mpca_root(p);
   }
@@ -2925,12 +7314,16 @@ static mpc_val_t *mpca_stmt_list_apply_to(mpc_val_t *x, void *s) {
   mpca_stmt_t *stmt;
   mpca_stmt_t **stmts = x;
   mpc_parser_t *left;
+  int id = 0;
 
   while(*stmts) {
     stmt = *stmts;
     left = mpca_grammar_find_parser(stmt->ident, st);
+    /* Without supplied parsers rules are numbered as they are defined */
+    if (st->va == NULL) { left->id = ++id; }
     if (st->flags & MPC_LANG_PREDICTIVE) { stmt->grammar = mpc_predictive(stmt->grammar); }
     if (stmt->name) { stmt->grammar = mpc_expect(stmt->grammar, stmt->name); }
+    if (st->flags & MPC_LANG_PACKRAT) { stmt->grammar = mpca_memo(stmt->grammar); }
     mpc_define(left, stmt->grammar);
     free(stmt->ident);
     free(stmt->name);
@@ -2939,6 +7332,9 @@ static mpc_val_t *mpca_stmt_list_apply_to(mpc_val_t *x, void *s) {
   }
   free(x);
   
+  mpc_optimise_all(st->parsers_num, st->parsers);
+  mpc_analyse_all(st->parsers_num, st->parsers);
+  
   return NULL;
 }
 
@@ -3018,9 +7414,9 @@ mpc_err_t *mpca_lang_file(int flags, FILE *f, ...) {
   st.parsers = NULL;
   st.flags = flags;
   
-  i = mpc_input_new_file("<mpca_lang_file>", f);
+  i = mpc_input_new_file_or_mmap("<mpca_lang_file>", f);
   err = mpca_lang_st(i, &st);
-  mpc_input_delete(i);
+  mpc_input_delete_file_or_mmap(i);
   
   free(st.parsers);
   va_end(va);
@@ -3093,9 +7489,9 @@ mpc_err_t *mpca_lang_contents(int flags, const char *filename, ...) {
   st.parsers = NULL;
   st.flags = flags;
   
-  i = mpc_input_new_file(filename, f);
+  i = mpc_input_new_file_or_mmap(filename, f);
   err = mpca_lang_st(i, &st);
-  mpc_input_delete(i);
+  mpc_input_delete_file_or_mmap(i);
   
   free(st.parsers);
   va_end(va);  
@@ -3104,3 +7500,568 @@ mpc_err_t *mpca_lang_contents(int flags, const char *filename, ...) {
   
   return err;
 }
+
+/*
+** Code Generation
+**
+** `mpca_generate` reads a language just like
+** `mpca_lang` but instead of building it writes
+** out C source for a parser of each rule, called
+** `<prefix>_parse_<rule>`. Every parser in the
+** optimised graph becomes a function that calls
+** its children directly, so nothing is built or
+** dispatched at run time and the output for any
+** input is the same AST `mpca_lang` would give.
+**
+** Errors just record the furthest position that
+** was reached and what was expected there, so a
+** message may name fewer alternatives than the
+** one `mpca_lang` would give.
+*/
+
+typedef void(*mpc_generate_fn_t)(void);
+
+typedef struct {
+  mpc_generate_fn_t f;
+  const char *name;
+} mpc_generate_name_t;
+
+static const char *mpc_generate_name(mpc_generate_fn_t f) {
+  
+  static const mpc_generate_name_t names[] = {
+    { (mpc_generate_fn_t)free,               "free" },
+    { (mpc_generate_fn_t)mpcf_dtor_null,     "mpcf_dtor_null" },
+    { (mpc_generate_fn_t)mpc_ast_delete,     "mpc_ast_delete" },
+    { (mpc_generate_fn_t)mpcf_ctor_null,     "mpcf_ctor_null" },
+    { (mpc_generate_fn_t)mpcf_ctor_str,      "mpcf_ctor_str" },
+    { (mpc_generate_fn_t)mpcf_free,          "mpcf_free" },
+    { (mpc_generate_fn_t)mpcf_int,           "mpcf_int" },
+    { (mpc_generate_fn_t)mpcf_hex,           "mpcf_hex" },
+    { (mpc_generate_fn_t)mpcf_oct,           "mpcf_oct" },
+    { (mpc_generate_fn_t)mpcf_float,         "mpcf_float" },
+    { (mpc_generate_fn_t)mpcf_escape,        "mpcf_escape" },
+    { (mpc_generate_fn_t)mpcf_unescape,      "mpcf_unescape" },
+    { (mpc_generate_fn_t)mpcf_unescape_regex, "mpcf_unescape_regex" },
+    { (mpc_generate_fn_t)mpcf_str_ast,       "mpcf_str_ast" },
+    { (mpc_generate_fn_t)mpc_ast_add_root,   "mpc_ast_add_root" },
+    { (mpc_generate_fn_t)mpc_ast_tag,        "mpc_ast_tag" },
+    { (mpc_generate_fn_t)mpc_ast_add_tag,    "mpc_ast_add_tag" },
+    { (mpc_generate_fn_t)mpcf_null,          "mpcf_null" },
+    { (mpc_generate_fn_t)mpcf_fst,           "mpcf_fst" },
+    { (mpc_generate_fn_t)mpcf_snd,           "mpcf_snd" },
+    { (mpc_generate_fn_t)mpcf_trd,           "mpcf_trd" },
+    { (mpc_generate_fn_t)mpcf_fst_free,      "mpcf_fst_free" },
+    { (mpc_generate_fn_t)mpcf_snd_free,      "mpcf_snd_free" },
+    { (mpc_generate_fn_t)mpcf_trd_free,      "mpcf_trd_free" },
+    { (mpc_generate_fn_t)mpcf_strfold,       "mpcf_strfold" },
+    { (mpc_generate_fn_t)mpcf_maths,         "mpcf_maths" },
+    { (mpc_generate_fn_t)mpcf_fold_ast,      "mpcf_fold_ast" },
+    { (mpc_generate_fn_t)mpc_optimise_fold,  "$_fold_seq" },
+    { NULL, NULL }
+  };
+  
+  int i;
+  for (i = 0; names[i].name; i++) {
+    if (names[i].f == f) { return names[i].name; }
+  }
+  return NULL;
+}
+
+/* Writes `text` with each `$` replaced by `prefix` */
+static void mpc_generate_text(FILE *f, const char *prefix, const char *text) {
+  for (; *text; text++) {
+    if (*text == '$') { fputs(prefix, f); } else { fputc(*text, f); }
+  }
+}
+
+static void mpc_generate_string(FILE *f, const char *s) {
+  fputc('"', f);
+  for (; *s; s++) {
+    if (*s >= 32 && *s < 127 && *s != '"' && *s != '\\' && *s != '?') {
+      fputc(*s, f);
+    } else {
+      fprintf(f, "\\%03o", (unsigned char)*s);
+    }
+  }
+  fputc('"', f);
+}
+
+static void mpc_generate_call(FILE *f, const char *prefix, mpc_generate_fn_t fn) {
+  mpc_generate_text(f, prefix, mpc_generate_name(fn));
+}
+
+static int mpc_generate_supported(mpc_parser_t *p) {
+  
+  int i;
+  
+  switch (p->type) {
+    case MPC_TYPE_SATISFY:  return 0;
+    case MPC_TYPE_LIFT:     return mpc_generate_name((mpc_generate_fn_t)p->data.lift.lf) != NULL;
+    case MPC_TYPE_LIFT_VAL: return p->data.lift.x == NULL;
+    case MPC_TYPE_APPLY:    return mpc_generate_name((mpc_generate_fn_t)p->data.apply.f) != NULL;
+    case MPC_TYPE_APPLY_TO:
+      /* Only tags are known to take a string */
+      return p->data.apply_to.f == (mpc_apply_to_t)mpc_ast_tag
+          || p->data.apply_to.f == (mpc_apply_to_t)mpc_ast_add_tag
+          || p->data.apply_to.f == mpcaf_add_rule;
+    case MPC_TYPE_NOT:
+    case MPC_TYPE_MAYBE:
+      return mpc_generate_name((mpc_generate_fn_t)p->data.not.lf) != NULL
+        && (p->type == MPC_TYPE_MAYBE || mpc_generate_name((mpc_generate_fn_t)p->data.not.dx) != NULL);
+    case MPC_TYPE_MANY:
+    case MPC_TYPE_MANY1:    return mpc_generate_name((mpc_generate_fn_t)p->data.repeat.f) != NULL;
+    case MPC_TYPE_COUNT:
+      return mpc_generate_name((mpc_generate_fn_t)p->data.repeat.f) != NULL
+        && mpc_generate_name((mpc_generate_fn_t)p->data.repeat.dx) != NULL;
+    case MPC_TYPE_AND:
+      if (mpc_generate_name((mpc_generate_fn_t)p->data.and.f) == NULL) { return 0; }
+      for (i = 0; i < p->data.and.n-1; i++) {
+        if (mpc_generate_name((mpc_generate_fn_t)p->data.and.dxs[i]) == NULL) { return 0; }
+      }
+      return 1;
+    default: return 1;
+  }
+}
+
+static const char *mpc_generate_prelude[] = {
+  "/* Generated by mpca_generate. Do not edit. */\n",
+  "\n",
+  "#include \"mpc.h\"\n",
+  "\n",
+  "typedef struct {\n",
+  "  const char *filename;\n",
+  "  const char *string;\n",
+  "  mpc_state_t state;\n",
+  "  int backtrack;\n",
+  "  int quiet;\n",
+  "  mpc_state_t err_state;\n",
+  "  int err_num;\n",
+  "  const char *err_expected[32];\n",
+  "  const char *err_failure;\n",
+  "} $_input_t;\n",
+  "\n",
+  "static void $_err($_input_t *i, const char *x, int failure) {\n",
+  "  int k;\n",
+  "  if (i->quiet || i->state.pos < i->err_state.pos) { return; }\n",
+  "  if (i->state.pos > i->err_state.pos) {\n",
+  "    i->err_state = i->state;\n",
+  "    i->err_state.next = i->string[i->state.pos];\n",
+  "    i->err_num = 0;\n",
+  "    i->err_failure = NULL;\n",
+  "  }\n",
+  "  if (failure) { if (!i->err_failure) { i->err_failure = x; } return; }\n",
+  "  for (k = 0; k < i->err_num; k++) {\n",
+  "    if (strcmp(i->err_expected[k], x) == 0) { return; }\n",
+  "  }\n",
+  "  if (i->err_num < 32) { i->err_expected[i->err_num++] = x; }\n",
+  "}\n",
+  "\n",
+  "static int $_finish($_input_t *i, int ok, mpc_val_t *x, mpc_result_t *r) {\n",
+  "  int k;\n",
+  "  const char *failure = i->err_failure;\n",
+  "  mpc_err_t *e;\n",
+  "  if (ok) { r->output = x; return 1; }\n",
+  "  if (i->err_num == 0 && !failure) { failure = \"Unknown Error\"; }\n",
+  "  e = malloc(sizeof(mpc_err_t));\n",
+  "  e->state = i->err_state;\n",
+  "  e->filename = malloc(strlen(i->filename) + 1);\n",
+  "  strcpy(e->filename, i->filename);\n",
+  "  e->failure = NULL;\n",
+  "  e->expected_num = 0;\n",
+  "  e->expected = malloc(sizeof(char*) * (i->err_num + 1));\n",
+  "  if (failure) {\n",
+  "    e->failure = malloc(strlen(failure) + 1);\n",
+  "    strcpy(e->failure, failure);\n",
+  "  } else {\n",
+  "    for (k = 0; k < i->err_num; k++) {\n",
+  "      e->expected[k] = malloc(strlen(i->err_expected[k]) + 1);\n",
+  "      strcpy(e->expected[k], i->err_expected[k]);\n",
+  "    }\n",
+  "    e->expected_num = i->err_num;\n",
+  "  }\n",
+  "  r->error = e;\n",
+  "  return 0;\n",
+  "}\n",
+  "\n",
+  "static void $_init($_input_t *i, const char *filename, const char *string) {\n",
+  "  i->filename = filename;\n",
+  "  i->string = string;\n",
+  "  i->state.pos = 0;\n",
+  "  i->state.row = 0;\n",
+  "  i->state.col = 0;\n",
+  "  i->state.next = '\\0';\n",
+  "  i->backtrack = 1;\n",
+  "  i->quiet = 0;\n",
+  "  i->err_state.pos = -1;\n",
+  "  i->err_state.row = -1;\n",
+  "  i->err_state.col = -1;\n",
+  "  i->err_state.next = '\\0';\n",
+  "  i->err_num = 0;\n",
+  "  i->err_failure = NULL;\n",
+  "}\n",
+  "\n",
+  NULL
+};
+
+static const char *mpc_generate_advance[] = {
+  "static void $_advance($_input_t *i) {\n",
+  "  i->state.col++;\n",
+  "  if (i->string[i->state.pos] == '\\n') { i->state.col = 0; i->state.row++; }\n",
+  "  i->state.pos++;\n",
+  "}\n",
+  "\n",
+  NULL
+};
+
+static const char *mpc_generate_take[] = {
+  "static mpc_val_t *$_take($_input_t *i) {\n",
+  "  char *x = malloc(2);\n",
+  "  x[0] = i->string[i->state.pos];\n",
+  "  x[1] = '\\0';\n",
+  "  $_advance(i);\n",
+  "  return x;\n",
+  "}\n",
+  "\n",
+  NULL
+};
+
+static const char *mpc_generate_has[] = {
+  "static int $_has(const unsigned char *c, char x) {\n",
+  "  return (c[(unsigned char)x / 8] >> ((unsigned char)x % 8)) & 1;\n",
+  "}\n",
+  "\n",
+  NULL
+};
+
+static const char *mpc_generate_str[] = {
+  "static int $_string($_input_t *i, const char *x, mpc_val_t **o) {\n",
+  "  mpc_state_t s = i->state;\n",
+  "  const char *c;\n",
+  "  for (c = x; *c; c++) {\n",
+  "    if (i->string[i->state.pos] == '\\0' || i->string[i->state.pos] != *c) {\n",
+  "      if (i->backtrack > 0) { i->state = s; }\n",
+  "      return 0;\n",
+  "    }\n",
+  "    $_advance(i);\n",
+  "  }\n",
+  "  *o = malloc(strlen(x) + 1);\n",
+  "  strcpy(*o, x);\n",
+  "  return 1;\n",
+  "}\n",
+  "\n",
+  NULL
+};
+
+static const char *mpc_generate_push[] = {
+  "static mpc_val_t **$_push(mpc_val_t **xs, int n, mpc_val_t *x) {\n",
+  "  if ((n & (n-1)) == 0) { xs = realloc(xs, sizeof(mpc_val_t*) * (n ? n * 2 : 1)); }\n",
+  "  xs[n] = x;\n",
+  "  return xs;\n",
+  "}\n",
+  "\n",
+  NULL
+};
+
+static const char *mpc_generate_fold[] = {
+  "static mpc_val_t *$_fold_seq(int n, mpc_val_t **xs) {\n",
+  "  int k, j = 0, c = 0;\n",
+  "  for (k = 0; k < n; k++) { if (xs[k]) { j = k; c++; } }\n",
+  "  if (c == 0) { return NULL; }\n",
+  "  if (c == 1) { return xs[j]; }\n",
+  "  return mpcf_fold_ast(n, xs);\n",
+  "}\n",
+  "\n",
+  NULL
+};
+
+static void mpc_generate_lines(FILE *f, const char *prefix, const char **lines) {
+  for (; *lines; lines++) { mpc_generate_text(f, prefix, *lines); }
+}
+
+static int mpc_generate_index(mpc_graph_t *g, mpc_parser_t *p) {
+  return (int)(mpc_graph_find(g, p) - g->nodes);
+}
+
+/* Records a failure at the start of the parser, as its error would be */
+static void mpc_generate_fail(FILE *f, const char *prefix, mpc_err_t *e) {
+  
+  int i;
+  
+  if (e == NULL || e->failure) {
+    fprintf(f, "  %s_err(i, ", prefix);
+    mpc_generate_string(f, e ? e->failure : "Incorrect Input");
+    fprintf(f, ", 1);\n");
+    return;
+  }
+  
+  for (i = 0; i < e->expected_num; i++) {
+    fprintf(f, "  %s_err(i, ", prefix);
+    mpc_generate_string(f, e->expected[i]);
+    fprintf(f, ", 0);\n");
+  }
+}
+
+static void mpc_generate_node(FILE *f, const char *prefix, mpc_graph_t *g, int k) {
+  
+  int j, x;
+  mpc_parser_t *p = g->nodes[k].p;
+  
+  fprintf(f, "static int %s_%i(%s_input_t *i, mpc_val_t **o) {\n", prefix, k, prefix);
+  
+  x = mpc_graph_children(p) ? mpc_generate_index(g, mpc_graph_child(p, 0)) : 0;
+  
+  switch (p->type) {
+    
+    case MPC_TYPE_UNDEFINED:
+      fprintf(f, "  %s_err(i, \"Parser Undefined!\", 1);\n  return 0;\n", prefix);
+    break;
+    
+    case MPC_TYPE_PASS:
+    case MPC_TYPE_LIFT_VAL:
+      fprintf(f, "  (void)i;\n  *o = NULL;\n  return 1;\n");
+    break;
+    
+    case MPC_TYPE_FAIL:
+      fprintf(f, "  %s_err(i, ", prefix);
+      mpc_generate_string(f, p->data.fail.m);
+      fprintf(f, ", 1);\n  return 0;\n");
+    break;
+    
+    case MPC_TYPE_LIFT:
+      fprintf(f, "  (void)i;\n  *o = ");
+      mpc_generate_call(f, prefix, (mpc_generate_fn_t)p->data.lift.lf);
+      fprintf(f, "();\n  return 1;\n");
+    break;
+    
+    case MPC_TYPE_SOI:
+      fprintf(f, "  if (i->state.pos == 0) { *o = NULL; return 1; }\n");
+      mpc_generate_fail(f, prefix, NULL);
+      fprintf(f, "  return 0;\n");
+    break;
+    
+    case MPC_TYPE_EOI:
+      fprintf(f, "  if (i->string[i->state.pos] == '\\0') { *o = NULL; return 1; }\n");
+      mpc_generate_fail(f, prefix, NULL);
+      fprintf(f, "  return 0;\n");
+    break;
+    
+    case MPC_TYPE_ANY:
+      fprintf(f, "  if (i->string[i->state.pos] != '\\0') { *o = %s_take(i); return 1; }\n", prefix);
+      mpc_generate_fail(f, prefix, NULL);
+      fprintf(f, "  return 0;\n");
+    break;
+    
+    case MPC_TYPE_SINGLE:
+      fprintf(f, "  if (i->string[i->state.pos] != '\\0' && i->string[i->state.pos] == %i) {\n", p->data.single.x);
+      fprintf(f, "    *o = %s_take(i);\n    return 1;\n  }\n", prefix);
+      mpc_generate_fail(f, prefix, NULL);
+      fprintf(f, "  return 0;\n");
+    break;
+    
+    case MPC_TYPE_CLASS:
+      fprintf(f, "  static const unsigned char c[32] = {");
+      for (j = 0; j < 32; j++) { fprintf(f, j ? ", %i" : "%i", p->data.class.x[j]); }
+      fprintf(f, "};\n");
+      fprintf(f, "  if (i->string[i->state.pos] != '\\0' && %s_has(c, i->string[i->state.pos])) {\n", prefix);
+      fprintf(f, "    *o = %s_take(i);\n    return 1;\n  }\n", prefix);
+      mpc_generate_fail(f, prefix, p->data.class.err);
+      fprintf(f, "  return 0;\n");
+    break;
+    
+    case MPC_TYPE_STRING:
+      fprintf(f, "  if (%s_string(i, ", prefix);
+      mpc_generate_string(f, p->data.string.x);
+      fprintf(f, ", o)) { return 1; }\n");
+      mpc_generate_fail(f, prefix, NULL);
+      fprintf(f, "  return 0;\n");
+    break;
+    
+    case MPC_TYPE_REGEX:
+    case MPC_TYPE_MEMO:
+      fprintf(f, "  return %s_%i(i, o);\n", prefix, x);
+    break;
+    
+    case MPC_TYPE_EXPECT:
+      fprintf(f, "  int r;\n  i->quiet++;\n  r = %s_%i(i, o);\n  i->quiet--;\n  if (r) { return 1; }\n", prefix, x);
+      fprintf(f, "  %s_err(i, ", prefix);
+      mpc_generate_string(f, p->data.expect.m);
+      fprintf(f, ", 0);\n  return 0;\n");
+    break;
+    
+    case MPC_TYPE_APPLY:
+      fprintf(f, "  mpc_val_t *x;\n  if (!%s_%i(i, &x)) { return 0; }\n  *o = ", prefix, x);
+      mpc_generate_call(f, prefix, (mpc_generate_fn_t)p->data.apply.f);
+      fprintf(f, "(x);\n  return 1;\n");
+    break;
+    
+    case MPC_TYPE_APPLY_TO:
+      fprintf(f, "  mpc_val_t *x;\n  if (!%s_%i(i, &x)) { return 0; }\n  *o = ", prefix, x);
+      if (p->data.apply_to.f == mpcaf_add_rule) {
+        fprintf(f, "mpc_ast_add_rule(x, ");
+        mpc_generate_string(f, ((mpc_parser_t*)p->data.apply_to.d)->name);
+        fprintf(f, ", %i);\n  return 1;\n", ((mpc_parser_t*)p->data.apply_to.d)->id);
+        break;
+      }
+      mpc_generate_call(f, prefix, (mpc_generate_fn_t)p->data.apply_to.f);
+      fprintf(f, "(x, ");
+      mpc_generate_string(f, p->data.apply_to.d);
+      fprintf(f, ");\n  return 1;\n");
+    break;
+    
+    case MPC_TYPE_PREDICT:
+      fprintf(f, "  int r;\n  i->backtrack--;\n  r = %s_%i(i, o);\n  i->backtrack++;\n  return r;\n", prefix, x);
+    break;
+    
+    case MPC_TYPE_NOT:
+      fprintf(f, "  mpc_val_t *x;\n  mpc_state_t s = i->state;\n");
+      fprintf(f, "  if (%s_%i(i, &x)) {\n", prefix, x);
+      fprintf(f, "    if (i->backtrack > 0) { i->state = s; }\n    ");
+      mpc_generate_call(f, prefix, (mpc_generate_fn_t)p->data.not.dx);
+      fprintf(f, "(x);\n    %s_err(i, \"opposite\", 0);\n    return 0;\n  }\n  *o = ", prefix);
+      mpc_generate_call(f, prefix, (mpc_generate_fn_t)p->data.not.lf);
+      fprintf(f, "();\n  return 1;\n");
+    break;
+    
+    case MPC_TYPE_MAYBE:
+      fprintf(f, "  if (%s_%i(i, o)) { return 1; }\n  *o = ", prefix, x);
+      mpc_generate_call(f, prefix, (mpc_generate_fn_t)p->data.not.lf);
+      fprintf(f, "();\n  return 1;\n");
+    break;
+    
+    case MPC_TYPE_MANY:
+    case MPC_TYPE_MANY1:
+    case MPC_TYPE_COUNT:
+      fprintf(f, "  int n = 0;\n  mpc_val_t *x, **xs = NULL;\n");
+      if (p->type == MPC_TYPE_COUNT) { fprintf(f, "  mpc_state_t s = i->state;\n"); }
+      fprintf(f, "  while (%s_%i(i, &x)) { xs = %s_push(xs, n++, x); }\n", prefix, x, prefix);
+      if (p->type == MPC_TYPE_MANY1) {
+        fprintf(f, "  if (n == 0) { return 0; }\n");
+      }
+      if (p->type == MPC_TYPE_COUNT) {
+        fprintf(f, "  if (n != %i) {\n    while (n) { ", p->data.repeat.n);
+        mpc_generate_call(f, prefix, (mpc_generate_fn_t)p->data.repeat.dx);
+        fprintf(f, "(xs[--n]); }\n    free(xs);\n    if (i->backtrack > 0) { i->state = s; }\n    return 0;\n  }\n");
+      }
+      fprintf(f, "  *o = ");
+      mpc_generate_call(f, prefix, (mpc_generate_fn_t)p->data.repeat.f);
+      fprintf(f, "(n, xs);\n  free(xs);\n  return 1;\n");
+    break;
+    
+    case MPC_TYPE_OR:
+      for (j = 0; j < p->data.or.n; j++) {
+        fprintf(f, "  if (%s_%i(i, o)) { return 1; }\n", prefix, mpc_generate_index(g, p->data.or.xs[j]));
+      }
+      fprintf(f, p->data.or.n ? "  return 0;\n" : "  *o = NULL;\n  return 1;\n");
+    break;
+    
+    case MPC_TYPE_AND:
+      if (p->data.and.n == 0) {
+        fprintf(f, "  *o = ");
+        mpc_generate_call(f, prefix, (mpc_generate_fn_t)p->data.and.f);
+        fprintf(f, "(0, NULL);\n  return 1;\n");
+        break;
+      }
+      fprintf(f, "  mpc_val_t *xs[%i];\n  mpc_state_t s = i->state;\n", p->data.and.n);
+      for (j = 0; j < p->data.and.n; j++) {
+        fprintf(f, "  if (!%s_%i(i, &xs[%i])) { goto fail%i; }\n", prefix, mpc_generate_index(g, p->data.and.xs[j]), j, j);
+      }
+      fprintf(f, "  *o = ");
+      mpc_generate_call(f, prefix, (mpc_generate_fn_t)p->data.and.f);
+      fprintf(f, "(%i, xs);\n  return 1;\n", p->data.and.n);
+      for (j = p->data.and.n-1; j >= 0; j--) {
+        fprintf(f, "fail%i:\n", j);
+        if (j > 0) {
+          fprintf(f, "  ");
+          mpc_generate_call(f, prefix, (mpc_generate_fn_t)p->data.and.dxs[j-1]);
+          fprintf(f, "(xs[%i]);\n", j-1);
+        }
+      }
+      fprintf(f, "  if (i->backtrack > 0) { i->state = s; }\n  return 0;\n");
+    break;
+    
+    default: break;
+  }
+  
+  fprintf(f, "}\n\n");
+}
+
+static mpc_err_t *mpc_generate_st(FILE *f, const char *prefix, mpca_grammar_st_t *st) {
+  
+  int i, k;
+  int uses[MPC_TYPE_REGEX+1];
+  int fold = 0;
+  mpc_graph_t g;
+  mpc_parser_t *p;
+  
+  mpc_graph_init(&g, st->parsers_num, st->parsers);
+  
+  memset(uses, 0, sizeof(uses));
+  for (k = 0; k < g.num; k++) {
+    p = g.nodes[k].p;
+    if (!mpc_generate_supported(p)) {
+      mpc_graph_delete(&g);
+      return mpc_err_fail("<mpca_generate>", mpc_state_invalid(),
+        "Grammar uses a parser that cannot be generated!");
+    }
+    uses[(int)p->type] = 1;
+    fold = fold || (p->type == MPC_TYPE_AND && p->data.and.f == mpc_optimise_fold);
+  }
+  
+  mpc_generate_lines(f, prefix, mpc_generate_prelude);
+  if (uses[MPC_TYPE_ANY] || uses[MPC_TYPE_SINGLE] || uses[MPC_TYPE_CLASS] || uses[MPC_TYPE_STRING]) {
+    mpc_generate_lines(f, prefix, mpc_generate_advance);
+  }
+  if (uses[MPC_TYPE_ANY] || uses[MPC_TYPE_SINGLE] || uses[MPC_TYPE_CLASS]) {
+    mpc_generate_lines(f, prefix, mpc_generate_take);
+  }
+  if (uses[MPC_TYPE_CLASS])  { mpc_generate_lines(f, prefix, mpc_generate_has); }
+  if (uses[MPC_TYPE_STRING]) { mpc_generate_lines(f, prefix, mpc_generate_str); }
+  if (uses[MPC_TYPE_MANY] || uses[MPC_TYPE_MANY1] || uses[MPC_TYPE_COUNT]) {
+    mpc_generate_lines(f, prefix, mpc_generate_push);
+  }
+  if (fold) { mpc_generate_lines(f, prefix, mpc_generate_fold); }
+  
+  for (k = 0; k < g.num; k++) {
+    fprintf(f, "static int %s_%i(%s_input_t *i, mpc_val_t **o);\n", prefix, k, prefix);
+  }
+  fprintf(f, "\n");
+  
+  for (k = 0; k < g.num; k++) { mpc_generate_node(f, prefix, &g, k); }
+  
+  for (i = 0; i < st->parsers_num; i++) {
+    fprintf(f, "int %s_parse_%s(const char *filename, const char *string, mpc_result_t *r) {\n", prefix, st->parsers[i]->name);
+    fprintf(f, "  %s_input_t i;\n  mpc_val_t *x = NULL;\n  int ok;\n", prefix);
+    fprintf(f, "  %s_init(&i, filename, string);\n", prefix);
+    fprintf(f, "  ok = %s_%i(&i, &x);\n", prefix, mpc_generate_index(&g, st->parsers[i]));
+    fprintf(f, "  return %s_finish(&i, ok, x, r);\n}\n\n", prefix);
+  }
+  
+  mpc_graph_delete(&g);
+  return NULL;
+}
+
+mpc_err_t *mpca_generate(FILE *f, const char *prefix, int flags, const char *language) {
+  
+  int i;
+  mpca_grammar_st_t st;
+  mpc_input_t *in;
+  mpc_err_t *err;
+  
+  /* Without a list of parsers each rule gets a new one */
+  st.va = NULL;
+  st.parsers_num = 0;
+  st.parsers = NULL;
+  st.flags = flags;
+  
+  in = mpc_input_new_string("<mpca_generate>", language);
+  err = mpca_lang_st(in, &st);
+  mpc_input_delete(in);
+  
+  if (err == NULL) { err = mpc_generate_st(f, prefix, &st); }
+  
+  for (i = 0; i < st.parsers_num; i++) { mpc_undefine(st.parsers[i]); }
+  for (i = 0; i < st.parsers_num; i++) { mpc_delete(st.parsers[i]); }
+  free(st.parsers);
+  
+  return err;
+}
@@ -22,7 +22,7 @@
 */
 
 typedef struct {
-  int pos;
+  long pos;
   int row;
   int col;
   char next;
@@ -43,6 +43,13 @@ void mpc_err_print_to(mpc_err_t *e, FILE *f);
 
 /*
 ** Parsing
+**
+** Parsing never changes a parser, and everything a
+** parse works in belongs to its input, stack or
+** context. Once a grammar is built, optimised and
+** analysed it can be used by any number of threads
+** parsing at the same time, each with its own
+** contexts if they use any.
 */
 
 typedef void mpc_val_t;
@@ -56,10 +63,129 @@ struct mpc_parser_t;
 typedef struct mpc_parser_t mpc_parser_t;
 
 int mpc_parse(const char *filename, const char *string, mpc_parser_t *p, mpc_result_t *r);
+int mpc_parse_n(const char *filename, const char *string, size_t length, mpc_parser_t *p, mpc_result_t *r);
 int mpc_parse_file(const char *filename, FILE *file, mpc_parser_t *p, mpc_result_t *r);
 int mpc_parse_pipe(const char *filename, FILE *pipe, mpc_parser_t *p, mpc_result_t *r);
 int mpc_parse_contents(const char *filename, mpc_parser_t *p, mpc_result_t *r);
 
+/*
+** A stream parses one value after another from
+** `file`. Each `mpc_stream_parse` consumes only
+** the input `p` matched, so the next starts right
+** after it, and a failed parse consumes nothing.
+** Nothing is skipped between values, so a caller
+** usually parses any whitespace first and then
+** asks `mpc_stream_eof`, which is true only once
+** no input is left at all.
+**
+** `mpc_parse_pipe` may read further than it
+** consumes and only one character can be put back
+** on `pipe`, so use a stream to read more after it.
+*/
+
+struct mpc_stream_t;
+typedef struct mpc_stream_t mpc_stream_t;
+
+mpc_stream_t *mpc_stream_new(const char *filename, FILE *file);
+void mpc_stream_delete(mpc_stream_t *s);
+int mpc_stream_parse(mpc_stream_t *s, mpc_parser_t *p, mpc_result_t *r);
+int mpc_stream_eof(mpc_stream_t *s);
+
+/*
+** A context can be kept and passed to many
+** parses, one after another, so the memory the
+** parser works in is allocated once rather than
+** on every call. It must not be used by two
+** parses at the same time.
+**
+** With `MPC_ERRORS_FARTHEST` no error is built
+** until a parse fails. The error then gives the
+** furthest position reached and what could have
+** come next there, but may list fewer things
+** than a full error would.
+*/
+
+struct mpc_parse_ctx_t;
+typedef struct mpc_parse_ctx_t mpc_parse_ctx_t;
+
+enum {
+  MPC_ERRORS_FULL     = 0,
+  MPC_ERRORS_FARTHEST = 1
+};
+
+mpc_parse_ctx_t *mpc_parse_ctx_new(void);
+void mpc_parse_ctx_errors(mpc_parse_ctx_t *c, int mode);
+void mpc_parse_ctx_delete(mpc_parse_ctx_t *c);
+int mpc_parse_ctx(mpc_parse_ctx_t *c, const char *filename, const char *string, mpc_parser_t *p, mpc_result_t *r);
+
+/*
+** Parses each of the `n` files named in
+** `filenames` with `p`, using up to `nthreads`
+** threads. The result for `filenames[i]` is put
+** in `rs[i]` and `oks[i]` says if it is an
+** output or an error, as `mpc_parse` would
+** return. Gives the number of files which
+** parsed.
+**
+** On POSIX systems this needs linking with
+** `-pthread`. Defining `MPC_NO_THREADS` when
+** compiling `mpc.c` parses the files one after
+** another instead.
+*/
+
+int mpc_parse_files(mpc_parser_t *p, const char **filenames, int n, mpc_result_t *rs, int *oks, int nthreads);
+
+/*
+** Parses a long run of top level forms, such as
+** a large Lispy file, in chunks on up to
+** `nthreads` threads. Chunks are cut between the
+** top level bracketed forms, found by counting
+** the brackets in `open` and `close` outside of
+** strings, which start and end with `quote`
+** and may contain `escape`, and comments, which
+** run from `comment` to the end of the line.
+** Any of those three can be `'\0'` if the
+** grammar has no such thing.
+**
+** `p` must be a root like `/^/ <form>* /$/`
+** giving an AST whose root holds the start, the
+** forms and then the end. The result is the same
+** as `mpc_parse` would give.
+*/
+
+typedef struct {
+  const char *open;
+  const char *close;
+  char quote;
+  char escape;
+  char comment;
+} mpc_split_t;
+
+int mpc_parse_split(const char *filename, const char *string, size_t length, mpc_parser_t *p, const mpc_split_t *s, int nthreads, mpc_result_t *r);
+
+/*
+** Checks if `string` parses without making any
+** outputs or calling any folds. On failure the
+** position of the error `mpc_parse` would give
+** is put in `err_pos`.
+*/
+
+int mpc_recognize(mpc_parser_t *p, const char *string, long *err_pos);
+
+/*
+** A compiled program gives the same results as
+** parsing with `p` directly but runs faster. It
+** refers back to `p`, so delete the program first
+** and do not redefine any rule while it is in use.
+*/
+
+struct mpc_program_t;
+typedef struct mpc_program_t mpc_program_t;
+
+mpc_program_t *mpc_compile(mpc_parser_t *p);
+void mpc_program_delete(mpc_program_t *c);
+int mpc_parse_compiled(const char *filename, const char *string, mpc_program_t *c, mpc_result_t *r);
+
 /*
 ** Function Types
 */
@@ -70,6 +196,42 @@ typedef mpc_val_t*(*mpc_ctor_t)(void);
 typedef mpc_val_t*(*mpc_apply_t)(mpc_val_t*);
 typedef mpc_val_t*(*mpc_apply_to_t)(mpc_val_t*,void*);
 typedef mpc_val_t*(*mpc_fold_t)(int,mpc_val_t**);
+typedef mpc_val_t*(*mpc_copy_t)(mpc_val_t*);
+
+/*
+** A push parser is handed its input a piece at a
+** time with `mpc_feed` and `mpc_push_end` marks
+** that no more is coming. Each `mpc_push_next`
+** gives one of:
+**
+**   MPC_PUSH_OUTPUT  the next value is put in `r`
+**   MPC_PUSH_ERROR   an error is put in `r` and all
+**                    input fed so far is discarded
+**   MPC_PUSH_MORE    more input must be fed first
+**   MPC_PUSH_DONE    the input has ended
+**
+** After an error the parser carries on with the
+** next input fed in, so a REPL can report a bad
+** line and keep going. Deleting it part way
+** through a value frees what has been built, any
+** value complete at that point going to `d`.
+*/
+
+struct mpc_push_t;
+typedef struct mpc_push_t mpc_push_t;
+
+enum {
+  MPC_PUSH_ERROR  = 0,
+  MPC_PUSH_OUTPUT = 1,
+  MPC_PUSH_MORE   = 2,
+  MPC_PUSH_DONE   = 3
+};
+
+mpc_push_t *mpc_push_new(const char *filename, mpc_parser_t *p, mpc_dtor_t d);
+void mpc_push_delete(mpc_push_t *x);
+void mpc_feed(mpc_push_t *x, const char *data, size_t n);
+void mpc_push_end(mpc_push_t *x);
+int mpc_push_next(mpc_push_t *x, mpc_result_t *r);
 
 /*
 ** Building a Parser
@@ -123,6 +285,39 @@ mpc_parser_t *mpc_and(int n, mpc_fold_t f, ...);
 
 mpc_parser_t *mpc_predictive(mpc_parser_t *a);
 
+mpc_parser_t *mpc_memo(mpc_parser_t *a, mpc_copy_t cx, mpc_dtor_t dx);
+
+/* Parses like `mpc_parse`, counting how often memoised results were reused */
+int mpc_parse_memo_stats(const char *filename, const char *string, mpc_parser_t *p, mpc_result_t *r, long *hits, long *misses);
+
+/*
+** Grammar Analysis
+**
+** Lets each `or` reachable from `p` skip any
+** alternative that cannot start with the next
+** character, and makes named rules predictive
+** where that is provably safe. Done for you by
+** `mpca_lang`. Run it again after redefining
+** any rule.
+*/
+
+void mpc_analyse(mpc_parser_t *p);
+
+/*
+** Optimisation
+**
+** Rewrites `p` and everything reachable from it
+** into an equivalent parser with fewer steps. It
+** flattens nested `and` and `or` chains, drops
+** `pass` and needless `expect`, and factors out
+** prefixes shared by neighbouring alternatives
+** unless the grammar uses `mpc_predictive`.
+** Results and errors are unchanged. Done for you
+** by `mpca_lang`. Run `mpc_analyse` after it.
+*/
+
+void mpc_optimise(mpc_parser_t *p);
+
 /*
 ** Common Parsers
 */
@@ -239,11 +434,26 @@ mpc_parser_t *mpc_re(const char *re);
 ** AST
 */
 
+/*
+** Rules of a grammar are numbered from 1 in the
+** order their parsers are given to `mpca_lang` or
+** `mpca_grammar`, or in the order they are defined
+** by `mpca_generate`. `rule` is the number of
+** the innermost rule a node was tagged with, or 0
+** if it was not tagged by any rule, and `rules` has
+** the bit `1 << (n-1)` set for each rule `n` up to
+** `MPC_AST_RULES_MAX` that tagged it.
+*/
+
+enum { MPC_AST_RULES_MAX = 32 };
+
 typedef struct mpc_ast_t {
   char *tag;
   char *contents;
   int children_num;
   struct mpc_ast_t** children;
+  int rule;
+  unsigned long rules;
 } mpc_ast_t;
 
 mpc_ast_t *mpc_ast_new(const char *tag, const char *contents);
@@ -251,7 +461,9 @@ mpc_ast_t *mpc_ast_build(int n, const char *tag, ...);
 mpc_ast_t *mpc_ast_add_root(mpc_ast_t *a);
 mpc_ast_t *mpc_ast_add_child(mpc_ast_t *r, mpc_ast_t *a);
 mpc_ast_t *mpc_ast_add_tag(mpc_ast_t *a, const char *t);
+mpc_ast_t *mpc_ast_add_rule(mpc_ast_t *a, const char *t, int id);
 mpc_ast_t *mpc_ast_tag(mpc_ast_t *a, const char *t);
+mpc_ast_t *mpc_ast_copy(mpc_ast_t *a);
 
 void mpc_ast_delete(mpc_ast_t *a);
 void mpc_ast_print(mpc_ast_t *a);
@@ -261,10 +473,80 @@ int mpc_ast_eq(mpc_ast_t *a, mpc_ast_t *b);
 mpc_val_t *mpcf_fold_ast(int n, mpc_val_t **as);
 mpc_val_t *mpcf_str_ast(mpc_val_t *c);
 
+/*
+** An arena owns every node, string and child
+** array of the trees built by a parse context it
+** is given to. Trees in an arena must not be passed
+** to `mpc_ast_delete`. Instead they are all freed
+** at once by `mpc_ast_arena_clear`, which keeps the
+** memory for the next parse. Only the functions
+** used by `mpca_lang` and the `mpca_` combinators
+** build into the arena.
+*/
+
+struct mpc_ast_arena_t;
+typedef struct mpc_ast_arena_t mpc_ast_arena_t;
+
+mpc_ast_arena_t *mpc_ast_arena_new(void);
+void mpc_ast_arena_clear(mpc_ast_arena_t *a);
+void mpc_ast_arena_delete(mpc_ast_arena_t *a);
+
+void mpc_parse_ctx_arena(mpc_parse_ctx_t *c, mpc_ast_arena_t *a);
+
+/*
+** A flat AST keeps a tree in arrays indexed by
+** node. Nodes are stored in preorder with the root
+** at 0, so a loop over the indices walks the whole
+** tree, and `first` and `next` link each node to its
+** first child and next sibling, or are -1. `tag` and
+** `contents` are offsets into `strings`. Tags are
+** only stored once. `start` and `length` give the
+** part of the input each node spans.
+**
+** A parse context in `MPC_OUTPUT_FLAT` mode puts
+** a `mpc_flat_t` in the output of each successful
+** parse in place of a `mpc_ast_t`. This is freed
+** with `mpc_flat_delete`. No nodes are allocated
+** while parsing and folds just link children to one
+** another. As with arenas, only grammars built by
+** `mpca_lang` and the `mpca_` combinators can be
+** used. Flat mode takes precedence over an arena.
+*/
+
+typedef struct {
+  int nodes_num;
+  int *first;
+  int *next;
+  int *children_num;
+  int *rule;
+  unsigned long *rules;
+  long *tag;
+  long *contents;
+  long *start;
+  long *length;
+  long strings_num;
+  char *strings;
+} mpc_flat_t;
+
+enum {
+  MPC_OUTPUT_AST  = 0,
+  MPC_OUTPUT_FLAT = 1
+};
+
+void mpc_parse_ctx_output(mpc_parse_ctx_t *c, int mode);
+
+void mpc_flat_delete(mpc_flat_t *f);
+int mpc_flat_first(mpc_flat_t *f, int n);
+int mpc_flat_next(mpc_flat_t *f, int n);
+const char *mpc_flat_tag(mpc_flat_t *f, int n);
+const char *mpc_flat_contents(mpc_flat_t *f, int n);
+mpc_ast_t *mpc_flat_ast(mpc_flat_t *f, int n);
+
 mpc_parser_t *mpca_tag(mpc_parser_t *a, const char *t);
 mpc_parser_t *mpca_add_tag(mpc_parser_t *a, const char *t);
 mpc_parser_t *mpca_root(mpc_parser_t *a);
 mpc_parser_t *mpca_total(mpc_parser_t *a);
+mpc_parser_t *mpca_memo(mpc_parser_t *a);
 
 mpc_parser_t *mpca_not(mpc_parser_t *a);
 mpc_parser_t *mpca_maybe(mpc_parser_t *a);
@@ -279,7 +561,8 @@ mpc_parser_t *mpca_and(int n, ...);
 enum {
   MPC_LANG_DEFAULT              = 0,
   MPC_LANG_PREDICTIVE           = 1,
-  MPC_LANG_WHITESPACE_SENSITIVE = 2
+  MPC_LANG_WHITESPACE_SENSITIVE = 2,
+  MPC_LANG_PACKRAT              = 4
 };
 
 mpc_parser_t *mpca_grammar(int flags, const char *grammar, ...);
@@ -289,6 +572,15 @@ mpc_err_t *mpca_lang_file(int flags, FILE *f, ...);
 mpc_err_t *mpca_lang_pipe(int flags, FILE *f, ...);
 mpc_err_t *mpca_lang_contents(int flags, const char *filename, ...);
 
+/*
+** Writes C source for a parser of each rule in
+** `language`, named `<prefix>_parse_<rule>`, which
+** gives the same AST as `mpca_lang` would. Rules
+** are found by name so no parsers are passed in.
+*/
+
+mpc_err_t *mpca_generate(FILE *f, const char *prefix, int flags, const char *language);
+
 /*
 ** Debug & Testing
 */
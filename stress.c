@@ -0,0 +1,131 @@
+#define _POSIX_C_SOURCE 200809L
+#include "bench.h"
+#include <pthread.h>
+#include <time.h>
+
+/*
+** Parses with one Lispy grammar from many threads
+** at once. Every thread checks each result against
+** the one made before any threads started, so a
+** race shows up as a mismatch, and the time taken
+** for the same work per thread shows how it scales.
+**
+**   cc -std=c99 -O2 -Wall stress.c mpc.c -lm -pthread -o stress
+**   ./stress [lines] [runs] [threads] [default|packrat]
+**
+** Build with -fsanitize=thread to have races
+** reported directly.
+*/
+
+typedef struct {
+  mpc_parser_t* parser;
+  const char* input;
+  const char* bad;
+  mpc_ast_t* expected;
+  char* error;
+  int runs;
+  int ctx;
+  int mismatches;
+} stress_t;
+
+double stress_now(void) {
+  struct timespec t;
+  clock_gettime(CLOCK_MONOTONIC, &t);
+  return t.tv_sec + t.tv_nsec / 1e9;
+}
+
+/* Alternates good and bad input, through a context or not */
+void* stress_run(void* arg) {
+
+  stress_t* s = arg;
+  mpc_parse_ctx_t* c = s->ctx ? mpc_parse_ctx_new() : NULL;
+  mpc_result_t r;
+
+  for (int i = 0; i < s->runs; i++) {
+
+    int ok = c
+      ? mpc_parse_ctx(c, "<stress>", s->input, s->parser, &r)
+      : mpc_parse("<stress>", s->input, s->parser, &r);
+    if (!ok) { s->mismatches++; mpc_err_delete(r.error); continue; }
+    if (!mpc_ast_eq(r.output, s->expected)) { s->mismatches++; }
+    mpc_ast_delete(r.output);
+
+    if (mpc_parse("<stress>", s->bad, s->parser, &r)) {
+      s->mismatches++;
+      mpc_ast_delete(r.output);
+      continue;
+    }
+    char* error = mpc_err_string(r.error);
+    if (strcmp(error, s->error) != 0) { s->mismatches++; }
+    free(error);
+    mpc_err_delete(r.error);
+  }
+
+  if (c) { mpc_parse_ctx_delete(c); }
+  return NULL;
+}
+
+int main(int argc, char** argv) {
+
+  int lines = argc > 1 ? atoi(argv[1]) : 200;
+  int runs = argc > 2 ? atoi(argv[2]) : 10;
+  int threads = argc > 3 ? atoi(argv[3]) : 8;
+  const char* mode = argc > 4 ? argv[4] : "default";
+
+  int flags = strcmp(mode, "packrat") == 0 ? MPC_LANG_PACKRAT : MPC_LANG_DEFAULT;
+
+  bench_grammar_t g;
+  if (!bench_grammar_new(&g, flags)) { return 1; }
+  mpc_parser_t* Lispy = g.Lispy;
+
+  char* input = bench_input(lines);
+  const char* bad = "(+ 1 (* 2 3) {head (list 1 2)) }";
+  mpc_result_t a, b;
+
+  /* The answers every thread must give, found before any start */
+  if (!mpc_parse("<stress>", input, Lispy, &a)) { mpc_err_print(a.error); return 1; }
+  if (mpc_parse("<stress>", bad, Lispy, &b)) { puts("Bad input parsed!"); return 1; }
+  char* error = mpc_err_string(b.error);
+  mpc_err_delete(b.error);
+
+  pthread_t* ids = malloc(sizeof(pthread_t) * threads);
+  stress_t* work = malloc(sizeof(stress_t) * threads);
+  double single = 0;
+  int mismatches = 0;
+
+  printf("%i lines x %i runs per thread, %s\n", lines, runs, mode);
+
+  /* Doubles the threads each time, finishing on `threads` */
+  for (int n = 1; n <= threads; n = n < threads && n * 2 > threads ? threads : n * 2) {
+
+    double start = stress_now();
+
+    for (int i = 0; i < n; i++) {
+      stress_t s = { Lispy, input, bad, a.output, error, runs, i % 2, 0 };
+      work[i] = s;
+      pthread_create(&ids[i], NULL, stress_run, &work[i]);
+    }
+
+    int wrong = 0;
+    for (int i = 0; i < n; i++) {
+      pthread_join(ids[i], NULL);
+      wrong += work[i].mismatches;
+    }
+
+    double taken = stress_now() - start;
+    if (n == 1) { single = taken; }
+    mismatches += wrong;
+
+    printf("%2i threads: %.3fs, %.2fx throughput, %i mismatches\n",
+      n, taken, n * single / taken, wrong);
+  }
+
+  free(ids);
+  free(work);
+  free(error);
+  free(input);
+  mpc_ast_delete(a.output);
+  bench_grammar_delete(&g);
+
+  return mismatches ? 1 : 0;
+}
@@ -1,4 +1,9 @@
 #include "mpc.h"
+#include <stdint.h>
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
 
 #ifdef _WIN32
 
@@ -155,6 +160,14 @@ lval *lval_sym(char *s) {
   return v;
 }
 
+/* symbol type lval which takes a malloc'ed string rather than copying it */
+lval *lval_sym_own(char *s) {
+  lval *v = malloc(sizeof(lval));
+  v->type = LVAL_SYM;
+  v->sym = s;
+  return v;
+}
+
 lval *lval_sexpr(void) {
   lval *v = malloc(sizeof(lval));
   v->type = LVAL_SEXPR;
@@ -500,35 +513,335 @@ lval *lval_eval(lenv *e, lval *v) {
   return v; /* all other types remain the same */
 }
 
-lval *lval_read_num(mpc_ast_t *t) {
+lval *lval_read_num(char *s) {
   errno = 0;
-  double x = strtod(t->contents, NULL);
+  double x = strtod(s, NULL);
   return errno != ERANGE ? lval_num(x) : lval_err("Invalid number");
 }
 
-lval *lval_read(mpc_ast_t *t) {
-  /* if symbol or number return conversion to that type */
-  if (strstr(t->tag, "number")) { return lval_read_num(t); }
-  if (strstr(t->tag, "symbol")) { return lval_sym(t->contents); }
+/* the lispy grammar
+
+    number : /(-|+)?[0-9]+(\.)?([0-9]+)?/ ;
+    symbol : /[a-zA-Z0-9_+\-*\/\\=<>!&]+/ ;
+    sexpr  : '(' <expr>* ')' ;
+    qexpr  : '{' <expr>* '}' ;
+    expr   : <number> | <symbol> | <sexpr> | <qexpr> ;
+    lispy  : /^/ <expr>* /$/ ;
+
+  is built from mpc combinators the way mpca_lang would build it, so it
+  accepts the same inputs and gives the same errors, but its applies and
+  folds make the lvals as it parses instead of an mpc_ast_t to be read
+  afterwards */
+mpc_val_t *lvalf_num(mpc_val_t *x) {
+  lval *v = lval_read_num(x);
+  free(x);
+  return v;
+}
 
-  /* if root (>) or sexpr then create empty list */
-  lval *x = NULL;
-  if(strcmp(t->tag, ">") == 0) { x = lval_sexpr(); }
-  if(strstr(t->tag, "sexpr"))  { x = lval_sexpr(); }
-  if(strstr(t->tag, "qexpr"))  { x = lval_qexpr(); }
+/* the symbol keeps the string mpc matched rather than copying it */
+mpc_val_t *lvalf_sym(mpc_val_t *x) {
+  return lval_sym_own(x);
+}
 
-  /* check for valid expression */
-  for (int i=0; i < t->children_num; i++) {
-    if (strcmp(t->children[i]->contents, "(") == 0) { continue; }
-    if (strcmp(t->children[i]->contents, ")") == 0) { continue; }
-    if (strcmp(t->children[i]->contents, "}") == 0) { continue; }
-    if (strcmp(t->children[i]->contents, "{") == 0) { continue; }
-    if (strcmp(t->children[i]->tag,  "regex") == 0) { continue; }
-    x = lval_add(x, lval_read(t->children[i]));
+/* every <expr>* arrives at once so the cells are allocated exactly */
+mpc_val_t *lvalf_list(int n, mpc_val_t **xs) {
+  lval *v = lval_sexpr();
+  if (n > 0) {
+    v->count = n;
+    v->cell = malloc(sizeof(lval*) * n);
+    memcpy(v->cell, xs, sizeof(lval*) * n);
+  }
+  return v;
+}
+
+/* drop the brackets, or the start and end for the root */
+mpc_val_t *lvalf_sexpr(int n, mpc_val_t **xs) {
+  free(xs[0]);
+  free(xs[2]);
+  return xs[1];
+}
+
+mpc_val_t *lvalf_qexpr(int n, mpc_val_t **xs) {
+  lval *v = lvalf_sexpr(n, xs);
+  v->type = LVAL_QEXPR;
+  return v;
+}
+
+void lvalf_del(mpc_val_t *x) {
+  lval_del(x);
+}
+
+void lval_grammar(mpc_parser_t *Number, mpc_parser_t *Symbol, mpc_parser_t *Sexpr,
+                  mpc_parser_t *Qexpr, mpc_parser_t *Expr, mpc_parser_t *Lispy) {
+  mpc_define(Number, mpc_apply(mpc_tok(mpc_re("(-|+)?[0-9]+(\\.)?([0-9]+)?")), lvalf_num));
+  mpc_define(Symbol, mpc_apply(mpc_tok(mpc_re("[a-zA-Z0-9_+\\-*/\\\\=<>!&]+")), lvalf_sym));
+  mpc_define(Sexpr, mpc_and(3, lvalf_sexpr,
+    mpc_tok(mpc_char('(')), mpc_many(lvalf_list, Expr), mpc_tok(mpc_char(')')), free, lvalf_del));
+  mpc_define(Qexpr, mpc_and(3, lvalf_qexpr,
+    mpc_tok(mpc_char('{')), mpc_many(lvalf_list, Expr), mpc_tok(mpc_char('}')), free, lvalf_del));
+  mpc_define(Expr, mpc_or(4, Number, Symbol, Sexpr, Qexpr));
+  mpc_define(Lispy, mpc_and(3, lvalf_sexpr,
+    mpc_tok(mpc_re("^")), mpc_many(lvalf_list, Expr), mpc_tok(mpc_re("$")), free, lvalf_del));
+  mpc_optimise(Lispy);
+  mpc_analyse(Lispy);
+}
+
+/* structural index reader (http://arxiv.org/abs/1902.08318):
+  stage 1 classifies the input 64 bytes at a time into bitmaps of the
+  brackets, the whitespace and the first character of every token.
+  stage 2 visits only those positions and builds the lvals directly,
+  accepting exactly the inputs the lispy grammar accepts and giving
+  the same lval its parser would. anything else gives NULL and mpc is
+  used to report the error. */
+typedef struct {
+  size_t blocks;
+  uint64_t *brackets;
+  uint64_t *spaces;
+  uint64_t *starts;
+} lindex;
+
+/* the characters of the symbol regex */
+static const char *lindex_symbol_chars =
+  "abcdefghijklmnopqrstuvwxyzABCDEFGHIJKLMNOPQRSTUVWXYZ0123456789_+-*/\\=<>!&";
+
+static int lindex_ctz(uint64_t x) {
+#ifdef __GNUC__
+  return __builtin_ctzll(x);
+#else
+  int i = 0;
+  while (!(x & 1)) { x >>= 1; i++; }
+  return i;
+#endif
+}
+
+/* bitmaps of the brackets and the whitespace in 64 bytes */
+static void lindex_block(const char *s, uint64_t *brackets, uint64_t *spaces) {
+  uint64_t b = 0, w = 0;
+#ifdef __SSE2__
+  for (int k = 0; k < 4; k++) {
+    __m128i v = _mm_loadu_si128((const __m128i *)(s + 16 * k));
+    __m128i x = _mm_or_si128(
+      _mm_or_si128(_mm_cmpeq_epi8(v, _mm_set1_epi8('(')), _mm_cmpeq_epi8(v, _mm_set1_epi8(')'))),
+      _mm_or_si128(_mm_cmpeq_epi8(v, _mm_set1_epi8('{')), _mm_cmpeq_epi8(v, _mm_set1_epi8('}'))));
+    /* \t \n \v \f \r are 9 to 13, so one unsigned range check */
+    __m128i t = _mm_sub_epi8(v, _mm_set1_epi8(9));
+    __m128i y = _mm_or_si128(_mm_cmpeq_epi8(v, _mm_set1_epi8(' ')),
+      _mm_cmpeq_epi8(_mm_min_epu8(t, _mm_set1_epi8(4)), t));
+    b |= (uint64_t)(uint16_t)_mm_movemask_epi8(x) << (16 * k);
+    w |= (uint64_t)(uint16_t)_mm_movemask_epi8(y) << (16 * k);
+  }
+#else
+  for (int k = 0; k < 64; k++) {
+    if (strchr("(){}", s[k])) { b |= (uint64_t)1 << k; }
+    if (strchr(" \t\n\v\f\r", s[k])) { w |= (uint64_t)1 << k; }
+  }
+#endif
+  *brackets = b;
+  *spaces = w;
+}
+
+/* stage 1 */
+static lindex lindex_build(const char *s, size_t n) {
+  lindex x;
+  char last[64];
+  uint64_t carry = 0;
+
+  x.blocks = (n + 63) / 64;
+  x.brackets = malloc(sizeof(uint64_t) * x.blocks);
+  x.spaces = malloc(sizeof(uint64_t) * x.blocks);
+  x.starts = malloc(sizeof(uint64_t) * x.blocks);
+
+  for (size_t i = 0; i < x.blocks; i++) {
+    const char *b = s + i * 64;
+    /* the last block is padded out with spaces */
+    if (i * 64 + 64 > n) {
+      memset(last, ' ', 64);
+      memcpy(last, b, n - i * 64);
+      b = last;
+    }
+    lindex_block(b, &x.brackets[i], &x.spaces[i]);
+    uint64_t token = ~(x.brackets[i] | x.spaces[i]);
+    x.starts[i] = token & ~((token << 1) | carry);
+    carry = token >> 63;
   }
   return x;
 }
 
+static void lindex_del(lindex *x) {
+  free(x->brackets);
+  free(x->spaces);
+  free(x->starts);
+}
+
+/* what each character is to the reader */
+enum { LCHAR_BAD, LCHAR_SYMBOL, LCHAR_BRACKET, LCHAR_SPACE };
+
+static void lindex_classes(unsigned char *c) {
+  memset(c, LCHAR_BAD, 256);
+  for (const char *x = lindex_symbol_chars; *x; x++) { c[(unsigned char)*x] = LCHAR_SYMBOL; }
+  for (const char *x = "(){}"; *x; x++) { c[(unsigned char)*x] = LCHAR_BRACKET; }
+  for (const char *x = " \t\n\v\f\r"; *x; x++) { c[(unsigned char)*x] = LCHAR_SPACE; }
+}
+
+/* values read so far, each list takes its items off the top when it closes */
+typedef struct {
+  lval **vals;
+  size_t count;
+  size_t slots;
+} lstack;
+
+static void lstack_push(lstack *k, lval *v) {
+  if (k->count == k->slots) {
+    k->slots *= 2;
+    k->vals = realloc(k->vals, sizeof(lval*) * k->slots);
+  }
+  k->vals[k->count++] = v;
+}
+
+static lval *lstack_close(lstack *k, lval *v, size_t mark) {
+  v->count = k->count - mark;
+  if (v->count > 0) {
+    v->cell = malloc(sizeof(lval*) * v->count);
+    memcpy(v->cell, &k->vals[mark], sizeof(lval*) * v->count);
+  }
+  k->count = mark;
+  return v;
+}
+
+static lval *lindex_read_num(const char *s, size_t n) {
+  /* whole numbers of up to 15 digits are exact in a double, so this
+    gives what strtod would */
+  size_t d = (s[0] == '-' || s[0] == '+');
+  if (n - d <= 15 && memchr(s, '.', n) == NULL) {
+    double x = 0;
+    for (size_t i = d; i < n; i++) { x = x * 10 + (s[i] - '0'); }
+    return lval_num(s[0] == '-' ? -x : x);
+  }
+
+  char small[64];
+  char *t = n < sizeof(small) ? small : malloc(n + 1);
+  memcpy(t, s, n);
+  t[n] = '\0';
+  errno = 0;
+  double x = strtod(t, NULL);
+  if (t != small) { free(t); }
+  return errno != ERANGE ? lval_num(x) : lval_err("Invalid number");
+}
+
+/* reads the numbers and symbols in one run of token characters, the way
+  expr tries number before symbol, and gives the length of the run or 0
+  if the grammar rejects it */
+static size_t lindex_read_atoms(lstack *k, const unsigned char *c, const char *s) {
+  size_t p = 0;
+  while (c[(unsigned char)s[p]] < LCHAR_BRACKET) {
+    size_t q = p;
+    if (s[q] == '-' || s[q] == '+') { q++; }
+    if (s[q] >= '0' && s[q] <= '9') {
+      /* number : /(-|+)?[0-9]+(\.)?([0-9]+)?/ */
+      while (s[q] >= '0' && s[q] <= '9') { q++; }
+      if (s[q] == '.') { q++; }
+      while (s[q] >= '0' && s[q] <= '9') { q++; }
+      lstack_push(k, lindex_read_num(s + p, q - p));
+    } else {
+      q = p;
+      while (c[(unsigned char)s[q]] == LCHAR_SYMBOL) { q++; }
+      if (q == p) { return 0; }
+      char *sym = malloc(q - p + 1);
+      memcpy(sym, s + p, q - p);
+      sym[q - p] = '\0';
+      lstack_push(k, lval_sym_own(sym));
+    }
+    p = q;
+  }
+  return p;
+}
+
+/* stage 2 */
+lval *lval_read_index(const char *s) {
+  size_t n = strlen(s);
+  lindex x = lindex_build(s, n);
+  unsigned char c[256];
+  lstack k = { malloc(sizeof(lval*) * 64), 0, 64 };
+  lstack open = { malloc(sizeof(lval*) * 16), 0, 16 };
+  size_t *marks = malloc(sizeof(size_t) * 16);
+  int ok = 1;
+
+  lindex_classes(c);
+  /* the '\0' ending the input ends a token like a bracket would */
+  c[0] = LCHAR_BRACKET;
+
+  for (size_t i = 0; ok && i < x.blocks; i++) {
+    uint64_t bits = x.brackets[i] | x.starts[i];
+    while (ok && bits) {
+      size_t p = i * 64 + lindex_ctz(bits);
+      bits &= bits - 1;
+      switch (s[p]) {
+        case '(':
+        case '{':
+          if (open.count == open.slots) { marks = realloc(marks, sizeof(size_t) * open.slots * 2); }
+          marks[open.count] = k.count;
+          lstack_push(&open, s[p] == '(' ? lval_sexpr() : lval_qexpr());
+          break;
+        case ')':
+        case '}':
+          ok = open.count > 0 && open.vals[open.count-1]->type == (s[p] == ')' ? LVAL_SEXPR : LVAL_QEXPR);
+          if (ok) {
+            open.count--;
+            lstack_push(&k, lstack_close(&k, open.vals[open.count], marks[open.count]));
+          }
+          break;
+        default: ok = lindex_read_atoms(&k, c, s + p) > 0;
+      }
+    }
+  }
+
+  ok = ok && open.count == 0;
+  lval *root = ok ? lstack_close(&k, lval_sexpr(), 0) : NULL;
+
+  for (size_t i = 0; i < k.count; i++) { lval_del(k.vals[i]); }
+  for (size_t i = 0; i < open.count; i++) { lval_del(open.vals[i]); }
+  free(k.vals);
+  free(open.vals);
+  free(marks);
+  lindex_del(&x);
+  return root;
+}
+
+/* evaluate a file one top-level expression at a time as it is read
+   so that the whole file never has to be held in memory */
+void lval_eval_file(lenv *e, mpc_parser_t *Expr, char *filename) {
+  FILE *f = fopen(filename, "rb");
+  if (f == NULL) {
+    printf("Could not open file '%s'\n", filename);
+    return;
+  }
+
+  mpc_parser_t *Blank = mpc_whitespaces();
+  mpc_stream_t *s = mpc_stream_new(filename, f);
+  mpc_result_t r;
+
+  while(1) {
+    /* skip whitespace between expressions */
+    mpc_stream_parse(s, Blank, &r);
+    free(r.output);
+    if (mpc_stream_eof(s)) { break; }
+
+    if (mpc_stream_parse(s, Expr, &r)) {
+      lval *x = lval_eval(e, r.output);
+      if (x->type == LVAL_ERR) { lval_println(x); }
+      lval_del(x);
+    } else {
+      mpc_err_print(r.error);
+      mpc_err_delete(r.error);
+      break;
+    }
+  }
+
+  mpc_stream_delete(s);
+  mpc_delete(Blank);
+  fclose(f);
+}
+
 int main(int argc, char **argv) {
   /* setup grammar */
   mpc_parser_t *Number = mpc_new("number");
@@ -538,36 +851,44 @@ int main(int argc, char **argv) {
   mpc_parser_t *Expr = mpc_new("expr");
   mpc_parser_t *Lispy = mpc_new("lispy");
 
-  mpca_lang(MPC_LANG_DEFAULT,
-          " \
-          number    : /(-|+)?[0-9]+(\\.)?([0-9]+)?/; \
-          symbol    : /[a-zA-Z0-9_+\\-*\\/\\\\=<>!&]+/ ; \
-          sexpr     : '(' <expr>* ')' ; \
-          qexpr     : '{' <expr>* '}' ; \
-          expr      : <number> | <symbol> | <sexpr> | <qexpr> ; \
-          lispy     : /^/ <expr>* /$/; \
-          ",
-          Number, Symbol, Sexpr, Qexpr, Expr, Lispy);
-
-  puts("Lispy version 0.0.0.0.5");
-  puts("Press Ctrl+C to Exit\n");
+  lval_grammar(Number, Symbol, Sexpr, Qexpr, Expr, Lispy);
 
   lenv *e = lenv_new();
   lenv_add_builtins(e);
 
+  /* evaluate any files given on the command line instead of running the prompt */
+  if (argc >= 2) {
+    for (int i=1; i < argc; i++) {
+      lval_eval_file(e, Expr, argv[i]);
+    }
+    lenv_del(e);
+    mpc_cleanup(6, Number, Symbol, Sexpr, Qexpr, Expr, Lispy);
+    return 0;
+  }
+
+  puts("Lispy version 0.0.0.0.5");
+  puts("Press Ctrl+C to Exit\n");
+
   while(1) {
     char *input = readline("lispy> ");
     add_history(input);
 
-    mpc_result_t r;
-    if (mpc_parse("<stdin>", input, Lispy, &r)) {
-      lval *x = lval_eval(e, lval_read(r.output));
+    /* only inputs the grammar rejects miss the index reader, mpc
+      parses those again for the error message */
+    lval *x = lval_read_index(input);
+    if (x == NULL) {
+      mpc_result_t r;
+      if (mpc_parse("<stdin>", input, Lispy, &r)) {
+        x = r.output;
+      } else {
+        mpc_err_print(r.error);
+        mpc_err_delete(r.error);
+      }
+    }
+    if (x != NULL) {
+      x = lval_eval(e, x);
       lval_println(x);
       lval_del(x);
-      mpc_ast_delete(r.output);
-    } else {
-      mpc_err_print(r.error);
-      mpc_err_delete(r.error);
     }
     free(input);
   }